@@ -10,6 +10,7 @@
 #include <getopt.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
 
 // Local includes
 #include "vcsbeam.h"
@@ -20,8 +21,32 @@ struct fine_pfb_offline_opts {
     char              *datadir;          // The path to where the recombined data live
     char              *metafits;         // filename of the metafits file
     char              *coarse_chan_str;  // Absolute or relative coarse channel number
+    int                ncoarse_chans;    // The number of (contiguous) coarse channels to process
+    int                nthreads;         // The number of coarse channels/segments to process concurrently
+    int                nsegments;        // Split the seconds of each coarse channel into this many segments
+    int                nwriters;         // The number of background threads writing output files
+    int                read_ahead;       // The number of seconds to read ahead in the background (0 = none)
+    int                read_seconds;     // The maximum number of seconds to read at once
+    bool               use_mmap;         // Map the input files into memory instead of reading them
+    bool               skip_flagged;     // Don't read the RF inputs flagged in the metafits file
+    int                direct_io;        // The number of O_DIRECT reads to keep in flight (0 = don't use O_DIRECT)
+    char              *stage_dir;        // A local directory to stage the input files in (NULL = don't stage)
+    double             stage_size;       // The most GiB to have staged at once (per node)
+    int                stage_threads;    // The number of files to stage at once (per node)
+    int                zstd_threads;     // The number of threads decompressing the input files (0 = not compressed)
     char              *analysis_filter;  // Which analysis filter to use
     int                nchunks;          // Split each second into this many processing chunks
+    int                stride;           // The PFB stride, M (M < K means oversampled; 0 = critically sampled)
+    int                nchans;           // The number of output fine channels, K
+};
+
+struct fine_pfb_offline_worker {
+    vcsbeam_context   *vm;               // The (shared) parent context
+    vcsbeam_context   *cvm;              // This worker's channel context
+    write_queue       *wq;               // The (shared) queue for writing output files
+    int                nsegments;        // The number of time segments per coarse channel
+    int               *next_item;        // The next (coarse channel, segment) pair to be claimed by a worker
+    pthread_mutex_t   *next_item_mutex;  // Protects next_item
 };
 
 /***********************
@@ -30,6 +55,7 @@ struct fine_pfb_offline_opts {
 
 void usage();
 void fine_pfb_offline_parse_cmdline( int argc, char **argv, struct fine_pfb_offline_opts *opts );
+void *fine_pfb_offline_run_worker( void *arg );
 
 /********
  * MAIN *
@@ -46,8 +72,12 @@ int main( int argc, char *argv[] )
     vcsbeam_context *vm = vmInit( use_mpi );
 
     vmLoadObsMetafits( vm, opts.metafits );
+    // Compressed input files must be known about before binding the data
+    if (opts.zstd_threads > 0)
+        vmInitZstdReader( vm, opts.zstd_threads );
+
     vmBindObsData( vm,
-        opts.coarse_chan_str, 1, 0,
+        opts.coarse_chan_str, opts.ncoarse_chans, 0,
         opts.begin_str, opts.nseconds, 0,
         opts.datadir );
 
@@ -63,28 +93,98 @@ int main( int argc, char *argv[] )
     }
 
     // Load the filter
-    int K = 128; // The number of desired output channels
+    int K = opts.nchans; // The number of desired output channels
     vmLoadFilter( vm, opts.analysis_filter, ANALYSIS_FILTER, K );
 
-    // Create and init the PFB struct
-    int M = K; // The filter stride (M = K <=> "critically sampled PFB")
+    int M = (opts.stride > 0 ? opts.stride : K); // The filter stride (M = K <=> "critically sampled PFB")
     vm->chunks_per_second = opts.nchunks;
-    vmInitForwardPFB( vm, M, PFB_SMART | PFB_MALLOC_HOST_OUTPUT );
 
-    // Let's try it out on one second of data
-    char filename[128];
-    vm_error status;
-    while ((status = vmReadNextSecond( vm )) == VM_SUCCESS)
+    // Leave out the flagged RF inputs when reading (this is shared by all
+    // the workers)
+    if (opts.skip_flagged)
+        vmSetSkippedRFInputs( vm );
+
+    // Each worker reads into its own buffer, so the parent's is not needed
+    vmFreeVHost( vm );
+
+    // Each coarse channel's seconds can be split into (nearly) equal time
+    // segments, which are processed independently
+    int nsegments = opts.nsegments;
+    if (nsegments > vm->num_gps_seconds_to_process)
+        nsegments = vm->num_gps_seconds_to_process;
+
+    // Copy the input files to local storage ahead of time (this is also
+    // shared by all the workers)
+    if (opts.stage_dir != NULL)
+        vmInitStager( vm, opts.stage_dir, (size_t)(opts.stage_size * (1 << 30)), opts.stage_threads, nsegments );
+
+    // Set up a pool of workers, each of which claims (coarse channel, time
+    // segment) pairs in turn. The metadata and filter are shared between all
+    // workers.
+    int nitems = opts.ncoarse_chans * nsegments;
+    int nthreads = (opts.nthreads < nitems ? opts.nthreads : nitems);
+    int next_item = 0;
+    pthread_mutex_t next_item_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+    pthread_t threads[nthreads];
+    struct fine_pfb_offline_worker workers[nthreads];
+
+    write_queue *wq = NULL;
+
+    int t;
+    for (t = 0; t < nthreads; t++)
     {
-        // Actually do the PFB
-        vmExecuteForwardPFB( vm );
+        workers[t].vm              = vm;
+        workers[t].cvm             = vmInitChannelContext( vm );
+        workers[t].nsegments       = nsegments;
+        workers[t].next_item       = &next_item;
+        workers[t].next_item_mutex = &next_item_mutex;
+
+        // Create and init the PFB struct
+        vmInitForwardPFB( workers[t].cvm, M, PFB_SMART | PFB_MALLOC_HOST_OUTPUT );
+
+        // Read upcoming seconds in the background, map them straight into
+        // memory, or read several at once
+        if (opts.read_ahead > 0)
+            vmInitReadAhead( workers[t].cvm, opts.read_ahead );
+        if (opts.use_mmap)
+            vmInitMmapReader( workers[t].cvm );
+        if (opts.read_seconds > 1)
+            vmInitBatchReader( workers[t].cvm, opts.read_seconds );
+
+        // Bypass the page cache when reading
+        if (opts.direct_io > 0)
+            vmInitDirectReader( workers[t].cvm, opts.direct_io );
+
+        // Output files are written in the background. Give the queue enough
+        // buffers that every worker can have one second in flight, plus one
+        // being written by each writer.
+        if (wq == NULL)
+            wq = vmInitWriteQueue( workers[t].cvm->fpfb->vcs_size, nthreads + opts.nwriters, opts.nwriters );
+        workers[t].wq = wq;
+    }
 
-        // Write out the answer to a file
-        vmWritePFBOutputToFile( vm );
+    for (t = 0; t < nthreads; t++)
+    {
+        if (pthread_create( &threads[t], NULL, fine_pfb_offline_run_worker, &workers[t] ) != 0)
+        {
+            fprintf( stderr, "error: could not create worker thread #%d\n", t );
+            exit(EXIT_FAILURE);
+        }
     }
 
-    // Report performance statistics
-    vmReportPerformanceStats( vm );
+    for (t = 0; t < nthreads; t++)
+        pthread_join( threads[t], NULL );
+
+    // Wait for all the output to be written
+    vmFreeWriteQueue( wq );
+
+    // Report performance statistics, and free the workers
+    for (t = 0; t < nthreads; t++)
+    {
+        vmReportPerformanceStats( workers[t].cvm );
+        vmDestroyChannelContext( workers[t].cvm );
+    }
 
     // Free memory
     destroy_vcsbeam_context( vm );
@@ -97,6 +197,55 @@ int main( int argc, char *argv[] )
  * FUNCTION DEFINITIONS *
  ************************/
 
+void *fine_pfb_offline_run_worker( void *arg )
+{
+    struct fine_pfb_offline_worker *w = (struct fine_pfb_offline_worker *)arg;
+
+    int nseconds = w->vm->num_gps_seconds_to_process;
+    int item, c, seg, first, last;
+    while (1)
+    {
+        // Claim the next unprocessed (coarse channel, segment) pair
+        pthread_mutex_lock( w->next_item_mutex );
+        item = (*w->next_item)++;
+        pthread_mutex_unlock( w->next_item_mutex );
+
+        if (item >= w->vm->num_coarse_chans_to_process * w->nsegments)
+            break;
+
+        c   = item / w->nsegments;
+        seg = item % w->nsegments;
+
+        // The seconds [first, last) in this segment
+        first = (seg * nseconds) / w->nsegments;
+        last  = ((seg + 1) * nseconds) / w->nsegments;
+
+        vmSetChannelContextCoarseChan( w->cvm, w->vm, c );
+
+        // Segments after the first one overlap the previous segment by one
+        // second, which is only used to fill the filter history
+        if (first > 0)
+        {
+            vmSetChannelContextSeconds( w->cvm, w->vm, first - 1, last - first + 1 );
+            vmCheckError( vmReadNextSecond( w->cvm ) );
+            vmPrimeForwardPFB( w->cvm );
+        }
+        else
+            vmSetChannelContextSeconds( w->cvm, w->vm, first, last - first );
+
+        while (vmReadNextSecond( w->cvm ) == VM_SUCCESS)
+        {
+            // Actually do the PFB
+            vmExecuteForwardPFB( w->cvm );
+
+            // Hand the answer over to be written out to file
+            vmWritePFBOutputToQueue( w->cvm, w->wq );
+        }
+    }
+
+    return NULL;
+}
+
 void usage()
 {
     printf( "\nusage: fine_pfb_offline [OPTIONS]\n");
@@ -117,8 +266,42 @@ void usage()
             "\t                           relative to the first or last channel in the observation\n"
             "\t                           respectively. Otherwise, it is treated as a receiver channel number\n"
             "\t                           (0-255) [default: \"+0\"]\n"
+            "\t-N, --ncoarse-chans=VAL    Process VAL contiguous coarse channels, starting at CHAN\n"
+            "\t                           [default: 1]\n"
+            "\t-s, --nsegments=VAL        Split the seconds of each coarse channel into VAL segments that\n"
+            "\t                           can be processed concurrently [default: 1]\n"
+            "\t-t, --nthreads=VAL         Process up to VAL coarse channels/segments concurrently. Each\n"
+            "\t                           thread needs its own host and GPU buffers [default: 1]\n"
+            "\t-W, --nwriters=VAL         Write output files with VAL background threads [default: 1]\n"
+            "\t-r, --read-ahead=VAL       Read up to VAL seconds ahead in a background thread, so that reading\n"
+            "\t                           overlaps with processing. Each thread needs VAL extra host buffers\n"
+            "\t                           [default: 0, i.e. read each second only when it is needed]\n"
+            "\t-L, --read-seconds=VAL     Read up to VAL consecutive seconds at once, which is more efficient\n"
+            "\t                           on parallel filesystems. Needs VAL seconds' worth of host memory.\n"
+            "\t                           Cannot be used with -r or -Z [default: 1]\n"
+            "\t-Z, --mmap                 Map the input files straight into memory instead of copying each\n"
+            "\t                           second out of them. Cannot be used with -r or -L [default: off]\n"
+            "\t-D, --direct-io=VAL        Read the input files with O_DIRECT, bypassing the page cache, and keep\n"
+            "\t                           up to VAL reads in flight at once (for MWAX only). Has no effect with\n"
+            "\t                           -Z or -k [default: 0, i.e. read via the page cache]\n"
+            "\t-l, --stage-dir=DIR        Copy the input files to DIR (e.g. node-local scratch) in the background,\n"
+            "\t                           ahead of when they are needed, and read them from there [default: off]\n"
+            "\t-g, --stage-size=GIB       Keep at most GIB GiB of input files in the -l directory at once\n"
+            "\t                           [default: 32]\n"
+            "\t-j, --stage-threads=VAL    Copy up to VAL files to the -l directory at once [default: 2]\n"
+            "\t-z, --zstd=VAL             The input files are zstd-compressed (as VOLTFILE.zst, in the seekable\n"
+            "\t                           format). Decompress them with VAL threads. Cannot be used with -Z, -D,\n"
+            "\t                           or -l [default: 0, i.e. not compressed]\n"
+            "\t-k, --skip-flagged         Don't read the RF inputs flagged in the metafits file; their\n"
+            "\t                           output is set to zero instead [default: off]\n"
             "\t-A, --analysis_filter=FILTER  Apply the named filter during fine channelisation.\n"
             "\t                           File [RUNTIME_DIR]/FILTER.dat must exist [default: FINEPFB]\n"
+            "\t-K, --nchans=VAL           Channelise each coarse channel into VAL fine channels. The\n"
+            "\t                           analysis filter is resampled to suit [default: 128]\n"
+            "\t-M, --stride=VAL           Use a PFB stride of VAL samples. Values less than the number of\n"
+            "\t                           output channels (K) produce an oversampled PFB. VAL must divide\n"
+            "\t                           evenly into the number of samples per second\n"
+            "\t                           [default: K, i.e. critically sampled]\n"
             "\t-T, --nseconds=VAL         Process VAL seconds of data [default: as many as possible]\n"
             "\t-n, --nchunks=VAL          Split each second's worth of data into VAL processing chunks\n"
             "\t                           [default: 1]\n"
@@ -138,8 +321,23 @@ void fine_pfb_offline_parse_cmdline( int argc, char **argv, struct fine_pfb_offl
     opts->datadir            = NULL;  // The path to where the recombined data live
     opts->metafits           = NULL;  // filename of the metafits file for the target observation
     opts->coarse_chan_str    = NULL;  // Absolute or relative coarse channel
+    opts->ncoarse_chans      = 1;
+    opts->nthreads           = 1;
+    opts->nsegments          = 1;
+    opts->nwriters           = 1;
+    opts->read_ahead         = 0;
+    opts->use_mmap           = false;
+    opts->skip_flagged       = false;
+    opts->read_seconds       = 1;
+    opts->direct_io          = 0;
+    opts->stage_dir          = NULL;
+    opts->stage_size         = 32.0;
+    opts->stage_threads      = 2;
+    opts->zstd_threads       = 0;
     opts->analysis_filter    = NULL;
     opts->nchunks            = 1;
+    opts->stride             = 0;
+    opts->nchans             = FILTER_NATIVE_NCHANS;
 
     if (argc > 1) {
 
@@ -150,17 +348,32 @@ void fine_pfb_offline_parse_cmdline( int argc, char **argv, struct fine_pfb_offl
                 {"analysis_filter", required_argument, 0, 'A'},
                 {"begin",           required_argument, 0, 'b'},
                 {"data-location",   required_argument, 0, 'd'},
+                {"direct-io",       required_argument, 0, 'D'},
+                {"stage-dir",       required_argument, 0, 'l'},
+                {"stage-size",      required_argument, 0, 'g'},
+                {"stage-threads",   required_argument, 0, 'j'},
+                {"zstd",            required_argument, 0, 'z'},
                 {"coarse-chan",     required_argument, 0, 'f'},
                 {"help",            required_argument, 0, 'h'},
+                {"skip-flagged",    no_argument,       0, 'k'},
+                {"nchans",          required_argument, 0, 'K'},
                 {"metafits",        required_argument, 0, 'm'},
+                {"stride",          required_argument, 0, 'M'},
                 {"nchunks",         required_argument, 0, 'n'},
+                {"ncoarse-chans",   required_argument, 0, 'N'},
+                {"read-ahead",      required_argument, 0, 'r'},
+                {"read-seconds",    required_argument, 0, 'L'},
+                {"nsegments",       required_argument, 0, 's'},
+                {"nthreads",        required_argument, 0, 't'},
+                {"nwriters",        required_argument, 0, 'W'},
                 {"nseconds",        required_argument, 0, 'T'},
-                {"version",         required_argument, 0, 'V'}
+                {"version",         required_argument, 0, 'V'},
+                {"mmap",            no_argument,       0, 'Z'}
             };
 
             int option_index = 0;
             c = getopt_long( argc, argv,
-                             "A:b:d:f:hm:n:T:V",
+                             "A:b:d:D:f:g:hj:kK:l:L:m:M:n:N:r:s:t:T:VW:z:Z",
                              long_options, &option_index);
             if (c == -1)
                 break;
@@ -179,21 +392,118 @@ void fine_pfb_offline_parse_cmdline( int argc, char **argv, struct fine_pfb_offl
                     opts->datadir = (char *)malloc( strlen(optarg) + 1 );
                     strcpy( opts->datadir, optarg );
                     break;
+                case 'D':
+                    opts->direct_io = atoi(optarg);
+                    if (opts->direct_io < 0)
+                    {
+                        fprintf( stderr, "error: fine_pfb_offline_parse_cmdline: "
+                                "-%c argument must be >= 0\n", c );
+                        exit(EXIT_FAILURE);
+                    }
+                    break;
                 case 'f':
                     opts->coarse_chan_str = (char *)malloc( strlen(optarg) + 1 );
                     strcpy( opts->coarse_chan_str, optarg );
                     break;
+                case 'g':
+                    opts->stage_size = atof(optarg);
+                    if (opts->stage_size <= 0.0)
+                    {
+                        fprintf( stderr, "error: fine_pfb_offline_parse_cmdline: "
+                                "-%c argument must be > 0\n", c );
+                        exit(EXIT_FAILURE);
+                    }
+                    break;
                 case 'h':
                     usage();
                     exit(EXIT_SUCCESS);
                     break;
+                case 'j':
+                    opts->stage_threads = atoi(optarg);
+                    if (opts->stage_threads <= 0)
+                    {
+                        fprintf( stderr, "error: fine_pfb_offline_parse_cmdline: "
+                                "-%c argument must be >= 1\n", c );
+                        exit(EXIT_FAILURE);
+                    }
+                    break;
+                case 'k':
+                    opts->skip_flagged = true;
+                    break;
+                case 'K':
+                    opts->nchans = atoi(optarg);
+                    if (opts->nchans <= 0)
+                    {
+                        fprintf( stderr, "error: fine_pfb_offline_parse_cmdline: "
+                                "-%c argument must be >= 1\n", c );
+                        exit(EXIT_FAILURE);
+                    }
+                    break;
+                case 'l':
+                    opts->stage_dir = (char *)malloc( strlen(optarg) + 1 );
+                    strcpy( opts->stage_dir, optarg );
+                    break;
+                case 'L':
+                    opts->read_seconds = atoi(optarg);
+                    if (opts->read_seconds <= 0)
+                    {
+                        fprintf( stderr, "error: fine_pfb_offline_parse_cmdline: "
+                                "-%c argument must be >= 1\n", c );
+                        exit(EXIT_FAILURE);
+                    }
+                    break;
                 case 'm':
                     opts->metafits = (char *)malloc( strlen(optarg) + 1 );
                     strcpy( opts->metafits, optarg );
                     break;
+                case 'M':
+                    opts->stride = atoi(optarg);
+                    if (opts->stride <= 0)
+                    {
+                        fprintf( stderr, "error: fine_pfb_offline_parse_cmdline: "
+                                "-%c argument must be >= 1\n", c );
+                        exit(EXIT_FAILURE);
+                    }
+                    break;
                 case 'n':
                     opts->nchunks = atoi(optarg);
                     break;
+                case 'N':
+                    opts->ncoarse_chans = atoi(optarg);
+                    if (opts->ncoarse_chans <= 0)
+                    {
+                        fprintf( stderr, "error: fine_pfb_offline_parse_cmdline: "
+                                "-%c argument must be >= 1\n", c );
+                        exit(EXIT_FAILURE);
+                    }
+                    break;
+                case 'r':
+                    opts->read_ahead = atoi(optarg);
+                    if (opts->read_ahead < 0)
+                    {
+                        fprintf( stderr, "error: fine_pfb_offline_parse_cmdline: "
+                                "-%c argument must be >= 0\n", c );
+                        exit(EXIT_FAILURE);
+                    }
+                    break;
+                case 's':
+                    opts->nsegments = atoi(optarg);
+                    if (opts->nsegments <= 0)
+                    {
+                        fprintf( stderr, "error: fine_pfb_offline_parse_cmdline: "
+                                "-%c argument must be >= 1\n", c );
+                        exit(EXIT_FAILURE);
+                    }
+                    break;
+                case 't':
+                    opts->nthreads = atoi(optarg);
+                    if (opts->nthreads <= 0)
+                    {
+                        fprintf( stderr, "error: fine_pfb_offline_parse_cmdline: "
+                                "-%c argument must be >= 1\n", c );
+                        exit(EXIT_FAILURE);
+                    }
+                    break;
                 case 'T':
                     opts->nseconds = atol(optarg);
                     if (opts->nseconds <= 0)
@@ -207,6 +517,27 @@ void fine_pfb_offline_parse_cmdline( int argc, char **argv, struct fine_pfb_offl
                     printf( "MWA Beamformer %s\n", VCSBEAM_VERSION);
                     exit(0);
                     break;
+                case 'W':
+                    opts->nwriters = atoi(optarg);
+                    if (opts->nwriters <= 0)
+                    {
+                        fprintf( stderr, "error: fine_pfb_offline_parse_cmdline: "
+                                "-%c argument must be >= 1\n", c );
+                        exit(EXIT_FAILURE);
+                    }
+                    break;
+                case 'z':
+                    opts->zstd_threads = atoi(optarg);
+                    if (opts->zstd_threads < 0)
+                    {
+                        fprintf( stderr, "error: fine_pfb_offline_parse_cmdline: "
+                                "-%c argument must be >= 0\n", c );
+                        exit(EXIT_FAILURE);
+                    }
+                    break;
+                case 'Z':
+                    opts->use_mmap = true;
+                    break;
                 default:
                     fprintf( stderr, "error: fine_pfb_offline_parse_cmdline: "
                             "unrecognised option '%s'\n", optarg );
@@ -360,13 +360,7 @@ void write_step( mpi_psrfits *mpf, logger *log )
         // Write second's worth of data to file
         logger_start_stopwatch( log, "write", true );
 
-        if (psrfits_write_subint( &(mpf->spliced_pf) ) != 0)
-        {
-            fprintf(stderr, "error: Write PSRFITS subint failed. File exists?\n");
-            exit(EXIT_FAILURE);
-        }
-        mpf->spliced_pf.sub.offs = roundf(mpf->spliced_pf.tot_rows * mpf->spliced_pf.sub.tsubint) + 0.5*mpf->spliced_pf.sub.tsubint;
-        mpf->spliced_pf.sub.lst += mpf->spliced_pf.sub.tsubint;
+        vmWriteSplicedPsrfits( mpf );
 
         logger_stop_stopwatch( log, "write" );
     }
@@ -37,6 +37,11 @@ struct make_tied_array_beam_opts {
     bool               out_fine;         // Output fine channelised data (PSRFITS)
     bool               out_coarse;       // Output coarse channelised data (VDIF)
     int                out_nstokes;      // Number of stokes parameters in PSRFITS output
+    int                out_nbits;        // Number of bits per sample in PSRFITS output
+    int                filterbank_nbits; // Write SIGPROC filterbank (with this many bits) instead of PSRFITS (0 = don't)
+    int                telescope_id;     // The SIGPROC telescope_id written in filterbank headers
+    int                shm_blocks;       // Write to shared memory ring buffers of this many seconds instead of to disk (0 = don't)
+    bool               mpi_io;           // Have every rank write its own channels into the PSRFITS files
 
     // Calibration options
     char              *cal_metafits;     // Filename of the metafits file
@@ -53,9 +58,19 @@ struct make_tied_array_beam_opts {
     // Other options
     char              *analysis_filter;  // Which analysis filter to use
     char              *synth_filter;     // Which synthesis filter to use
+    int                nchans;           // The number of fine channels to make (MWAX only)
     bool               smart;            // Use legacy settings for PFB
     int                max_sec_per_file; // Number of seconds per fits files
     int                nchunks;          // Split each second into this many processing chunks
+    int                read_ahead;       // The number of seconds to read ahead in the background (0 = none)
+    int                read_seconds;     // The maximum number of seconds to read at once
+    bool               use_mmap;         // Map the input files into memory instead of reading them (MWAX only)
+    bool               skip_flagged;     // Don't read the RF inputs of flagged tiles (MWAX only)
+    int                direct_io;        // The number of O_DIRECT reads to keep in flight (0 = don't use O_DIRECT)
+    char              *stage_dir;        // A local directory to stage the input files in (NULL = don't stage)
+    double             stage_size;       // The most GiB to have staged at once (per node)
+    int                stage_threads;    // The number of files to stage at once (per node)
+    int                zstd_threads;     // The number of threads decompressing the input files (0 = not compressed)
 };
 
 /***********************
@@ -66,7 +81,7 @@ void usage();
 void make_tied_array_beam_parse_cmdline( int argc, char **argv, struct make_tied_array_beam_opts *opts );
 
 void write_step( vcsbeam_context *vm, mpi_psrfits *mpfs,
-        struct vdifinfo *vf, vdif_header *vhdr, float *data_buffer_vdif );
+        struct vdifinfo *vf, float *data_buffer_vdif );
 
 /********
  * MAIN *
@@ -89,6 +104,10 @@ int main(int argc, char **argv)
     vmLoadObsMetafits( vm, opts.metafits );
     vmLoadCalMetafits( vm, opts.cal_metafits );
 
+    // Compressed input files must be known about before binding the data
+    if (opts.zstd_threads > 0)
+        vmInitZstdReader( vm, opts.zstd_threads );
+
     vmBindObsData( vm,
         opts.coarse_chan_str, 1, vm->mpi_rank,
         opts.begin_str, opts.nseconds, 0,
@@ -101,14 +120,35 @@ int main(int argc, char **argv)
         vmSetOutputChannelisation( vm, opts.out_fine, opts.out_coarse );
     }
 
+    // Copy the input files to local storage ahead of time
+    if (opts.stage_dir != NULL)
+        vmInitStager( vm, opts.stage_dir, (size_t)(opts.stage_size * (1 << 30)), opts.stage_threads, 1 );
+
+    // Read upcoming seconds in the background
+    if (opts.read_ahead > 0)
+        vmInitReadAhead( vm, opts.read_ahead );
+
+    // Or map them straight into memory
+    if (opts.use_mmap)
+        vmInitMmapReader( vm );
+
+    // Or read several seconds at once
+    if (opts.read_seconds > 1)
+        vmInitBatchReader( vm, opts.read_seconds );
+
+    // Bypass the page cache when reading
+    if (opts.direct_io > 0)
+        vmInitDirectReader( vm, opts.direct_io );
+
     // Set up case for stokes output and number of chunks per second of data
     vm->out_nstokes = opts.out_nstokes;
+    vm->out_nbits   = opts.out_nbits;
     vm->chunks_per_second = opts.nchunks;
     // If we need to, set up the forward PFB
     if (vm->do_forward_pfb)
     {
         // Load the filter
-        int K = 128; // The number of desired output channels
+        int K = opts.nchans; // The number of desired output channels
         vmLoadFilter( vm, opts.analysis_filter, ANALYSIS_FILTER, K );
 
         // Create and init the PFB struct
@@ -151,8 +191,6 @@ int main(int argc, char **argv)
     uintptr_t npols          = vm->obs_metadata->num_ant_pols;
     unsigned int nsamples    = vm->fine_sample_rate;
 
-    gpuDoubleComplex  *data_buffer_fine;
-
     if (vm->do_inverse_pfb)
     {
         // Load the (synthesis) PFB filter:
@@ -161,11 +199,6 @@ int main(int argc, char **argv)
         // PFB, feel is appropriate.
         vmLoadFilter( vm, opts.synth_filter, SYNTHESIS_FILTER, nchans );
         vmScaleFilterCoeffs( vm, SYNTHESIS_FILTER, 15.0/7.2 ); // (1/7.2) = 16384/117964.8
-
-        // Allocate memory for voltage buffer that will be used to perform the IPFB
-        // The buffer is 2 seconds long to allow the synthesis filter to operate over
-        // the transition between seconds
-        data_buffer_fine = create_data_buffer_fine( vm->npointing, 2*nsamples, nchans, npols );
     }
 
     /*********************
@@ -178,7 +211,6 @@ int main(int argc, char **argv)
 
     vmMallocVDevice( vm );
     vmMallocJVDevice( vm );
-    vmMallocEHost( vm );
     vmMallocEDevice( vm );
     vmMallocSHost( vm );
     vmMallocSDevice( vm );
@@ -213,6 +245,17 @@ int main(int argc, char **argv)
         {
             vmInitMPIPsrfits( vm, &(mpfs[p]), opts.max_sec_per_file, opts.out_nstokes,
                     &(beam_geom_vals[p]), NULL, true );
+
+            if (vm->mpi_rank == mpfs[p].writer_id)
+            {
+                if (opts.shm_blocks > 0)
+                    vmInitPsrfitsShm( &(mpfs[p]), opts.shm_blocks );
+                else if (opts.filterbank_nbits > 0)
+                    vmInitFilterbank( &(mpfs[p]), opts.filterbank_nbits, opts.telescope_id );
+            }
+
+            if (opts.mpi_io)
+                vmInitMPIIOPsrfits( vm, &(mpfs[p]) );
         }
     }
 
@@ -227,6 +270,11 @@ int main(int argc, char **argv)
     parse_calibration_correction_file( vm->obs_metadata->obs_id, &vm->cal );
     vmApplyCalibrationCorrections( vm );
 
+    // Tiles that are flagged (i.e. have all-zero calibration solutions)
+    // need not be read from disk
+    if (opts.skip_flagged)
+        vmSetSkippedRFInputs( vm );
+
     // ------------------
     // Prepare primary beam and geometric delay arrays
     // ------------------
@@ -239,6 +287,16 @@ int main(int argc, char **argv)
     // Populate the relevant header structs
     vmPopulateVDIFHeader( vm, beam_geom_vals, mjd_start, sec_offset );
 
+    // Open the VDIF files once, with room for one second of every pointing
+    // to be waiting to be written (or the shared memory, if requested)
+    if (vm->output_coarse_channels)
+    {
+        if (opts.shm_blocks > 0)
+            vmOpenVDIFShm( vm, opts.shm_blocks );
+        else
+            vmOpenVDIFFiles( vm, vm->npointing );
+    }
+
     // Begin the main loop: go through data one second at a time
 
     logger_message( vm->log, "\n*****BEGIN BEAMFORMING*****" );
@@ -266,7 +324,7 @@ int main(int argc, char **argv)
         // has terminated
         if (timestep_idx > 0) // i.e. don't do this the first time around
         {
-            write_step( vm, mpfs, vm->vf, &vm->vhdr, data_buffer_vdif );
+            write_step( vm, mpfs, vm->vf, data_buffer_vdif );
         }
 
         // Do the forward PFB (if needed), and form the beams
@@ -277,14 +335,9 @@ int main(int argc, char **argv)
         {
             logger_start_stopwatch( vm->log, "ipfb", true );
 
-            vmPullE( vm );
-
-            // Load the voltage data into the buffer
-            prepare_data_buffer_fine( data_buffer_fine, vm, timestep_idx );
-
-            // Run the iPFB kernel
-            cu_invert_pfb( data_buffer_fine, timestep_idx, vm->npointing,
-                    nsamples, nchans, npols, vm->vf->sizeof_buffer,
+            // Run the iPFB kernel directly on the beamformed voltages
+            // (which are still on the GPU)
+            cu_invert_pfb( vm->d_e, vm->npointing, nsamples, nchans, npols,
                     &gi, data_buffer_vdif );
 
             logger_stop_stopwatch( vm->log, "ipfb" );
@@ -300,7 +353,9 @@ int main(int argc, char **argv)
 
             for (p = 0; p < vm->npointing; p++)
             {
-                gather_splice_psrfits( &(mpfs[p]) );
+                // (With MPI-IO, each rank writes its own channels instead)
+                if (mpfs[p].mpiio == NULL)
+                    gather_splice_psrfits( &(mpfs[p]) );
             }
 
             logger_stop_stopwatch( vm->log, "splice" );
@@ -308,7 +363,16 @@ int main(int argc, char **argv)
     }
 
     // Write out the last second's worth of data
-    write_step( vm, mpfs, vm->vf, &vm->vhdr, data_buffer_vdif );
+    write_step( vm, mpfs, vm->vf, data_buffer_vdif );
+
+    // Wait for the VDIF files to be written out
+    if (vm->output_coarse_channels)
+    {
+        if (opts.shm_blocks > 0)
+            vmCloseVDIFShm( vm );
+        else
+            vmCloseVDIFFiles( vm );
+    }
 
     logger_message( vm->log, "\n*****END BEAMFORMING*****\n" );
 
@@ -333,11 +397,6 @@ int main(int argc, char **argv)
     // Free up memory
     logger_timed_message( vm->log, "Starting clean-up" );
 
-    if (vm->do_inverse_pfb)
-    {
-        free( data_buffer_fine );
-    }
-
     if (vm->do_inverse_pfb)
     {
         gpuHostFree( data_buffer_vdif  );
@@ -352,10 +411,10 @@ int main(int argc, char **argv)
     free( opts.custom_flags    );
     free( opts.metafits        );
     free( opts.synth_filter    );
+    free( opts.stage_dir       );
 
     vmFreeVDevice( vm );
     vmFreeJVDevice( vm );
-    vmFreeEHost( vm );
     vmFreeEDevice( vm );
     vmFreeSHost( vm );
     vmFreeSDevice( vm );
@@ -400,6 +459,8 @@ void usage()
     printf( "\nCHANNELISATION OPTIONS\n\n"
             "\t-A, --analysis_filter=FILTER  Apply the named filter during fine channelisation (for MWAX only).\n"
             "\t                           [default: FINEPFB]\n"
+            "\t-K, --nchans=VAL           Channelise each coarse channel into VAL fine channels (for MWAX only).\n"
+            "\t                           The analysis and synthesis filters are resampled to suit [default: 128]\n"
             "\t-s, --smart                Use legacy settings for fine channelisation [default: off]\n"
             "\t-S, --synth_filter=FILTER  Apply the named filter during high-time resolution synthesis.\n"
             "\t                           FILTER can be MIRROR or LSQ12.\n"
@@ -425,6 +486,23 @@ void usage()
             "\t-p, --out-fine             Output fine-channelised, full-Stokes data (PSRFITS)\n"
             "\t                           (if neither -p nor -v are used, default behaviour is to match channelisation of input)\n"
             "\t-N, --out-nstokes          Number of stokes parameters to output. Either 1 (stokes I only) or 4 (stokes IQUV)\n"
+            "\t-Q, --out-nbits=VAL        Number of bits per sample in the PSRFITS output. Either 1, 2, or 4 (digitised\n"
+            "\t                           about each channel's mean, with levels spaced to suit its standard deviation)\n"
+            "\t                           or 8 (scaled between each channel's minimum and maximum) [default: 8]\n"
+            "\t-I, --filterbank=NBITS     Write the fine-channelised, Stokes I data as SIGPROC filterbank (.fil) files\n"
+            "\t                           instead of PSRFITS, with NBITS (8 or 32) bits per sample. 8-bit samples are\n"
+            "\t                           digitised with fixed levels for each channel, set from the first second.\n"
+            "\t                           Implies -p and -N 1\n"
+            "\t-y, --telescope-id=ID      The SIGPROC telescope_id to write in filterbank headers. Set this to whatever\n"
+            "\t                           ID the downstream tools (e.g. for barycentring) take to be the MWA\n"
+            "\t                           [default: 0 (\"fake\")]\n"
+            "\t-W, --shm=VAL              Instead of writing to disk, write each second of output into a POSIX shared\n"
+            "\t                           memory ring buffer of VAL seconds (/dev/shm/[basename].dada for PSRFITS-style\n"
+            "\t                           detected data, /dev/shm/[basename].vdif for VDIF), for processes on the same\n"
+            "\t                           node to read. Cannot be used with -I [default: off]\n"
+            "\t-M, --mpi-io               Have every process write its own channels directly into the PSRFITS files\n"
+            "\t                           (with MPI-IO), instead of sending them all to one process to be written.\n"
+            "\t                           Cannot be used with -I or -W [default: off]\n"
             "\t-t, --max_t                Maximum number of seconds per output FITS file. [default: 200]\n"
             "\t-v, --out-coarse           Output coarse-channelised, 2-pol (XY) data (VDIF)\n"
             "\t                           (if neither -p nor -v are used, default behaviour is to match channelisation of input)\n"
@@ -450,11 +528,33 @@ void usage()
             "\t                                exp(PH*F + OFFS)\n"
             "\t                           Setting PH = OFFS = 0 is equivalent to not performing any phase correction\n"
             "\t-X, --cross-terms          Retain the PQ and QP terms of the calibration solution [default: off]\n"
+            "\t-k, --skip-flagged         Don't read the data for flagged tiles (i.e. those whose calibration\n"
+            "\t                           solutions are all zero) from disk (for MWAX only) [default: off]\n"
           );
 
     printf( "\nMEMORY OPTIONS\n\n"
             "\t-n, --nchunks=VAL          Split each second's worth of data into VAL processing chunks\n"
             "\t                           [default: 1]\n"
+            "\t-r, --read-ahead=VAL       Read up to VAL seconds ahead in a background thread, so that reading\n"
+            "\t                           overlaps with processing. This needs VAL extra host buffers\n"
+            "\t                           [default: 0, i.e. read each second only when it is needed]\n"
+            "\t-L, --read-seconds=VAL     Read up to VAL consecutive seconds at once, which is more efficient\n"
+            "\t                           on parallel filesystems. Needs VAL seconds' worth of host memory.\n"
+            "\t                           Cannot be used with -r or -Z [default: 1]\n"
+            "\t-Z, --mmap                 Map the input files straight into memory instead of copying each\n"
+            "\t                           second out of them (for MWAX only). Cannot be used with -r or -L [default: off]\n"
+            "\t-D, --direct-io=VAL        Read the input files with O_DIRECT, bypassing the page cache, and keep\n"
+            "\t                           up to VAL reads in flight at once (for MWAX only). Has no effect with\n"
+            "\t                           -Z or -k [default: 0, i.e. read via the page cache]\n"
+            "\t-l, --stage-dir=DIR        Copy the input files to DIR (e.g. node-local scratch) in the background,\n"
+            "\t                           ahead of when they are needed, and read them from there [default: off]\n"
+            "\t-g, --stage-size=GIB       Keep at most GIB GiB of input files in the -l directory at once. This\n"
+            "\t                           is shared between all the ranks on a node [default: 32]\n"
+            "\t-j, --stage-threads=VAL    Copy up to VAL files to the -l directory at once. This is shared\n"
+            "\t                           between all the ranks on a node [default: 2]\n"
+            "\t-z, --zstd=VAL             The input files are zstd-compressed (as VOLTFILE.zst, in the seekable\n"
+            "\t                           format). Decompress them with VAL threads. Cannot be used with -Z, -D,\n"
+            "\t                           or -l [default: 0, i.e. not compressed]\n"
           );
 
     printf( "\nOTHER OPTIONS\n\n"
@@ -478,11 +578,26 @@ void make_tied_array_beam_parse_cmdline(
     opts->out_fine             = false; // Output fine channelised data (PSRFITS)
     opts->out_coarse           = false; // Output coarse channelised data (VDIF)
     opts->out_nstokes          = 4;     // Output stokes IQUV by default
+    opts->out_nbits            = 8;     // Output 8-bit samples by default
+    opts->filterbank_nbits     = 0;     // Write PSRFITS by default
+    opts->telescope_id         = FILTERBANK_TELESCOPE_ID;
+    opts->shm_blocks           = 0;     // Write to disk by default
+    opts->mpi_io               = false; // Write PSRFITS from a single process by default
     opts->analysis_filter      = NULL;
     opts->synth_filter         = NULL;
+    opts->nchans               = FILTER_NATIVE_NCHANS;
     opts->max_sec_per_file     = 200;   // Number of seconds per fits files
     opts->custom_flags         = NULL;
     opts->nchunks              = 1;
+    opts->read_ahead           = 0;
+    opts->use_mmap             = false;
+    opts->skip_flagged         = false;
+    opts->read_seconds         = 1;
+    opts->direct_io            = 0;
+    opts->stage_dir            = NULL;
+    opts->stage_size           = 32.0;
+    opts->stage_threads        = 2;
+    opts->zstd_threads         = 0;
     opts->smart                = false;
 
     opts->cal_metafits         = NULL;  // filename of the metafits file for the calibration observation
@@ -506,9 +621,16 @@ void make_tied_array_beam_parse_cmdline(
                 {"out-fine",        no_argument,       0, 'p'},
                 {"out-coarse",      no_argument,       0, 'v'},
                 {"out-nstokes",     no_argument,       0, 'N'},
+                {"out-nbits",       required_argument, 0, 'Q'},
+                {"filterbank",      required_argument, 0, 'I'},
+                {"telescope-id",    required_argument, 0, 'y'},
+                {"shm",             required_argument, 0, 'W'},
+                {"mpi-io",          no_argument,       0, 'M'},
                 {"max_t",           required_argument, 0, 't'},
                 {"analysis_filter", required_argument, 0, 'A'},
                 {"synth_filter",    required_argument, 0, 'S'},
+                {"skip-flagged",    no_argument,       0, 'k'},
+                {"nchans",          required_argument, 0, 'K'},
                 {"nseconds",        required_argument, 0, 'T'},
                 {"pointings",       required_argument, 0, 'P'},
                 {"data-location",   required_argument, 0, 'd'},
@@ -522,14 +644,22 @@ void make_tied_array_beam_parse_cmdline(
                 {"PQ-phase",        required_argument, 0, 'U'},
                 {"offringa",        no_argument      , 0, 'O'},
                 {"nchunks",         required_argument, 0, 'n'},
+                {"read-ahead",      required_argument, 0, 'r'},
+                {"read-seconds",    required_argument, 0, 'L'},
+                {"direct-io",       required_argument, 0, 'D'},
+                {"stage-dir",       required_argument, 0, 'l'},
+                {"stage-size",      required_argument, 0, 'g'},
+                {"stage-threads",   required_argument, 0, 'j'},
+                {"zstd",            required_argument, 0, 'z'},
                 {"smart",           no_argument,       0, 's'},
                 {"help",            required_argument, 0, 'h'},
-                {"version",         required_argument, 0, 'V'}
+                {"version",         required_argument, 0, 'V'},
+                {"mmap",            no_argument,       0, 'Z'}
             };
 
             int option_index = 0;
             c = getopt_long( argc, argv,
-                             "A:b:Bc:C:d:e:f:F:hm:n:N:OpP:R:sS:t:T:U:vVX",
+                             "A:b:Bc:C:d:D:e:f:F:g:hI:j:kK:l:L:m:Mn:N:OpP:Q:r:R:sS:t:T:U:vVW:Xy:z:Z",
                              long_options, &option_index);
             if (c == -1)
                 break;
@@ -559,6 +689,15 @@ void make_tied_array_beam_parse_cmdline(
                     opts->datadir = (char *)malloc( strlen(optarg) + 1 );
                     strcpy( opts->datadir, optarg );
                     break;
+                case 'D':
+                    opts->direct_io = atoi(optarg);
+                    if (opts->direct_io < 0)
+                    {
+                        fprintf( stderr, "error: make_tied_array_beam_parse_cmdline: "
+                                "-%c argument must be >= 0\n", c );
+                        exit(EXIT_FAILURE);
+                    }
+                    break;
                 case 'f':
                     opts->coarse_chan_str = (char *)malloc( strlen(optarg) + 1 );
                     strcpy( opts->coarse_chan_str, optarg );
@@ -567,13 +706,68 @@ void make_tied_array_beam_parse_cmdline(
                     opts->custom_flags = (char *)malloc( strlen(optarg) + 1 );
                     strcpy( opts->custom_flags, optarg );
                     break;
+                case 'g':
+                    opts->stage_size = atof(optarg);
+                    if (opts->stage_size <= 0.0)
+                    {
+                        fprintf( stderr, "error: make_tied_array_beam_parse_cmdline: "
+                                "-%c argument must be > 0\n", c );
+                        exit(EXIT_FAILURE);
+                    }
+                    break;
                 case 'h':
                     usage();
                     exit(EXIT_SUCCESS);
                     break;
+                case 'I':
+                    opts->filterbank_nbits = atoi(optarg);
+                    if ((opts->filterbank_nbits != 8) && (opts->filterbank_nbits != 32))
+                    {
+                        fprintf( stderr, "error: make_tied_array_beam_parse_cmdline: "
+                                "-%c argument must be either 8 or 32\n", c );
+                        exit(EXIT_FAILURE);
+                    }
+                    break;
+                case 'j':
+                    opts->stage_threads = atoi(optarg);
+                    if (opts->stage_threads <= 0)
+                    {
+                        fprintf( stderr, "error: make_tied_array_beam_parse_cmdline: "
+                                "-%c argument must be >= 1\n", c );
+                        exit(EXIT_FAILURE);
+                    }
+                    break;
+                case 'k':
+                    opts->skip_flagged = true;
+                    break;
+                case 'K':
+                    opts->nchans = atoi(optarg);
+                    if (opts->nchans <= 0)
+                    {
+                        fprintf( stderr, "error: make_tied_array_beam_parse_cmdline: "
+                                "-%c argument must be >= 1\n", c );
+                        exit(EXIT_FAILURE);
+                    }
+                    break;
+                case 'l':
+                    opts->stage_dir = (char *)malloc( strlen(optarg) + 1 );
+                    strcpy( opts->stage_dir, optarg );
+                    break;
+                case 'L':
+                    opts->read_seconds = atoi(optarg);
+                    if (opts->read_seconds <= 0)
+                    {
+                        fprintf( stderr, "error: make_tied_array_beam_parse_cmdline: "
+                                "-%c argument must be >= 1\n", c );
+                        exit(EXIT_FAILURE);
+                    }
+                    break;
                 case 'm':
                     opts->metafits = strdup(optarg);
                     break;
+                case 'M':
+                    opts->mpi_io = true;
+                    break;
                 case 'n':
                     opts->nchunks = atoi(optarg);
                     break;
@@ -596,6 +790,25 @@ void make_tied_array_beam_parse_cmdline(
                     opts->pointings_file = (char *)malloc( strlen(optarg) + 1 );
                     strcpy( opts->pointings_file, optarg );
                     break;
+                case 'Q':
+                    opts->out_nbits = atoi(optarg);
+                    if ((opts->out_nbits != 1) && (opts->out_nbits != 2) &&
+                        (opts->out_nbits != 4) && (opts->out_nbits != 8))
+                    {
+                        fprintf( stderr, "error: make_tied_array_beam_parse_cmdline: "
+                                "-%c argument must be 1, 2, 4, or 8\n", c );
+                        exit(EXIT_FAILURE);
+                    }
+                    break;
+                case 'r':
+                    opts->read_ahead = atoi(optarg);
+                    if (opts->read_ahead < 0)
+                    {
+                        fprintf( stderr, "error: make_tied_array_beam_parse_cmdline: "
+                                "-%c argument must be >= 0\n", c );
+                        exit(EXIT_FAILURE);
+                    }
+                    break;
                 case 'R':
                     opts->ref_ant = (char *)malloc( strlen(optarg) + 1 );
                     strcpy( opts->ref_ant, optarg );
@@ -635,9 +848,33 @@ void make_tied_array_beam_parse_cmdline(
                     printf( "MWA Beamformer %s\n", VCSBEAM_VERSION);
                     exit(0);
                     break;
+                case 'W':
+                    opts->shm_blocks = atoi(optarg);
+                    if (opts->shm_blocks <= 0)
+                    {
+                        fprintf( stderr, "error: make_tied_array_beam_parse_cmdline: "
+                                "-%c argument must be >= 1\n", c );
+                        exit(EXIT_FAILURE);
+                    }
+                    break;
                 case 'X':
                     opts->keep_cross_terms = true;
                     break;
+                case 'y':
+                    opts->telescope_id = atoi(optarg);
+                    break;
+                case 'z':
+                    opts->zstd_threads = atoi(optarg);
+                    if (opts->zstd_threads < 0)
+                    {
+                        fprintf( stderr, "error: make_tied_array_beam_parse_cmdline: "
+                                "-%c argument must be >= 0\n", c );
+                        exit(EXIT_FAILURE);
+                    }
+                    break;
+                case 'Z':
+                    opts->use_mmap = true;
+                    break;
                 default:
                     fprintf( stderr, "error: make_tied_array_beam_parse_cmdline: "
                                     "unrecognised option '%s'\n", optarg );
@@ -690,12 +927,40 @@ void make_tied_array_beam_parse_cmdline(
         strcpy( opts->synth_filter, "LSQ12" );
     }
 
+    if (opts->filterbank_nbits > 0 && opts->out_nbits != 8)
+    {
+        fprintf( stderr, "error: make_tied_array_beam_parse_cmdline: "
+                "-I cannot be used with -Q\n" );
+        exit(EXIT_FAILURE);
+    }
+
+    if (opts->filterbank_nbits > 0 && opts->shm_blocks > 0)
+    {
+        fprintf( stderr, "error: make_tied_array_beam_parse_cmdline: "
+                "-I and -W cannot be used together\n" );
+        exit(EXIT_FAILURE);
+    }
+
+    if (opts->mpi_io && (opts->filterbank_nbits > 0 || opts->shm_blocks > 0))
+    {
+        fprintf( stderr, "error: make_tied_array_beam_parse_cmdline: "
+                "-M cannot be used with -I or -W\n" );
+        exit(EXIT_FAILURE);
+    }
+
+    // Filterbank files are fine-channelised, and only Stokes I is written
+    if (opts->filterbank_nbits > 0)
+    {
+        opts->out_fine    = true;
+        opts->out_nstokes = 1;
+    }
+
 }
 
 
 
 void write_step( vcsbeam_context *vm, mpi_psrfits *mpfs,
-        struct vdifinfo *vf, vdif_header *vhdr, float *data_buffer_vdif )
+        struct vdifinfo *vf, float *data_buffer_vdif )
 {
     int p;
     for (p = 0; p < vm->npointing; p++)
@@ -705,27 +970,33 @@ void write_step( vcsbeam_context *vm, mpi_psrfits *mpfs,
         if (vm->output_fine_channels)
         {
 
-            // Write out the spliced channels
-            wait_splice_psrfits( &(mpfs[p]) );
-
-            if (vm->coarse_chan_idx == mpfs[p].writer_id)
+            // With MPI-IO, all ranks write their own channels together
+            if (mpfs[p].mpiio != NULL)
             {
-                if (psrfits_write_subint( &(mpfs[p].spliced_pf) ) != 0)
+                vmWriteMPIIOPsrfits( &(mpfs[p]) );
+            }
+            else
+            {
+                // Write out the spliced channels
+                wait_splice_psrfits( &(mpfs[p]) );
+
+                // (This hands the subint over to be written in the background)
+                if (vm->mpi_rank == mpfs[p].writer_id)
                 {
-                    fprintf(stderr, "error: Write PSRFITS subint failed. File exists?\n");
-                    exit(EXIT_FAILURE);
+                    if (mpfs[p].shm != NULL)
+                        vmWritePsrfitsShm( &(mpfs[p]) );
+                    else if (mpfs[p].fil != NULL)
+                        vmWriteFilterbank( &(mpfs[p]) );
+                    else
+                        vmWriteSplicedPsrfits( &(mpfs[p]) );
                 }
-
-                mpfs[p].spliced_pf.sub.offs = roundf(mpfs[p].spliced_pf.tot_rows * mpfs[p].spliced_pf.sub.tsubint) + 0.5*mpfs[p].spliced_pf.sub.tsubint;
-                mpfs[p].spliced_pf.sub.lst += mpfs[p].spliced_pf.sub.tsubint;
-
             }
 
         }
 
         if (vm->output_coarse_channels)
         {
-            vdif_write_second( &vf[p], vhdr,
+            vdif_write_second( &vf[p],
                     data_buffer_vdif + p * vf->sizeof_buffer );
         }
 
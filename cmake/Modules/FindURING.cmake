@@ -0,0 +1,36 @@
+# - Try to find liburing (the Linux io_uring helper library).
+# Variables used by this module:
+#  URING_ROOT_DIR     - liburing root directory
+# Variables defined by this module:
+#  URING_FOUND        - system has liburing
+#  URING_INCLUDE_DIR  - the liburing include directory (cached)
+#  URING_INCLUDE_DIRS - the liburing include directories
+#                         (identical to URING_INCLUDE_DIR)
+#  URING_LIBRARY      - the liburing library (cached)
+#  URING_LIBRARIES    - the liburing libraries
+#                         (identical to URING_LIBRARY)
+
+message("Finding URING")
+
+set(URING_ROOT_DIR $ENV{URING})
+
+if(NOT URING_FOUND)
+
+  find_path(URING_INCLUDE_DIR liburing.h
+    HINTS ${URING_ROOT_DIR} PATH_SUFFIXES include)
+  find_library(URING_LIBRARY uring
+    HINTS ${URING_ROOT_DIR} PATH_SUFFIXES lib lib64)
+  mark_as_advanced(URING_INCLUDE_DIR URING_LIBRARY)
+
+  include(FindPackageHandleStandardArgs)
+  find_package_handle_standard_args(URING DEFAULT_MSG
+    URING_LIBRARY URING_INCLUDE_DIR)
+
+  set(URING_INCLUDE_DIRS ${URING_INCLUDE_DIR})
+  set(URING_LIBRARIES ${URING_LIBRARY})
+
+endif(NOT URING_FOUND)
+
+if (URING_FOUND)
+    message(STATUS "Found URING (${URING_LIBRARIES})")
+endif (URING_FOUND)
@@ -0,0 +1,36 @@
+# - Try to find the zstd compression library.
+# Variables used by this module:
+#  ZSTD_ROOT_DIR     - libzstd root directory
+# Variables defined by this module:
+#  ZSTD_FOUND        - system has libzstd
+#  ZSTD_INCLUDE_DIR  - the libzstd include directory (cached)
+#  ZSTD_INCLUDE_DIRS - the libzstd include directories
+#                         (identical to ZSTD_INCLUDE_DIR)
+#  ZSTD_LIBRARY      - the libzstd library (cached)
+#  ZSTD_LIBRARIES    - the libzstd libraries
+#                         (identical to ZSTD_LIBRARY)
+
+message("Finding ZSTD")
+
+set(ZSTD_ROOT_DIR $ENV{ZSTD})
+
+if(NOT ZSTD_FOUND)
+
+  find_path(ZSTD_INCLUDE_DIR zstd.h
+    HINTS ${ZSTD_ROOT_DIR} PATH_SUFFIXES include)
+  find_library(ZSTD_LIBRARY zstd
+    HINTS ${ZSTD_ROOT_DIR} PATH_SUFFIXES lib lib64)
+  mark_as_advanced(ZSTD_INCLUDE_DIR ZSTD_LIBRARY)
+
+  include(FindPackageHandleStandardArgs)
+  find_package_handle_standard_args(ZSTD DEFAULT_MSG
+    ZSTD_LIBRARY ZSTD_INCLUDE_DIR)
+
+  set(ZSTD_INCLUDE_DIRS ${ZSTD_INCLUDE_DIR})
+  set(ZSTD_LIBRARIES ${ZSTD_LIBRARY})
+
+endif(NOT ZSTD_FOUND)
+
+if (ZSTD_FOUND)
+    message(STATUS "Found ZSTD (${ZSTD_LIBRARIES})")
+endif (ZSTD_FOUND)
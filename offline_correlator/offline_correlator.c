@@ -8,21 +8,27 @@
 #include "fourbit.h"
 #include "xgpu.h"
 #include "corr_utils.h"
+#include "vcsbeam.h"
 
 /* SM: These should not be defined here, but should be taken directly from
  * VCSTOOLS. However, VCSTOOLS does not currently have any facility to export
  * this kind of info externally.
  */
-#define NFREQUENCY   128ul
+#define NFREQUENCY   128ul  /* The default number of fine channels (see -K) */
 #define NSTATION     128ul
 #define NPOL           2ul
 #define NBIT           4ul
-#define NTIMESTEPS 10000ul
 #define NDIM           2ul  /* SM: re+im = 2 parts to complex number */
 
-#define NSAMPLES       (NTIMESTEPS*NFREQUENCY*NSTATION*NPOL*NDIM)
-#define NCMPLX_SAMPLES (NTIMESTEPS*NFREQUENCY*NSTATION*NPOL)
-#define NSAMPLES_PER_TIMESTEP  (NSAMPLES/NTIMESTEPS)
+/* The number of (fine channel, time step) pairs in one second of one coarse
+ * channel. The number of time steps per second is this divided by the number
+ * of fine channels (e.g. 10000 for 128 fine channels).
+ */
+#define NCHAN_SAMPLES 1280000ul
+
+#define NSAMPLES       (NCHAN_SAMPLES*NSTATION*NPOL*NDIM)
+#define NCMPLX_SAMPLES (NCHAN_SAMPLES*NSTATION*NPOL)
+#define NSAMPLES_PER_TIMESTEP(nfreq)  (NSAMPLES/(NCHAN_SAMPLES/(nfreq)))
 
 /* SM: This is apparently a fixed HDU header size for the output gpubox files
  */
@@ -58,6 +64,13 @@ typedef struct Options_t {
     char *obsid;
     int offline;
     int dumps_per_second;
+    unsigned long nfrequency;
+
+    // For channelising MWAX data on the fly
+    char *metafits;
+    char *begin_str;
+    char *coarse_chan_str;
+    char *analysis_filter;
 } Options;
 
 void usage()
@@ -66,12 +79,34 @@ void usage()
             "Takes VCS data files and correlates as per the "
             "parameters of the linked xGPU library\n" );
     printf( "usage: offline_correlator -c <coarse_channel> -d <infile> [options]\n" );
+    printf( "   or: offline_correlator -m <metafits> -d <datadir> [options]\n" );
+    printf( "In the second form, one second of MWAX (coarse channelised) data is fine "
+            "channelised on the GPU and passed straight to the correlator, without "
+            "writing any intermediate files. In that case, OBSID, STARTTIME and "
+            "COARSE_CHANNEL default to values derived from the metafits file.\n" );
     printf( "Options:\n" );
+    printf( "   -A FILTER\n" );
+    printf( "        (MWAX only) Apply the named filter during fine channelisation "
+            "[default: FINEPFB]\n" );
+    printf( "   -b GPSTIME\n" );
+    printf( "        (MWAX only) The GPS second to correlate. If GPSTIME starts with a "
+            "'+' or a '-', it is taken relative to the start or end of the observation "
+            "[default: \"+0\"]\n" );
     printf( "   -e EDGES\n" );
     printf( "        Set EDGES channels at both top and bottom of the band to 0 "
             "[default: 0]\n" );
+    printf( "   -f CHAN\n" );
+    printf( "        (MWAX only) The coarse channel to correlate. If CHAN starts with a "
+            "'+' or a '-', it is taken relative to the first or last channel in the "
+            "observation, otherwise it is a receiver channel number [default: \"+0\"]\n" );
     printf( "   -h\n" );
     printf( "        Display this help and exit\n" );
+    printf( "   -K NCHANS\n" );
+    printf( "        The number of fine channels in the input VCS data. This must match "
+            "the number of frequencies that xGPU was compiled with [default: %lu]\n", NFREQUENCY );
+    printf( "   -m METAFITS\n" );
+    printf( "        Read MWAX data (from the directory given with -d) for the "
+            "observation described by METAFITS\n" );
     printf( "   -n CHAN_AVERAGE\n" );
     printf( "        Average CHAN_AVERAGE adjacent channels in the final output "
             "[default: 4]\n" );
@@ -95,9 +130,15 @@ void parse_cmdline(int argc, char *argv[], Options *opt)
     }
 
     int arg = 0;
-    while ((arg = getopt(argc, argv, "c:d:e:hn:o:r:s:")) != -1) {
+    while ((arg = getopt(argc, argv, "A:b:c:d:e:f:hK:m:n:o:r:s:")) != -1) {
 
         switch (arg) {
+            case 'A':
+                opt->analysis_filter = strdup(optarg);
+                break;
+            case 'b':
+                opt->begin_str = strdup(optarg);
+                break;
             case 'c':
                 opt->coarse_chan = atoi(optarg);
                 break;
@@ -107,9 +148,18 @@ void parse_cmdline(int argc, char *argv[], Options *opt)
             case 'e':
                 opt->edge = atoi(optarg);
                 break;
+            case 'f':
+                opt->coarse_chan_str = strdup(optarg);
+                break;
+            case 'm':
+                opt->metafits = strdup(optarg);
+                break;
             case 'h':
                 usage();
                 exit(EXIT_SUCCESS);
+            case 'K':
+                opt->nfrequency = strtoul(optarg, NULL, 10);
+                break;
             case 'n':
                 opt->chan_to_aver=atoi(optarg);
                 break;
@@ -136,27 +186,42 @@ void parse_cmdline(int argc, char *argv[], Options *opt)
         exit(EXIT_FAILURE);
     }
 
-    if (opt->coarse_chan < 0)
+    // For MWAX data, these can be worked out from the metafits file later
+    if (opt->metafits == NULL)
     {
-        usage();
-        fprintf( stderr, "error: a positive coarse channel must be given\n" );
-        exit(EXIT_FAILURE);
-    }
+        if (opt->coarse_chan < 0)
+        {
+            usage();
+            fprintf( stderr, "error: a positive coarse channel must be given\n" );
+            exit(EXIT_FAILURE);
+        }
 
-    if (opt->out_file == NULL && opt->starttime < 0)
-    {
-        usage();
-        fprintf( stderr, "error: starttime required\n" );
-        exit(EXIT_FAILURE);
+        if (opt->out_file == NULL && opt->starttime < 0)
+        {
+            usage();
+            fprintf( stderr, "error: starttime required\n" );
+            exit(EXIT_FAILURE);
+        }
+
+        if (opt->obsid == NULL)
+        {
+            usage();
+            fprintf(stderr, "error: obsid required\n" );
+            exit(EXIT_FAILURE);
+        }
     }
 
-    if (opt->obsid == NULL)
+    if (opt->nfrequency == 0 || NCHAN_SAMPLES % opt->nfrequency != 0)
     {
         usage();
-        fprintf(stderr, "error: obsid required\n" );
+        fprintf( stderr, "error: number of fine channels (%lu) must divide "
+                "evenly into %lu\n", opt->nfrequency, NCHAN_SAMPLES );
         exit(EXIT_FAILURE);
     }
+}
 
+void set_out_file( Options *opt )
+{
     // If no explicit out_file is given, a default one is constructed:
     // [obsid]_[timestamp]_gpubox[chan]_00.fits
 
@@ -176,29 +241,16 @@ void parse_cmdline(int argc, char *argv[], Options *opt)
 }
 
 
-void read_vcs( FILE *fin, size_t ntime, int edge, ComplexInput *out )
-/* Read VCS data files and convert from (4+4)-bit complex to
- * (8+8)-bit complex.
+void expand_vcs( const char *vcsdata, size_t nread, size_t nfrequency, int edge, ComplexInput *out )
+/* Convert VCS data (in the legacy recombined format) from (4+4)-bit complex
+ * to (8+8)-bit complex. The VCS data can come either from a file (see
+ * read_vcs()) or straight from the forward fine PFB.
  */
 {
     // Check that the out pointer has been allocated
     if (out == NULL)
     {
-        fprintf( stderr, "error: read_vcs: out pointer is NULL\n" );
-        exit(EXIT_FAILURE);
-    }
-
-    // SM: TODO: Put this elsewhere?
-    build_eight_bit_lookup();
-
-    // Read data in from file
-    size_t bytes_to_read = ntime*NSAMPLES_PER_TIMESTEP*NBIT/8;
-    char *vcsdata = (char *)malloc( bytes_to_read );
-    size_t nread = fread( vcsdata, 1, bytes_to_read, fin );
-    if (nread != bytes_to_read)
-    {
-        fprintf( stderr, "error: read only "
-                "%ld of %ld bytes\n", nread, bytes_to_read );
+        fprintf( stderr, "error: expand_vcs: out pointer is NULL\n" );
         exit(EXIT_FAILURE);
     }
 
@@ -216,9 +268,9 @@ void read_vcs( FILE *fin, size_t ntime, int edge, ComplexInput *out )
     for (s = 0; s < nread; s += (NPOL*NDIM*NBIT)/8)
     {
         // Determine the channel number of this sample
-        c = (s / samps_per_chan) % NFREQUENCY;
+        c = (s / samps_per_chan) % nfrequency;
 
-        if ((c < (size_t)edge ) || c >= (NFREQUENCY - edge))
+        if ((c < (size_t)edge ) || c >= (nfrequency - edge))
         {
             // Set edge channels to 0
             for (r = 0; r < real_samples_per_step; r++)
@@ -239,10 +291,127 @@ void read_vcs( FILE *fin, size_t ntime, int edge, ComplexInput *out )
         out_ptr[1].imag = (ReImInput)expanded[3];
         out_ptr += 2;
     }
+}
+
+void read_vcs( FILE *fin, size_t ntime, size_t nfrequency, int edge, ComplexInput *out )
+/* Read VCS data files and convert from (4+4)-bit complex to
+ * (8+8)-bit complex.
+ */
+{
+    // Read data in from file
+    size_t bytes_to_read = ntime*NSAMPLES_PER_TIMESTEP(nfrequency)*NBIT/8;
+    char *vcsdata = (char *)malloc( bytes_to_read );
+    size_t nread = fread( vcsdata, 1, bytes_to_read, fin );
+    if (nread != bytes_to_read)
+    {
+        fprintf( stderr, "error: read only "
+                "%ld of %ld bytes\n", nread, bytes_to_read );
+        exit(EXIT_FAILURE);
+    }
+
+    expand_vcs( vcsdata, nread, nfrequency, edge, out );
 
     free( vcsdata );
 }
 
+vcsbeam_context *channelise_mwax( Options *opt )
+/* Read one second of MWAX data and fine channelise it on the GPU, producing
+ * exactly the (4+4)-bit legacy recombined data that fine_pfb_offline would
+ * have written to file. The result is left in vm->fpfb->vcs_data.
+ *
+ * If the preceding second was recorded (i.e. its data file is there), it is
+ * also read, but only to fill the PFB's filter history (as fine_pfb_offline
+ * does when it carries on from one second to the next). Otherwise, the PFB
+ * starts from an empty history, as fine_pfb_offline does for the first
+ * second it processes.
+ */
+{
+    vcsbeam_context *vm = vmInit( false );
+
+    vmLoadObsMetafits( vm, opt->metafits );
+
+    // The preceding second may be before the start of the data (e.g. if
+    // the default, the "good" time, is later than the start of the
+    // observation), so only bind it if its file exists
+    uint64_t begin = parse_begin_string( vm->obs_metadata, opt->begin_str );
+    int nprime = 0;
+    if (begin > vm->obs_metadata->metafits_timesteps[0].gps_time_ms/1000)
+    {
+        char filename[MAX_COMMAND_LENGTH];
+        char path[2*MAX_COMMAND_LENGTH];
+        memset( filename, 0, MAX_COMMAND_LENGTH );
+        vmGetVoltFilename( vm, parse_coarse_chan_string( vm->obs_metadata, opt->coarse_chan_str ),
+                begin - 1, filename );
+        sprintf( path, "%s/%s", opt->in_file, filename );
+
+        nprime = (access( path, R_OK ) == 0 ? 1 : 0);
+    }
+
+    vmBindObsData( vm,
+        opt->coarse_chan_str, 1, 0,
+        opt->begin_str, 1 + nprime, -nprime,
+        opt->in_file );
+
+    if (vm->obs_metadata->mwa_version != VCSMWAXv2)
+    {
+        fprintf( stderr, "error: observation %u does not appear to be "
+                "coarse-channelised MWAX data\n",
+                vm->obs_metadata->obs_id );
+        exit(EXIT_FAILURE);
+    }
+
+    if (vm->obs_metadata->num_rf_inputs != NSTATION*NPOL)
+    {
+        fprintf( stderr, "error: observation %u has %u RF inputs, but "
+                "offline_correlator requires %lu\n",
+                vm->obs_metadata->obs_id, vm->obs_metadata->num_rf_inputs,
+                NSTATION*NPOL );
+        exit(EXIT_FAILURE);
+    }
+
+    // Fill in any of the output file details not given on the command line
+    int coarse_chan_idx = vm->coarse_chan_idxs_to_process[0];
+    uint64_t gps_second = vm->gps_seconds_to_process[nprime];
+
+    if (opt->coarse_chan < 0)
+        opt->coarse_chan = vm->obs_metadata->metafits_coarse_chans[coarse_chan_idx].gpubox_number;
+
+    if (opt->starttime < 0)
+        opt->starttime = vm->obs_metadata->metafits_timesteps[0].unix_time_ms/1000 +
+            (gps_second - vm->obs_metadata->metafits_timesteps[0].gps_time_ms/1000);
+
+    if (opt->obsid == NULL)
+    {
+        opt->obsid = (char *)malloc( 16 );
+        sprintf( opt->obsid, "%u", vm->obs_metadata->obs_id );
+    }
+
+    // Set up the forward PFB, exactly as fine_pfb_offline would
+    vmLoadFilter( vm, opt->analysis_filter, ANALYSIS_FILTER, opt->nfrequency );
+    vm->chunks_per_second = 1;
+    vmInitForwardPFB( vm, opt->nfrequency, PFB_SMART | PFB_MALLOC_HOST_OUTPUT );
+
+    // The output must be exactly one second's worth of legacy VCS data
+    size_t expected_bytes = NSAMPLES*NBIT/8;
+    if (vm->fpfb->vcs_size != expected_bytes)
+    {
+        fprintf( stderr, "error: channelise_mwax: fine PFB produces %lu bytes "
+                "per second, but %lu are needed\n", vm->fpfb->vcs_size, expected_bytes );
+        exit(EXIT_FAILURE);
+    }
+
+    if (nprime > 0)
+    {
+        vmCheckError( vmReadNextSecond( vm ) );
+        vmPrimeForwardPFB( vm );
+    }
+
+    vmCheckError( vmReadNextSecond( vm ) );
+    vmExecuteForwardPFB( vm );
+
+    return vm;
+}
+
 int main(int argc, char **argv)
 {
     clock_t start = clock();
@@ -259,21 +428,53 @@ int main(int argc, char **argv)
     opt.coarse_chan      = -1; // only set in the header if this is >= 0
     opt.out_file         = NULL;
     opt.dumps_per_second = 1;
+    opt.nfrequency       = NFREQUENCY;
+    opt.metafits         = NULL;
+    opt.begin_str        = NULL;
+    opt.coarse_chan_str  = NULL;
+    opt.analysis_filter  = NULL;
 
     // Parse the command line
     parse_cmdline( argc, argv, &opt );
 
+    // SM: TODO: Put this elsewhere?
+    build_eight_bit_lookup();
+
+    // If MWAX data are given, channelise them straight into memory.
+    // Otherwise, the (already channelised) input file is read bit by bit below.
+    vcsbeam_context *vm = NULL;
+    char *vcsdata = NULL;
+    if (opt.metafits != NULL)
+    {
+        if (opt.begin_str == NULL)
+            opt.begin_str = strdup( "+0" );
+        if (opt.coarse_chan_str == NULL)
+            opt.coarse_chan_str = strdup( "+0" );
+        if (opt.analysis_filter == NULL)
+            opt.analysis_filter = strdup( "FINEPFB" );
+
+        printf( "[%9.5lf] Fine channelising MWAX data\n", (clock()-start)/(double)CLOCKS_PER_SEC );
+        vm = channelise_mwax( &opt );
+        vcsdata = (char *)vm->fpfb->vcs_data;
+    }
+
+    set_out_file( &opt );
+
     // Prepare structs/variables for xGPU-related info
     XGPUInfo xgpu_info;
     int xgpu_error = 0;
 
     // Open the input file for reading
-    FILE *fin = fopen( opt.in_file, "r" );
-    if (fin == NULL)
+    FILE *fin = NULL;
+    if (vm == NULL)
     {
-        fprintf( stderr, "error: unable to open '%s' for reading\n",
-                opt.in_file );
-        exit(EXIT_FAILURE);
+        fin = fopen( opt.in_file, "r" );
+        if (fin == NULL)
+        {
+            fprintf( stderr, "error: unable to open '%s' for reading\n",
+                    opt.in_file );
+            exit(EXIT_FAILURE);
+        }
     }
 
     // Open the out_file for writing
@@ -292,7 +493,7 @@ int main(int argc, char **argv)
 
     if ((xgpu_info.npol       != NPOL      ) ||
         (xgpu_info.nstation   != NSTATION  ) ||
-        (xgpu_info.nfrequency != NFREQUENCY) ||
+        (xgpu_info.nfrequency != opt.nfrequency) ||
         (xgpu_info.input_type != XGPU_INT8 ))
     {
         fprintf( stderr, "error: XGPU library was compiled with:\n"
@@ -311,7 +512,7 @@ int main(int argc, char **argv)
                 xgpu_info.input_type,
                 NPOL,
                 NSTATION,
-                NFREQUENCY,
+                opt.nfrequency,
                 0 );
         exit(EXIT_FAILURE);
     }
@@ -330,7 +531,7 @@ int main(int argc, char **argv)
     fprintf( stderr, "nintegrations = %d / %d / %d = %d\n", NCMPLX_SAMPLES, xgpu_info.vecLength, opt.dumps_per_second, nintegrations );
 
     // Allocate output matrix array
-    size_t full_matLength = NFREQUENCY * NSTATION * NSTATION * NPOL * NPOL;
+    size_t full_matLength = opt.nfrequency * NSTATION * NSTATION * NPOL * NPOL;
     size_t full_size_bytes = opt.dumps_per_second * full_matLength * sizeof(Complex);
     Complex *full_matrix_h = (Complex *)malloc( full_size_bytes );
 
@@ -343,7 +544,7 @@ int main(int argc, char **argv)
     int hdu_num;
     for (hdu_num = 0; hdu_num < opt.dumps_per_second; hdu_num++) {
         blockSize += HEADER_SIZE;
-        blockSize += n_visibilities * (uint64_t)NFREQUENCY *
+        blockSize += n_visibilities * (uint64_t)opt.nfrequency *
             sizeof(Complex) / opt.chan_to_aver; // sizeof a data cube
 
         int remainder = blockSize % HEADER_SIZE; // pad out to the end of the HDU
@@ -376,16 +577,25 @@ int main(int argc, char **argv)
 
     int d; // iterate over (d)umps_per_second
     int i; // iterate over (i)ntegrations
-    int ntimesteps = NTIMESTEPS/(nintegrations*opt.dumps_per_second);
+    int ntimesteps = (NCHAN_SAMPLES/opt.nfrequency)/(nintegrations*opt.dumps_per_second);
     for (d = 0; d < opt.dumps_per_second; d++)
     {
         for (i = 0; i < nintegrations; i++)
         {
             // Read in the next chunk of VCS data
-            printf( "[%9.5lf] Reading in next %llu bytes\n",
-                    (clock()-start)/(double)CLOCKS_PER_SEC,
-                    ntimesteps*NSAMPLES_PER_TIMESTEP*NBIT/8 );
-            read_vcs( fin, ntimesteps, opt.edge, context.array_h );
+            size_t chunk_bytes = ntimesteps*NSAMPLES_PER_TIMESTEP(opt.nfrequency)*NBIT/8;
+            if (vm == NULL)
+            {
+                printf( "[%9.5lf] Reading in next %lu bytes\n",
+                        (clock()-start)/(double)CLOCKS_PER_SEC, chunk_bytes );
+                read_vcs( fin, ntimesteps, opt.nfrequency, opt.edge, context.array_h );
+            }
+            else
+            {
+                // The fine channelised data are already in memory
+                size_t offset = (d*nintegrations + i)*chunk_bytes;
+                expand_vcs( vcsdata + offset, chunk_bytes, opt.nfrequency, opt.edge, context.array_h );
+            }
 
             // Report progress so far
             printf( "[%9.5lf] Running GPU X-Engine (%d/%d)\n",
@@ -434,7 +644,7 @@ int main(int argc, char **argv)
     the_manager.nbit          = NBIT;
     the_manager.coarse_chan   = opt.coarse_chan;
     the_manager.nstation      = NSTATION;
-    the_manager.nfrequency    = NFREQUENCY;
+    the_manager.nfrequency    = opt.nfrequency;
     the_manager.ndim          = NDIM;
     the_manager.npol          = NPOL;
     the_manager.dumps_per_sec = opt.dumps_per_second;
@@ -460,8 +670,11 @@ int main(int argc, char **argv)
     xgpuFree( &context );
     free( full_matrix_h );
     free( FITSbuffer );
-    fclose( fin );
+    if (fin != NULL)
+        fclose( fin );
     fclose( fout );
+    if (vm != NULL)
+        destroy_vcsbeam_context( vm );
     free( opt.out_file );
     if (opt.in_file)
         free( opt.in_file );
@@ -0,0 +1,342 @@
+/********************************************************
+ *                                                      *
+ * Licensed under the Academic Free License version 3.0 *
+ *                                                      *
+ ********************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <mpi.h>
+
+#include <psrfits.h>
+
+#include "vcsbeam.h"
+
+/**
+ * Writes a string keyword (or a bare string, if `value` is NULL) to a
+ * SIGPROC header.
+ *
+ * @param fp    The file being written to
+ * @param name  The keyword (or bare string)
+ * @param value The keyword's value (or NULL)
+ */
+static void filterbank_write_string( FILE *fp, const char *name, const char *value )
+{
+    int len = strlen( name );
+    fwrite( &len, sizeof(int), 1, fp );
+    fwrite( name, sizeof(char), len, fp );
+
+    if (value != NULL)
+        filterbank_write_string( fp, value, NULL );
+}
+
+/**
+ * Writes an integer keyword to a SIGPROC header.
+ *
+ * @param fp    The file being written to
+ * @param name  The keyword
+ * @param value The keyword's value
+ */
+static void filterbank_write_int( FILE *fp, const char *name, int value )
+{
+    filterbank_write_string( fp, name, NULL );
+    fwrite( &value, sizeof(int), 1, fp );
+}
+
+/**
+ * Writes a floating point keyword to a SIGPROC header.
+ *
+ * @param fp    The file being written to
+ * @param name  The keyword
+ * @param value The keyword's value
+ */
+static void filterbank_write_double( FILE *fp, const char *name, double value )
+{
+    filterbank_write_string( fp, name, NULL );
+    fwrite( &value, sizeof(double), 1, fp );
+}
+
+/**
+ * Converts an angle into SIGPROC's packed sexagesimal format.
+ *
+ * @param angle The angle, in hours (for RA) or degrees (for Dec)
+ *
+ * @return The angle as a single number of the form `ddmmss.s`
+ */
+static double filterbank_sexagesimal( double angle )
+{
+    double sign = (angle < 0.0 ? -1.0 : 1.0);
+    angle = fabs( angle );
+
+    double d = floor( angle );
+    double m = floor( (angle - d) * 60.0 );
+    double s = ((angle - d) * 60.0 - m) * 60.0;
+
+    return sign * (d*10000.0 + m*100.0 + s);
+}
+
+/**
+ * Writes the SIGPROC header for the spliced output of an `mpi_psrfits` struct.
+ *
+ * @param fp The (newly opened) file to write the header to
+ * @param pf The spliced PSRFITS struct describing the output
+ * @param fb The filterbank file being written
+ *
+ * The channels are written in order of decreasing frequency (i.e. with a
+ * negative channel width), which is what most search codes expect.
+ */
+static void filterbank_write_header( FILE *fp, struct psrfits *pf, filterbank *fb )
+{
+    int nchan = pf->hdr.nchan;
+
+    filterbank_write_string( fp, "HEADER_START", NULL );
+
+    filterbank_write_string( fp, "rawdatafile", pf->basefilename );
+    filterbank_write_string( fp, "source_name", pf->hdr.source );
+
+    filterbank_write_int( fp, "telescope_id", fb->telescope_id );
+    filterbank_write_int( fp, "machine_id",   FILTERBANK_MACHINE_ID   );
+    filterbank_write_int( fp, "data_type",    1 ); // (filterbank)
+
+    filterbank_write_double( fp, "src_raj",  filterbank_sexagesimal( pf->hdr.ra2000/15.0 ) );
+    filterbank_write_double( fp, "src_dej",  filterbank_sexagesimal( pf->hdr.dec2000 ) );
+    filterbank_write_double( fp, "az_start", pf->hdr.azimuth );
+    filterbank_write_double( fp, "za_start", pf->hdr.zenith_ang );
+
+    filterbank_write_double( fp, "tstart", (double)pf->hdr.MJD_epoch );
+    filterbank_write_double( fp, "tsamp",  pf->hdr.dt );
+
+    filterbank_write_double( fp, "fch1", pf->sub.dat_freqs[nchan - 1] );
+    filterbank_write_double( fp, "foff", -pf->hdr.df );
+    filterbank_write_int( fp, "nchans", nchan );
+    filterbank_write_int( fp, "nbits",  fb->nbits );
+    filterbank_write_int( fp, "nifs",   1 );
+    filterbank_write_int( fp, "nbeams", 1 );
+    filterbank_write_int( fp, "ibeam",  0 );
+
+    filterbank_write_string( fp, "HEADER_END", NULL );
+}
+
+/**
+ * Fixes the 8-bit digitisation levels of each channel of a filterbank file.
+ *
+ * @param fb The filterbank file
+ * @param pf The spliced PSRFITS struct holding the first second of data
+ *
+ * Each channel's mean and standard deviation are measured from the
+ * (rescaled) Stokes I samples. Level 0 is set to lie `FILTERBANK_8BIT_MEAN`
+ * levels below the mean, and each level is 1/`FILTERBANK_8BIT_STD` of a
+ * standard deviation. A channel with no variation (e.g. one that is
+ * flagged) is written as a constant `FILTERBANK_8BIT_MEAN`.
+ */
+static void filterbank_set_levels( filterbank *fb, struct psrfits *pf )
+{
+    int nchan = fb->nchan;
+    size_t stride = (size_t)pf->hdr.npol * nchan; // Between samples in the subint
+
+    fb->level_offsets = (float *)malloc( nchan * sizeof(float) );
+    fb->level_scales  = (float *)malloc( nchan * sizeof(float) );
+
+    int s, c;
+    for (c = 0; c < nchan; c++)
+    {
+        double sum = 0.0, sum2 = 0.0, v;
+        for (s = 0; s < fb->nsamples; s++)
+        {
+            v = pf->sub.data[s*stride + c]*pf->sub.dat_scales[c] + pf->sub.dat_offsets[c];
+            sum  += v;
+            sum2 += v*v;
+        }
+
+        double mean = sum / fb->nsamples;
+        double var  = sum2 / fb->nsamples - mean*mean;
+        double std  = (var > 0.0 ? sqrt( var ) : 0.0);
+
+        // (A constant channel, with a scale of 1, sits on the mean level)
+        fb->level_scales[c]  = (std > 0.0 ? FILTERBANK_8BIT_STD / std : 1.0);
+        fb->level_offsets[c] = mean - FILTERBANK_8BIT_MEAN / fb->level_scales[c];
+    }
+}
+
+/**
+ * Opens a SIGPROC filterbank file for the spliced output of an
+ * `mpi_psrfits` struct.
+ *
+ * @param mpf   The `mpi_psrfits` struct whose spliced output is to be
+ *              written
+ * @param nbits The number of bits per sample in the output file (either 8
+ *              or 32)
+ * @param telescope_id The SIGPROC `telescope_id` to write in the header
+ *              (e.g. `FILTERBANK_TELESCOPE_ID`), which tools such as PRESTO
+ *              use to look up the site (e.g. for barycentring)
+ *
+ * This should only be called on the writer, after vmInitMPIPsrfits(). The
+ * file is named `[basefilename].fil`, and stays open (in a single file,
+ * regardless of the PSRFITS `max_sec_per_file`) until vmFreeFilterbank()
+ * is called. Only Stokes I (i.e. the first of the spliced Stokes
+ * parameters) is written.
+ *
+ * For both 8-bit and 32-bit output, the scales and offsets are applied to
+ * the values in the spliced subint (which are renormalised for each channel
+ * every second). 32-bit output is the (float) result. For 8-bit output, the
+ * result is re-digitised, with fixed levels for each channel set from the
+ * first second (see vmWriteFilterbank()). The digitisation of each channel
+ * therefore does not jump from one second to the next, which would
+ * otherwise show up as a 1 Hz signal in periodicity searches.
+ *
+ * Each second's worth of samples is handed over to a write queue, so that
+ * it is written in the background, in one large sequential write. The
+ * PSRFITS writer thread started by vmInitMPIPsrfits() is not needed, and
+ * is freed.
+ *
+ * \see vmWriteFilterbank()
+ * \see vmFreeFilterbank()
+ */
+void vmInitFilterbank( mpi_psrfits *mpf, int nbits, int telescope_id )
+{
+    struct psrfits *pf = &(mpf->spliced_pf);
+
+    if (nbits != 8 && nbits != 32)
+    {
+        fprintf( stderr, "error: vmInitFilterbank: nbits (%d) must be either "
+                "8 or 32\n", nbits );
+        exit(EXIT_FAILURE);
+    }
+
+    if (pf->hdr.nbits != 8)
+    {
+        fprintf( stderr, "error: vmInitFilterbank: the spliced samples must "
+                "be 8-bit (not %d-bit)\n", pf->hdr.nbits );
+        exit(EXIT_FAILURE);
+    }
+
+    // A filterbank file can only describe evenly spaced channels
+    int nchan = pf->hdr.nchan;
+    double span = pf->sub.dat_freqs[nchan - 1] - pf->sub.dat_freqs[0];
+    if (fabs( span - (nchan - 1)*pf->hdr.df ) > 0.5*pf->hdr.df)
+    {
+        fprintf( stderr, "error: vmInitFilterbank: filterbank output needs "
+                "contiguous coarse channels\n" );
+        exit(EXIT_FAILURE);
+    }
+
+    // The spliced subints no longer go to a PSRFITS file, so the
+    // background PSRFITS writer (and its spare subints) is not needed
+    vmFreePsrfitsWriter( mpf );
+
+    filterbank *fb = (filterbank *)malloc( sizeof(filterbank) );
+
+    fb->nbits      = nbits;
+    fb->telescope_id = telescope_id;
+    fb->nchan      = nchan;
+    fb->nsamples   = pf->hdr.nsblk;
+    fb->block_size = (size_t)fb->nsamples * fb->nchan * (nbits / 8);
+
+    fb->level_offsets = NULL;
+    fb->level_scales  = NULL;
+
+    char filename[strlen(pf->basefilename) + 5];
+    sprintf( filename, "%s.fil", pf->basefilename );
+    fb->fp = fopen( filename, "w" );
+    if (fb->fp == NULL)
+    {
+        fprintf( stderr, "error: vmInitFilterbank: could not open '%s' for "
+                "writing\n", filename );
+        exit(EXIT_FAILURE);
+    }
+
+    filterbank_write_header( fb->fp, pf, fb );
+
+    // Two seconds can be waiting to be written while the next is filled
+    fb->wq = vmInitWriteQueue( fb->block_size, 2, 1 );
+    gpuMallocHost( &(fb->buffer), fb->block_size );
+
+    mpf->fil = fb;
+}
+
+/**
+ * Writes the spliced subint to the filterbank file.
+ *
+ * @param mpf The `mpi_psrfits` struct whose spliced subint is to be written
+ *
+ * This should only be called on the writer, after wait_splice_psrfits().
+ * The Stokes I samples are rescaled and reordered by decreasing frequency
+ * into `mpf&rarr;fil&rarr;buffer`, which is then handed over to be written
+ * in the background.
+ *
+ * For 8-bit output, the first call measures the mean and standard
+ * deviation of each channel, and fixes its levels so that the mean sits on
+ * level `FILTERBANK_8BIT_MEAN`, with `FILTERBANK_8BIT_STD` levels per
+ * standard deviation. These levels are used for the rest of the file.
+ */
+void vmWriteFilterbank( mpi_psrfits *mpf )
+{
+    filterbank     *fb = mpf->fil;
+    struct psrfits *pf = &(mpf->spliced_pf);
+
+    int nchan = fb->nchan;
+    size_t stride = (size_t)pf->hdr.npol * nchan; // Between samples in the subint
+
+    float *scales  = pf->sub.dat_scales;
+    float *offsets = pf->sub.dat_offsets;
+
+    int s, c;
+    if (fb->nbits == 8)
+    {
+        if (fb->level_offsets == NULL)
+            filterbank_set_levels( fb, pf );
+
+        uint8_t *out = (uint8_t *)fb->buffer;
+        float v;
+        for (s = 0; s < fb->nsamples; s++)
+        {
+            uint8_t *in = pf->sub.data + s*stride;
+            for (c = 0; c < nchan; c++)
+            {
+                v = (in[c]*scales[c] + offsets[c] - fb->level_offsets[c]) * fb->level_scales[c];
+                v = (v < 0.0f ? 0.0f : (v > 255.0f ? 255.0f : v));
+                out[s*nchan + (nchan - 1 - c)] = (uint8_t)rintf( v );
+            }
+        }
+    }
+    else
+    {
+        float *out = (float *)fb->buffer;
+        for (s = 0; s < fb->nsamples; s++)
+        {
+            uint8_t *in = pf->sub.data + s*stride;
+            for (c = 0; c < nchan; c++)
+                out[s*nchan + (nchan - 1 - c)] = in[c]*scales[c] + offsets[c];
+        }
+    }
+
+    fb->buffer = vmWriteQueueSwapToFile( fb->wq, fb->buffer, fb->block_size, fb->fp );
+}
+
+/**
+ * Finishes writing the filterbank file, and closes it.
+ *
+ * @param mpf The `mpi_psrfits` struct whose filterbank file is to be closed
+ *
+ * This blocks until everything handed over by vmWriteFilterbank() has been
+ * written.
+ */
+void vmFreeFilterbank( mpi_psrfits *mpf )
+{
+    filterbank *fb = mpf->fil;
+
+    // If there is no filterbank file, silently do nothing
+    if (fb == NULL)
+        return;
+
+    vmFreeWriteQueue( fb->wq );
+    fclose( fb->fp );
+    gpuHostFree( fb->buffer );
+    free( fb->level_offsets );
+    free( fb->level_scales );
+    free( fb );
+
+    mpf->fil = NULL;
+}
@@ -18,6 +18,9 @@
 
 #include "vcsbeam.h"
 
+#include "mwa_header.h"
+#include "ascii_header.h"
+
 /**
  * Populates a PSRFITS struct with data derived from the observation.
  *
@@ -122,7 +125,7 @@ void populate_spliced_psrfits_header(
     pf->hdr.df         = fine_chan_width / 1e6; // (MHz)
     pf->hdr.orig_nchan = pf->hdr.nchan;
     pf->hdr.orig_df    = pf->hdr.df;
-    pf->hdr.nbits      = 8;
+    pf->hdr.nbits      = vm->out_nbits;
     pf->hdr.orig_nbits = 8;  // in Scott's version of psrfits_utils this is an entry need to figure out the original nbits of the data
     pf->hdr.nsblk      = sample_rate;  // block is always 1 second of data
 
@@ -356,9 +359,19 @@ void populate_psrfits_header(
     pf->hdr.df         = fine_chan_width / 1e6; // (MHz)
     pf->hdr.orig_nchan = pf->hdr.nchan;
     pf->hdr.orig_df    = pf->hdr.df;
-    pf->hdr.nbits      = 8;
+    pf->hdr.nbits      = vm->out_nbits;
     pf->hdr.nsblk      = sample_rate;  // block is always 1 second of data
 
+    // Each coarse channel's spectrum must fill a whole number of bytes, so
+    // that the coarse channels can be spliced together
+    if ((pf->hdr.nchan * pf->hdr.nbits) % 8 != 0)
+    {
+        fprintf( stderr, "error: populate_psrfits_header: %d channels of %d-bit "
+                "samples do not fill a whole number of bytes\n",
+                pf->hdr.nchan, pf->hdr.nbits );
+        exit(EXIT_FAILURE);
+    }
+
     pf->hdr.ds_freq_fact = 1;
     pf->hdr.ds_time_fact = 1;
 
@@ -495,6 +508,11 @@ void free_psrfits( struct psrfits *pf )
  * @param outfile The prefix for the output PSRFITS files
  * @param is_coherent `true` for tied-array beamforming, `false` for
  *        incoherent beamforming
+ *
+ * Each call assigns the next rank (round-robin, starting from
+ * `vm&rarr;writer`) as the writer of the new struct, so this must be called
+ * for the same outputs, in the same order, on every rank. Only the writer
+ * allocates the spliced subint (and starts a thread to write it).
  */
 void vmInitMPIPsrfits(
         vcsbeam_context *vm,
@@ -511,13 +529,24 @@ void vmInitMPIPsrfits(
         exit(EXIT_FAILURE);
     }
 
-    mpf->writer_id = vm->writer;
-
-    // Populate the PSRFITS header struct for the combined (spliced) output file
+    // Spread the outputs (e.g. one per pointing) over the ranks, so that
+    // their splicing and writing is not all left to the same one
+    mpf->writer_id = vm->next_writer;
+    vm->next_writer = (vm->next_writer + 1) % vm->mpi_size;
+
+    // Populate the PSRFITS header struct for the combined (spliced) output
+    // file, and start the thread that will write it
+    mpf->writer = NULL;
+    mpf->fil    = NULL;
+    mpf->shm    = NULL;
+    mpf->mpiio  = NULL;
     if (vm->mpi_rank == mpf->writer_id)
+    {
         populate_spliced_psrfits_header( vm, &(mpf->spliced_pf),
                 max_sec_per_file, nstokes,
                 bg, outfile, is_coherent );
+        vmInitPsrfitsWriter( mpf, PSRFITS_WRITER_NBUFFERS );
+    }
 
     // Populate the PSRFITS header struct for a single channel
     populate_psrfits_header( vm, &(mpf->coarse_chan_pf), max_sec_per_file,
@@ -525,14 +554,17 @@ void vmInitMPIPsrfits(
 
     // Create MPI vector types designed to splice the coarse channels together
     // correctly during MPI_Gather
-    MPI_Type_contiguous( mpf->coarse_chan_pf.hdr.nchan, MPI_BYTE, &(mpf->coarse_chan_spectrum) );
+    // (Samples with fewer than 8 bits are already packed into bytes)
+    int spectrum_bytes = (mpf->coarse_chan_pf.hdr.nchan * mpf->coarse_chan_pf.hdr.nbits) / 8;
+
+    MPI_Type_contiguous( spectrum_bytes, MPI_BYTE, &(mpf->coarse_chan_spectrum) );
     MPI_Type_commit( &(mpf->coarse_chan_spectrum) );
 
     MPI_Type_vector( mpf->coarse_chan_pf.hdr.nsblk*nstokes, 1, vm->ncoarse_chans,
             mpf->coarse_chan_spectrum, &(mpf->total_spectrum_type) );
     MPI_Type_commit( &(mpf->total_spectrum_type) );
 
-    MPI_Type_create_resized( mpf->total_spectrum_type, 0, mpf->coarse_chan_pf.hdr.nchan, &(mpf->spliced_type) );
+    MPI_Type_create_resized( mpf->total_spectrum_type, 0, spectrum_bytes, &(mpf->spliced_type) );
     MPI_Type_commit( &(mpf->spliced_type) );
 
 
@@ -568,7 +600,9 @@ void vmInitMPIPsrfits(
  * @param mpf A pointer to the struct to be freed.
  *
  * Only the memory associated with member variables are freed.
- * The `mpi_psrfits` itself is not freed.
+ * The `mpi_psrfits` itself is not freed. On the writer, any subints still
+ * waiting to be written are written first. If MPI-IO is being used (see
+ * vmInitMPIIOPsrfits()), this must be called on all ranks at once.
  */
 
 void free_mpi_psrfits( mpi_psrfits *mpf )
@@ -588,12 +622,16 @@ void free_mpi_psrfits( mpi_psrfits *mpf )
     MPI_Type_free( &(mpf->coarse_chan_SCL) );
 */
 
+    vmFreeMPIIOPsrfits( mpf );
     free_psrfits( &(mpf->coarse_chan_pf) );
 
     int mpi_proc_id;
     MPI_Comm_rank( MPI_COMM_WORLD, &mpi_proc_id );
     if (mpi_proc_id == mpf->writer_id)
     {
+        vmFreePsrfitsWriter( mpf );
+        vmFreeFilterbank( mpf );
+        vmFreePsrfitsShm( mpf );
         free_psrfits( &(mpf->spliced_pf) );
     }
 }
@@ -640,3 +678,826 @@ void wait_splice_psrfits( mpi_psrfits *mpf )
     MPI_Wait( &(mpf->request_offsets), MPI_STATUS_IGNORE );
     MPI_Wait( &(mpf->request_scales),  MPI_STATUS_IGNORE );
 }
+
+/**
+ * Locks cfitsio, if it was not built to be called from multiple threads at
+ * once.
+ */
+static pthread_mutex_t cfitsio_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Writes one subint to the PSRFITS file, and advances the subint's time
+ * stamps ready for the next one.
+ *
+ * @param pf       The (spliced) PSRFITS struct to be written
+ * @param unpacked Space for the subint's samples, one per byte (only used
+ *                 for 4-bit samples; if NULL, it is allocated as needed)
+ *
+ * The samples in `pf&rarr;sub.data` are expected to be packed already.
+ * psrfits_utils packs 4-bit samples itself, from `pf&rarr;sub.data` (one per
+ * byte) into `pf&rarr;sub.rawdata`, so in that case it is handed the
+ * samples unpacked again (and packs them back into the same bytes).
+ */
+static void vmWritePsrfitsSubint( struct psrfits *pf, unsigned char *unpacked )
+{
+    bool lock = !fits_is_reentrant();
+
+    unsigned char *packed = pf->sub.data;
+    bool free_unpacked = false;
+    if (pf->hdr.nbits == 4)
+    {
+        if (unpacked == NULL)
+        {
+            unpacked = (unsigned char *)malloc( 2*pf->sub.bytes_per_subint );
+            free_unpacked = true;
+        }
+
+        int b;
+        for (b = 0; b < pf->sub.bytes_per_subint; b++)
+        {
+            unpacked[2*b]     = packed[b] >> 4;
+            unpacked[2*b + 1] = packed[b] & 0x0f;
+        }
+
+        pf->sub.data    = unpacked;
+        pf->sub.rawdata = packed;
+    }
+
+    if (lock)  pthread_mutex_lock( &cfitsio_mutex );
+
+    if (psrfits_write_subint( pf ) != 0)
+    {
+        fprintf(stderr, "error: Write PSRFITS subint failed. File exists?\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (lock)  pthread_mutex_unlock( &cfitsio_mutex );
+
+    pf->sub.data = packed;
+    if (free_unpacked)
+        free( unpacked );
+
+    pf->sub.offs = roundf(pf->tot_rows * pf->sub.tsubint) + 0.5*pf->sub.tsubint;
+    pf->sub.lst += pf->sub.tsubint;
+}
+
+/**
+ * The main loop of a PSRFITS writer thread.
+ *
+ * @param arg A pointer to the `psrfits_writer`
+ *
+ * Takes subints off the queue in order, writes each one to file, and
+ * returns its buffers to the writer's pool of free subints. Exits once the
+ * writer has been shut down and there is nothing left to write.
+ */
+static void *vmPsrfitsWriterWorker( void *arg )
+{
+    psrfits_writer *pw = (psrfits_writer *)arg;
+    psrfits_subint subint;
+
+    while (1)
+    {
+        // Wait for something to write
+        pthread_mutex_lock( &pw->mutex );
+        while (pw->npending == 0 && !pw->shutdown)
+            pthread_cond_wait( &pw->item_ready, &pw->mutex );
+
+        if (pw->npending == 0) // (and therefore shutdown)
+        {
+            pthread_mutex_unlock( &pw->mutex );
+            break;
+        }
+
+        subint = pw->pending[pw->pending_head];
+        pw->pending_head = (pw->pending_head + 1) % pw->nbuffers;
+        pw->npending--;
+        pthread_mutex_unlock( &pw->mutex );
+
+        // Write it out (without holding the lock)
+        pw->pf.sub.data        = subint.data;
+        pw->pf.sub.rawdata     = subint.data;
+        pw->pf.sub.dat_offsets = subint.offsets;
+        pw->pf.sub.dat_scales  = subint.scales;
+
+        vmWritePsrfitsSubint( &pw->pf, pw->unpacked );
+
+        // Return the buffers to the pool
+        pthread_mutex_lock( &pw->mutex );
+        pw->free_subints[pw->nfree++] = subint;
+        pthread_cond_signal( &pw->buffer_free );
+        pthread_mutex_unlock( &pw->mutex );
+    }
+
+    return NULL;
+}
+
+/**
+ * Starts a thread for writing the spliced PSRFITS subints in the background.
+ *
+ * @param mpf      The `mpi_psrfits` struct whose spliced output is to be
+ *                 written
+ * @param nbuffers The number of spare subints (beyond the one in
+ *                 `mpf&rarr;spliced_pf`) to allocate
+ *
+ * This should only be called on the writer, after `mpf&rarr;spliced_pf` has
+ * been populated. From then on, the writer thread has its own copy of the
+ * PSRFITS struct (which keeps track of the open file, the row number, etc.),
+ * and the only part of `mpf&rarr;spliced_pf` that the caller should use is
+ * the set of subint buffers, which are swapped for spare ones each time
+ * vmWriteSplicedPsrfits() is called. With one or more spare subints, the
+ * next second can be gathered into one subint while the previous one is
+ * being written out.
+ *
+ * \see vmWriteSplicedPsrfits()
+ * \see vmFreePsrfitsWriter()
+ */
+void vmInitPsrfitsWriter( mpi_psrfits *mpf, int nbuffers )
+{
+    if (nbuffers < 1)
+    {
+        fprintf( stderr, "error: vmInitPsrfitsWriter: number of buffers (%d) "
+                "must be >= 1\n", nbuffers );
+        exit(EXIT_FAILURE);
+    }
+
+    psrfits_writer *pw = (psrfits_writer *)malloc( sizeof(psrfits_writer) );
+
+    pw->pf = mpf->spliced_pf;
+
+    // Allocate the pool of spare subints, which all start off free
+    size_t nvals = mpf->spliced_pf.hdr.nchan * mpf->spliced_pf.hdr.npol;
+
+    pw->nbuffers     = nbuffers;
+    pw->free_subints = (psrfits_subint *)malloc( nbuffers * sizeof(psrfits_subint) );
+    pw->pending      = (psrfits_subint *)malloc( nbuffers * sizeof(psrfits_subint) );
+
+    int b;
+    for (b = 0; b < nbuffers; b++)
+    {
+        pw->free_subints[b].data    = (unsigned char *)malloc( mpf->spliced_pf.sub.bytes_per_subint );
+        pw->free_subints[b].offsets = (float *)malloc( nvals * sizeof(float) );
+        pw->free_subints[b].scales  = (float *)malloc( nvals * sizeof(float) );
+    }
+
+    // (4-bit samples have to be unpacked for psrfits_utils to write them)
+    pw->unpacked = NULL;
+    if (mpf->spliced_pf.hdr.nbits == 4)
+        pw->unpacked = (unsigned char *)malloc( 2*mpf->spliced_pf.sub.bytes_per_subint );
+
+    pw->nfree        = nbuffers;
+    pw->pending_head = 0;
+    pw->npending     = 0;
+    pw->shutdown     = false;
+
+    pthread_mutex_init( &pw->mutex, NULL );
+    pthread_cond_init( &pw->item_ready, NULL );
+    pthread_cond_init( &pw->buffer_free, NULL );
+
+    if (pthread_create( &pw->thread, NULL, vmPsrfitsWriterWorker, pw ) != 0)
+    {
+        fprintf( stderr, "error: vmInitPsrfitsWriter: could not create "
+                "writer thread\n" );
+        exit(EXIT_FAILURE);
+    }
+
+    mpf->writer = pw;
+}
+
+/**
+ * Writes the spliced subint to the PSRFITS file.
+ *
+ * @param mpf The `mpi_psrfits` struct whose spliced subint is to be written
+ *
+ * This should only be called on the writer, after wait_splice_psrfits().
+ * If a writer thread has been started (with vmInitPsrfitsWriter()), the
+ * subint is handed over to it, and `mpf&rarr;spliced_pf` is given a spare
+ * set of subint buffers to be gathered into next; this only blocks if all
+ * the spare subints are still waiting to be written. Otherwise, the subint
+ * is written straight away.
+ */
+void vmWriteSplicedPsrfits( mpi_psrfits *mpf )
+{
+    psrfits_writer *pw = mpf->writer;
+
+    if (pw == NULL)
+    {
+        vmWritePsrfitsSubint( &(mpf->spliced_pf), NULL );
+        return;
+    }
+
+    pthread_mutex_lock( &pw->mutex );
+
+    // Wait for a free subint to swap in
+    while (pw->nfree == 0)
+        pthread_cond_wait( &pw->buffer_free, &pw->mutex );
+
+    psrfits_subint empty = pw->free_subints[--pw->nfree];
+
+    // Queue up the full one (there is always room, since the queue never
+    // holds more than nbuffers items)
+    psrfits_subint *full = &pw->pending[(pw->pending_head + pw->npending) % pw->nbuffers];
+    full->data    = mpf->spliced_pf.sub.data;
+    full->offsets = mpf->spliced_pf.sub.dat_offsets;
+    full->scales  = mpf->spliced_pf.sub.dat_scales;
+    pw->npending++;
+
+    pthread_cond_signal( &pw->item_ready );
+    pthread_mutex_unlock( &pw->mutex );
+
+    mpf->spliced_pf.sub.data        = empty.data;
+    mpf->spliced_pf.sub.rawdata     = empty.data;
+    mpf->spliced_pf.sub.dat_offsets = empty.offsets;
+    mpf->spliced_pf.sub.dat_scales  = empty.scales;
+}
+
+/**
+ * Finishes writing any queued subints, and stops the PSRFITS writer thread.
+ *
+ * @param mpf The `mpi_psrfits` struct whose writer is to be freed
+ *
+ * Once all the subints have been written, the writer thread's copy of the
+ * PSRFITS struct is copied back into `mpf&rarr;spliced_pf` (keeping the
+ * latter's subint buffers), and the spare subints are freed.
+ */
+void vmFreePsrfitsWriter( mpi_psrfits *mpf )
+{
+    psrfits_writer *pw = mpf->writer;
+
+    // If there is no writer thread, silently do nothing
+    if (pw == NULL)
+        return;
+
+    // Tell the writer to stop once everything has been written
+    pthread_mutex_lock( &pw->mutex );
+    pw->shutdown = true;
+    pthread_cond_broadcast( &pw->item_ready );
+    pthread_mutex_unlock( &pw->mutex );
+
+    pthread_join( pw->thread, NULL );
+
+    // Hand the file state back
+    psrfits_subint current = {
+        mpf->spliced_pf.sub.data,
+        mpf->spliced_pf.sub.dat_offsets,
+        mpf->spliced_pf.sub.dat_scales
+    };
+
+    mpf->spliced_pf                 = pw->pf;
+    mpf->spliced_pf.sub.data        = current.data;
+    mpf->spliced_pf.sub.rawdata     = current.data;
+    mpf->spliced_pf.sub.dat_offsets = current.offsets;
+    mpf->spliced_pf.sub.dat_scales  = current.scales;
+
+    // All the spare subints are now back in the pool
+    int b;
+    for (b = 0; b < pw->nfree; b++)
+    {
+        free( pw->free_subints[b].data    );
+        free( pw->free_subints[b].offsets );
+        free( pw->free_subints[b].scales  );
+    }
+
+    pthread_mutex_destroy( &pw->mutex );
+    pthread_cond_destroy( &pw->item_ready );
+    pthread_cond_destroy( &pw->buffer_free );
+
+    free( pw->free_subints );
+    free( pw->pending );
+    free( pw->unpacked );
+    free( pw );
+
+    mpf->writer = NULL;
+}
+
+/**
+ * Creates a shared memory ring buffer for the spliced output of an
+ * `mpi_psrfits` struct.
+ *
+ * @param mpf     The `mpi_psrfits` struct whose spliced output is to be
+ *                written
+ * @param nblocks The number of seconds the ring buffer can hold
+ *
+ * This should only be called on the writer, after vmInitMPIPsrfits(). The
+ * ring (see vmCreateShmRing()) is named `/[basefilename].dada`, and each
+ * of its blocks holds one second of the spliced (8-bit) detected data, in
+ * the same order as in a PSRFITS subint (time, then Stokes parameter, then
+ * frequency). The data are described by a DADA-style ASCII header, so
+ * that processes on the same node can pick them up without going via
+ * disk. As with 8-bit filterbank output, the per-second scales and
+ * offsets are not passed on. The PSRFITS writer thread started by
+ * vmInitMPIPsrfits() is not needed, and is freed.
+ *
+ * \see vmWritePsrfitsShm()
+ * \see vmFreePsrfitsShm()
+ */
+void vmInitPsrfitsShm( mpi_psrfits *mpf, int nblocks )
+{
+    struct psrfits *pf = &(mpf->spliced_pf);
+
+    // The spliced subints no longer go to a PSRFITS file, so the
+    // background PSRFITS writer (and its spare subints) is not needed
+    vmFreePsrfitsWriter( mpf );
+
+    char ascii_header[MWA_HEADER_SIZE] = MWA_HEADER_INIT;
+
+    ascii_header_set( ascii_header, "HDR_SIZE",   "%d", SHM_RING_HEADER_SIZE );
+    ascii_header_set( ascii_header, "MODE",       "%s", pf->hdr.obs_mode     );
+    ascii_header_set( ascii_header, "INSTRUMENT", "%s", pf->hdr.backend      );
+    ascii_header_set( ascii_header, "DATAFILE",   "%s", pf->basefilename     );
+
+    ascii_header_set( ascii_header, "MJD_START",  "%.12f", (double)pf->hdr.MJD_epoch );
+
+    ascii_header_set( ascii_header, "SOURCE",     "%s", pf->hdr.source       );
+    ascii_header_set( ascii_header, "RA",         "%s", pf->hdr.ra_str       );
+    ascii_header_set( ascii_header, "DEC",        "%s", pf->hdr.dec_str      );
+
+    ascii_header_set( ascii_header, "FREQ",       "%f", pf->hdr.fctr         );
+    ascii_header_set( ascii_header, "BW",         "%f", pf->hdr.BW           );
+    ascii_header_set( ascii_header, "NCHAN",      "%d", pf->hdr.nchan        );
+    ascii_header_set( ascii_header, "TSAMP",      "%f", pf->hdr.dt * 1e6     );
+
+    ascii_header_set( ascii_header, "NBIT",       "%d", pf->hdr.nbits        );
+    ascii_header_set( ascii_header, "NDIM",       "%d", 1                    );
+    ascii_header_set( ascii_header, "NPOL",       "%d", pf->hdr.npol         );
+    ascii_header_set( ascii_header, "STATE",      "%s", (pf->hdr.npol == 1 ? "Intensity" : "Stokes") );
+    ascii_header_set( ascii_header, "ORDER",      "%s", "TSF"                );
+
+    ascii_header_set( ascii_header, "RESOLUTION", "%d", pf->sub.bytes_per_subint );
+    ascii_header_set( ascii_header, "NBLOCKS",    "%d", nblocks              );
+
+    char name[strlen(pf->basefilename) + 7];
+    sprintf( name, "/%s.dada", pf->basefilename );
+
+    mpf->shm = vmCreateShmRing( name, ascii_header, pf->sub.bytes_per_subint, nblocks );
+}
+
+/**
+ * Writes the spliced subint into the shared memory ring buffer.
+ *
+ * @param mpf The `mpi_psrfits` struct whose spliced subint is to be written
+ *
+ * This should only be called on the writer, after wait_splice_psrfits().
+ */
+void vmWritePsrfitsShm( mpi_psrfits *mpf )
+{
+    vmShmRingWrite( mpf->shm, mpf->spliced_pf.sub.data );
+}
+
+/**
+ * Marks the shared memory ring buffer as finished, and removes it.
+ *
+ * @param mpf The `mpi_psrfits` struct whose ring buffer is to be freed
+ */
+void vmFreePsrfitsShm( mpi_psrfits *mpf )
+{
+    vmFreeShmRing( mpf->shm );
+    mpf->shm = NULL;
+}
+
+/**
+ * The SUBINT columns that are the same for every coarse channel, in the
+ * order they are encoded by mpiio_psrfits_encode_head(). The first
+ * `MPIIO_PSRFITS_NSCALARS` have one value per row, and the rest have one
+ * value per channel.
+ */
+#define MPIIO_PSRFITS_NSCALARS  12
+static const char *mpiio_psrfits_head_names[MPIIO_PSRFITS_NHEAD_COLS] = {
+    "TSUBINT", "OFFS_SUB", "LST_SUB", "RA_SUB", "DEC_SUB", "GLON_SUB",
+    "GLAT_SUB", "FD_ANG", "POS_ANGLE", "PAR_ANGLE", "TEL_AZ", "TEL_ZEN",
+    "DAT_FREQ", "DAT_WTS"
+};
+
+/**
+ * Copies values into big-endian (i.e. FITS) byte order.
+ *
+ * @param dst  Where to put the copies
+ * @param src  The values to be copied
+ * @param size The size (in bytes) of each value
+ * @param n    The number of values
+ */
+static void mpiio_psrfits_big_endian( void *dst, const void *src, size_t size, size_t n )
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    unsigned char       *d = (unsigned char *)dst;
+    const unsigned char *s = (const unsigned char *)src;
+
+    size_t i, b;
+    for (i = 0; i < n; i++)
+        for (b = 0; b < size; b++)
+            d[i*size + b] = s[i*size + (size - 1 - b)];
+#else
+    memcpy( dst, src, size*n );
+#endif
+}
+
+/**
+ * Looks up where a column of a (binary) FITS table sits within each row.
+ *
+ * @param fptr   The FITS file, positioned at the table
+ * @param name   The name of the column
+ * @param col    The column description to be filled in
+ * @param status The cfitsio status
+ */
+static void mpiio_psrfits_get_column( fitsfile *fptr, const char *name,
+        mpiio_psrfits_column *col, int *status )
+{
+    int colnum;
+    fits_get_colnum( fptr, CASEINSEN, (char *)name, &colnum, status );
+    fits_get_coltype( fptr, colnum, &(col->typecode), &(col->repeat), NULL, status );
+
+    // cfitsio keeps the byte offset of each column of the current table
+    // (but has no function for asking for it)
+    if (*status == 0)
+        col->offset = fptr->Fptr->tableptr[colnum - 1].tbcol;
+}
+
+/**
+ * Creates the next PSRFITS file (header only), and works out where
+ * everything goes in its SUBINT table.
+ *
+ * @param mpf    The `mpi_psrfits` struct being written
+ * @param layout Filled with the position of the first row, the size of a
+ *               row, and the positions within a row of the DATA, DAT_OFFS
+ *               and DAT_SCL columns (in that order)
+ *
+ * This is only called on the writer. The file is created (and named) by
+ * psrfits_utils, exactly as it would be for psrfits_write_subint(), but
+ * with no rows. It is then closed, and read back to find the layout of
+ * the rows that the ranks will fill in.
+ */
+static void mpiio_psrfits_create( mpi_psrfits *mpf, long long layout[5] )
+{
+    mpiio_psrfits  *mi = mpf->mpiio;
+    struct psrfits *pf = &(mpf->spliced_pf);
+
+    if (psrfits_create( pf ) != 0)
+    {
+        fprintf( stderr, "error: mpiio_psrfits_create: could not create "
+                "'%s'. File exists?\n", pf->filename );
+        exit(EXIT_FAILURE);
+    }
+    fits_close_file( pf->fptr, &(pf->status) );
+    pf->fptr = NULL;
+
+    int status = 0;
+    fitsfile *fptr;
+    fits_open_file( &fptr, pf->filename, READONLY, &status );
+    fits_movnam_hdu( fptr, BINARY_TBL, "SUBINT", 0, &status );
+
+    LONGLONG headstart, datastart, dataend, naxis1;
+    fits_get_hduaddrll( fptr, &headstart, &datastart, &dataend, &status );
+    fits_read_key( fptr, TLONGLONG, "NAXIS1", &naxis1, NULL, &status );
+
+    mpiio_psrfits_column data, offs, scl;
+    mpiio_psrfits_get_column( fptr, "DATA",     &data, &status );
+    mpiio_psrfits_get_column( fptr, "DAT_OFFS", &offs, &status );
+    mpiio_psrfits_get_column( fptr, "DAT_SCL",  &scl,  &status );
+
+    int c;
+    for (c = 0; c < MPIIO_PSRFITS_NHEAD_COLS; c++)
+        mpiio_psrfits_get_column( fptr, mpiio_psrfits_head_names[c],
+                &(mi->head_cols[c]), &status );
+
+    fits_close_file( fptr, &status );
+
+    if (status != 0)
+    {
+        fits_report_error( stderr, status );
+        fprintf( stderr, "error: mpiio_psrfits_create: could not read the "
+                "SUBINT table of '%s'\n", pf->filename );
+        exit(EXIT_FAILURE);
+    }
+
+    // Check that the rows are laid out the way they are about to be written
+    int nvals = pf->hdr.npol * pf->hdr.nchan;
+    bool ok = (data.typecode == TBYTE  && data.repeat == pf->sub.bytes_per_subint &&
+               offs.typecode == TFLOAT && offs.repeat == nvals &&
+               scl.typecode  == TFLOAT && scl.repeat  == nvals);
+
+    mi->head_size = data.offset;
+    if (offs.offset < mi->head_size)  mi->head_size = offs.offset;
+    if (scl.offset  < mi->head_size)  mi->head_size = scl.offset;
+
+    for (c = 0; c < MPIIO_PSRFITS_NHEAD_COLS; c++)
+    {
+        mpiio_psrfits_column *col = &(mi->head_cols[c]);
+        long repeat = (c < MPIIO_PSRFITS_NSCALARS ? 1 : pf->hdr.nchan);
+        int  size   = (col->typecode == TDOUBLE ? sizeof(double) : sizeof(float));
+
+        if ((col->typecode != TDOUBLE && col->typecode != TFLOAT) ||
+                col->repeat != repeat ||
+                col->offset + col->repeat*size > mi->head_size)
+            ok = false;
+    }
+
+    if (!ok)
+    {
+        fprintf( stderr, "error: mpiio_psrfits_create: unexpected SUBINT "
+                "table layout in '%s'\n", pf->filename );
+        exit(EXIT_FAILURE);
+    }
+
+    if (mi->head == NULL)
+        mi->head = (unsigned char *)calloc( mi->head_size, 1 );
+
+    layout[0] = datastart;
+    layout[1] = naxis1;
+    layout[2] = data.offset;
+    layout[3] = offs.offset;
+    layout[4] = scl.offset;
+}
+
+/**
+ * Encodes the columns that are the same for every coarse channel (times,
+ * positions, frequencies, weights) for the current row.
+ *
+ * @param mi The MPI-IO state of the `mpi_psrfits` struct being written
+ * @param pf The spliced PSRFITS struct, holding the current values
+ */
+static void mpiio_psrfits_encode_head( mpiio_psrfits *mi, struct psrfits *pf )
+{
+    double scalars[MPIIO_PSRFITS_NSCALARS] = {
+        pf->sub.tsubint, pf->sub.offs, pf->sub.lst, pf->sub.ra, pf->sub.dec,
+        pf->sub.glon, pf->sub.glat, pf->sub.feed_ang, pf->sub.pos_ang,
+        pf->sub.par_ang, pf->sub.tel_az, pf->sub.tel_zen
+    };
+    float *arrays[MPIIO_PSRFITS_NHEAD_COLS - MPIIO_PSRFITS_NSCALARS] = {
+        pf->sub.dat_freqs, pf->sub.dat_weights
+    };
+
+    int c;
+    long i;
+    for (c = 0; c < MPIIO_PSRFITS_NHEAD_COLS; c++)
+    {
+        mpiio_psrfits_column *col = &(mi->head_cols[c]);
+        unsigned char *cell = mi->head + col->offset;
+
+        for (i = 0; i < col->repeat; i++)
+        {
+            double value = (c < MPIIO_PSRFITS_NSCALARS ? scalars[c] :
+                    arrays[c - MPIIO_PSRFITS_NSCALARS][i]);
+
+            if (col->typecode == TDOUBLE)
+                mpiio_psrfits_big_endian( cell + i*sizeof(double), &value, sizeof(double), 1 );
+            else
+            {
+                float fvalue = value;
+                mpiio_psrfits_big_endian( cell + i*sizeof(float), &fvalue, sizeof(float), 1 );
+            }
+        }
+    }
+}
+
+/**
+ * Collectively writes each rank's part of a row.
+ *
+ * @param fh       The file being written
+ * @param disp     Where (in bytes) this rank's part starts
+ * @param filetype Which of the following bytes this rank's part covers
+ * @param buf      This rank's part
+ * @param nbytes   The size (in bytes) of this rank's part (may be 0)
+ */
+static void mpiio_psrfits_write( MPI_File fh, MPI_Offset disp,
+        MPI_Datatype filetype, const void *buf, int nbytes )
+{
+    MPI_File_set_view( fh, disp, MPI_BYTE, filetype, "native", MPI_INFO_NULL );
+    if (MPI_File_write_all( fh, buf, nbytes, MPI_BYTE, MPI_STATUS_IGNORE ) != MPI_SUCCESS)
+    {
+        fprintf( stderr, "error: mpiio_psrfits_write: could not write %d "
+                "bytes at offset %lld\n", nbytes, (long long)disp );
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Creates the next PSRFITS file, and opens it on all ranks.
+ *
+ * @param mpf The `mpi_psrfits` struct being written
+ *
+ * This must be called on all ranks at once.
+ */
+static void mpiio_psrfits_open( mpi_psrfits *mpf )
+{
+    mpiio_psrfits *mi = mpf->mpiio;
+
+    int rank;
+    MPI_Comm_rank( MPI_COMM_WORLD, &rank );
+
+    long long layout[5];
+    char filename[sizeof(mpf->spliced_pf.filename)];
+    if (rank == mpf->writer_id)
+    {
+        mpiio_psrfits_create( mpf, layout );
+        strcpy( filename, mpf->spliced_pf.filename );
+    }
+
+    MPI_Bcast( layout, 5, MPI_LONG_LONG, mpf->writer_id, MPI_COMM_WORLD );
+    MPI_Bcast( filename, sizeof(filename), MPI_CHAR, mpf->writer_id, MPI_COMM_WORLD );
+
+    mi->datastart = layout[0];
+    mi->row_size  = layout[1];
+    mi->data_col  = layout[2];
+    mi->offs_col  = layout[3];
+    mi->scl_col   = layout[4];
+    mi->nrows     = 0;
+
+    if (MPI_File_open( MPI_COMM_WORLD, filename, MPI_MODE_WRONLY,
+                MPI_INFO_NULL, &(mi->fh) ) != MPI_SUCCESS)
+    {
+        fprintf( stderr, "error: mpiio_psrfits_open: could not open '%s' "
+                "for writing\n", filename );
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Closes the current PSRFITS file on all ranks, and finalises its header.
+ *
+ * @param mpf The `mpi_psrfits` struct being written
+ *
+ * This must be called on all ranks at once. The rows were written behind
+ * cfitsio's back, so the writer finally updates NAXIS2 to match, which
+ * also has cfitsio pad the table out to a whole FITS block.
+ */
+static void mpiio_psrfits_close( mpi_psrfits *mpf )
+{
+    mpiio_psrfits *mi = mpf->mpiio;
+
+    MPI_File_close( &(mi->fh) );
+
+    int rank;
+    MPI_Comm_rank( MPI_COMM_WORLD, &rank );
+    if (rank != mpf->writer_id)
+        return;
+
+    int status = 0;
+    fitsfile *fptr;
+    fits_open_file( &fptr, mpf->spliced_pf.filename, READWRITE, &status );
+    fits_movnam_hdu( fptr, BINARY_TBL, "SUBINT", 0, &status );
+    fits_update_key( fptr, TINT, "NAXIS2", &(mi->nrows), NULL, &status );
+    fits_close_file( fptr, &status );
+
+    if (status != 0)
+    {
+        fits_report_error( stderr, status );
+        fprintf( stderr, "error: mpiio_psrfits_close: could not finalise "
+                "'%s'\n", mpf->spliced_pf.filename );
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Switches an `mpi_psrfits` struct over to having every rank write its own
+ * slice of the PSRFITS files.
+ *
+ * @param vm  The VCSBeam context struct
+ * @param mpf The `mpi_psrfits` struct to be written with MPI-IO
+ *
+ * This must be called on all ranks at once, after vmInitMPIPsrfits().
+ * Instead of gathering the coarse channels onto the writer
+ * (gather_splice_psrfits()) to be written there, vmWriteMPIIOPsrfits() is
+ * called on every rank, and each rank writes its own channels' samples,
+ * offsets and scales straight into their places in each row of the
+ * SUBINT table, in collective MPI-IO writes. The writer only creates each
+ * file's header (via psrfits_utils) and fills in the columns that are
+ * the same for every channel, so it no longer needs the spliced subint,
+ * which is freed (along with its background writer thread).
+ *
+ * The rank order is taken to be the channel order, as it is for
+ * gather_splice_psrfits().
+ *
+ * \see vmWriteMPIIOPsrfits()
+ * \see vmFreeMPIIOPsrfits()
+ */
+void vmInitMPIIOPsrfits( vcsbeam_context *vm, mpi_psrfits *mpf )
+{
+    struct psrfits *cpf = &(mpf->coarse_chan_pf);
+
+    if (vm->mpi_rank == mpf->writer_id)
+    {
+        vmFreePsrfitsWriter( mpf );
+
+        free( mpf->spliced_pf.sub.data );
+        mpf->spliced_pf.sub.data    = NULL;
+        mpf->spliced_pf.sub.rawdata = NULL;
+    }
+
+    mpiio_psrfits *mi = (mpiio_psrfits *)malloc( sizeof(mpiio_psrfits) );
+
+    mi->fh    = MPI_FILE_NULL;
+    mi->slice = vm->mpi_rank;
+    mi->nrows = 0;
+    mi->head  = NULL;
+
+    int nvals          = cpf->hdr.npol * cpf->hdr.nchan;
+    int spectrum_bytes = (cpf->hdr.nchan * cpf->hdr.nbits) / 8;
+
+    // Each rank's slice of a row has the same shape as its contribution to
+    // the spliced subint in gather_splice_psrfits()
+    MPI_Type_vector( cpf->hdr.nsblk*cpf->hdr.npol, spectrum_bytes,
+            vm->ncoarse_chans*spectrum_bytes, MPI_BYTE, &(mi->data_slice) );
+    MPI_Type_commit( &(mi->data_slice) );
+
+    MPI_Type_vector( cpf->hdr.npol, cpf->hdr.nchan*sizeof(float),
+            vm->ncoarse_chans*cpf->hdr.nchan*sizeof(float), MPI_BYTE, &(mi->vals_slice) );
+    MPI_Type_commit( &(mi->vals_slice) );
+
+    mi->swapped = (float *)malloc( 2*nvals*sizeof(float) );
+
+    mpf->mpiio = mi;
+}
+
+/**
+ * Writes one subint's worth of every rank's channels into the PSRFITS file.
+ *
+ * @param mpf The `mpi_psrfits` struct being written
+ *
+ * This must be called on all ranks at once, in place of
+ * wait_splice_psrfits() and the writing of the spliced subint, with the
+ * current subint in `mpf&rarr;coarse_chan_pf`. A new file is started (as
+ * psrfits_write_subint() would) whenever the previous one has
+ * `rows_per_file` rows.
+ */
+void vmWriteMPIIOPsrfits( mpi_psrfits *mpf )
+{
+    mpiio_psrfits  *mi  = mpf->mpiio;
+    struct psrfits *cpf = &(mpf->coarse_chan_pf);
+    struct psrfits *pf  = &(mpf->spliced_pf);
+
+    if (mi->fh == MPI_FILE_NULL)
+        mpiio_psrfits_open( mpf );
+
+    int rank;
+    MPI_Comm_rank( MPI_COMM_WORLD, &rank );
+
+    MPI_Offset row = mi->datastart + mi->nrows*mi->row_size;
+
+    // The columns that are the same for every channel
+    int head_size = 0;
+    if (rank == mpf->writer_id)
+    {
+        mpiio_psrfits_encode_head( mi, pf );
+        head_size = mi->head_size;
+    }
+    mpiio_psrfits_write( mi->fh, row, MPI_BYTE, mi->head, head_size );
+
+    // This rank's samples, offsets and scales
+    int nvals          = cpf->hdr.npol * cpf->hdr.nchan;
+    int spectrum_bytes = (cpf->hdr.nchan * cpf->hdr.nbits) / 8;
+
+    mpiio_psrfits_big_endian( mi->swapped,         cpf->sub.dat_offsets, sizeof(float), nvals );
+    mpiio_psrfits_big_endian( mi->swapped + nvals, cpf->sub.dat_scales,  sizeof(float), nvals );
+
+    mpiio_psrfits_write( mi->fh, row + mi->data_col + mi->slice*spectrum_bytes,
+            mi->data_slice, cpf->sub.data, cpf->sub.bytes_per_subint );
+    mpiio_psrfits_write( mi->fh, row + mi->offs_col + mi->slice*cpf->hdr.nchan*sizeof(float),
+            mi->vals_slice, mi->swapped, nvals*sizeof(float) );
+    mpiio_psrfits_write( mi->fh, row + mi->scl_col + mi->slice*cpf->hdr.nchan*sizeof(float),
+            mi->vals_slice, mi->swapped + nvals, nvals*sizeof(float) );
+
+    mi->nrows++;
+
+    // Keep the writer's bookkeeping as psrfits_write_subint() would
+    if (rank == mpf->writer_id)
+    {
+        pf->rownum++;
+        pf->tot_rows++;
+        pf->N += pf->hdr.nsblk;
+        pf->T += pf->sub.tsubint;
+
+        pf->sub.offs = roundf(pf->tot_rows * pf->sub.tsubint) + 0.5*pf->sub.tsubint;
+        pf->sub.lst += pf->sub.tsubint;
+    }
+
+    if (cpf->rows_per_file > 0 && mi->nrows >= cpf->rows_per_file)
+        mpiio_psrfits_close( mpf );
+}
+
+/**
+ * Finishes the last PSRFITS file written with MPI-IO, and frees the MPI-IO
+ * state of an `mpi_psrfits` struct.
+ *
+ * @param mpf The `mpi_psrfits` struct being written
+ *
+ * This must be called on all ranks at once.
+ */
+void vmFreeMPIIOPsrfits( mpi_psrfits *mpf )
+{
+    mpiio_psrfits *mi = mpf->mpiio;
+
+    // If MPI-IO is not being used, silently do nothing
+    if (mi == NULL)
+        return;
+
+    if (mi->fh != MPI_FILE_NULL)
+        mpiio_psrfits_close( mpf );
+
+    MPI_Type_free( &(mi->data_slice) );
+    MPI_Type_free( &(mi->vals_slice) );
+
+    free( mi->swapped );
+    free( mi->head );
+    free( mi );
+
+    mpf->mpiio = NULL;
+}
@@ -37,88 +37,180 @@ void float2int8_trunc(float *f, int n, float min, float max, int8_t *i)
     }
 }
 
+/**
+ * On x86-64 (with GCC's ifunc support), vmQuantiseVDIF() is compiled once
+ * per listed ISA, and the best one for the running CPU is chosen when the
+ * library is loaded. Elsewhere, it is compiled once, as normal.
+ */
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && defined(__linux__)
+#define VM_QUANTISE_CLONES __attribute__((target_clones("avx2","sse4.1","default")))
+#else
+#define VM_QUANTISE_CLONES
+#endif
+
+// The number of floats quantised at a time when scales/offsets are applied
+#define VM_QUANTISE_BLOCK  256
+
+/**
+ * Converts floats to 8-bit offset-binary integers in a single pass.
+ *
+ * @param[in]  f       The (source) buffer of floats
+ * @param      n       The number of floats in `f`
+ * @param      nchan   The number of channels (i.e. polarisations) the
+ *                     samples in `f` cycle through
+ * @param      ndim    The number of floats per sample (2 if complex, 1 if
+ *                     real)
+ * @param[in]  scales  Per-channel multiplicative scales (may be NULL)
+ * @param[in]  offsets Per-channel offsets, subtracted before scaling (may
+ *                     be NULL)
+ * @param      min     The smallest allowed (scaled) value
+ * @param      max     The largest allowed (scaled) value
+ * @param[out] i       The (destination) buffer of 8-bit integers
+ *
+ * This does the work of float2int8_trunc() followed by to_offset_binary(),
+ * but without writing the clamped values back into `f`, and without a
+ * second pass over `i`. The samples in `f` are assumed to be ordered with
+ * the channel index varying faster than the sample index, which is the
+ * case for the VDIF frames made by vdif_write_second().
+ *
+ * The inner loops are kept branchless (with the clamp written as
+ * comparisons, which GCC vectorises where it will not vectorise
+ * fminf()/fmaxf()), and with no divisions, the per-channel scales and
+ * offsets being laid out ahead of time over a block spanning a whole
+ * number of samples. Since neither `f` nor
+ * `i` is shared between calls, different beams may be quantised
+ * concurrently from different threads.
+ */
+VM_QUANTISE_CLONES
+void vmQuantiseVDIF( const float *restrict f, int n, int nchan, int ndim,
+        const float *scales, const float *offsets, float min, float max,
+        int8_t *restrict i )
+{
+    int j, k;
+    float v;
+
+    if (scales == NULL && offsets == NULL)
+    {
+        for (j = 0; j < n; j++)
+        {
+            v = f[j];
+            v = (v < min ? min : v);
+            v = (v > max ? max : v);
+            i[j] = (int8_t)((int)rintf( v ) ^ 0x80);
+        }
+        return;
+    }
+
+    // The scales and offsets repeat every `period` floats. They are laid
+    // out over a whole number of periods, at least VM_QUANTISE_BLOCK floats
+    // long, so that each block can be done in a loop with no divisions
+    int period = nchan * ndim;
+    int block  = period * ((VM_QUANTISE_BLOCK + period - 1) / period);
+    float block_scales[block], block_offsets[block];
+
+    for (k = 0; k < block; k++)
+    {
+        int c = (k / ndim) % nchan;
+        block_scales[k]  = (scales  != NULL ? scales[c]  : 1.0f);
+        block_offsets[k] = (offsets != NULL ? offsets[c] : 0.0f);
+    }
+
+    for (j = 0; j < n; j += block)
+    {
+        int len = (n - j < block ? n - j : block);
+        for (k = 0; k < len; k++)
+        {
+            v = (f[j + k] - block_offsets[k]) * block_scales[k];
+            v = (v < min ? min : v);
+            v = (v > max ? max : v);
+            i[j + k] = (int8_t)((int)rintf( v ) ^ 0x80);
+        }
+    }
+}
+
 /**
  * Writes a second's worth of data to a VDIF file
  *
  * @param vf A struct containing metadata about the target VDIF file
- * @param vhdr A pointer to the VDIF frame header buffer
  * @param data_buffer_vdif The data to be written out
  *
- * The data to be written out are first normalised and scaled to fit
- * in the range -126 to 127 and demoted to integers.
- * "Blocks" of data are then written to file, along with the appropriate
- * binary headers for each "frame", via the function vdif_write_data().
+ * The data to be written out are clipped to the range -126 to 127 and
+ * demoted to offset-binary integers by vmQuantiseVDIF().
+ * "Blocks" of data are then assembled in `vf&rarr;buffer`, along with the
+ * appropriate binary headers for each "frame" (starting from
+ * `vf&rarr;vhdr`), and handed over to be written via the function
+ * vdif_write_data().
  */
-void vdif_write_second( struct vdifinfo *vf, vdif_header *vhdr,
-                        float *data_buffer_vdif )
+void vdif_write_second( struct vdifinfo *vf, float *data_buffer_vdif )
 {
     float *data_buffer_ptr = data_buffer_vdif;
     size_t offset_out_vdif = 0;
 
-    int8_t *out_buffer_8_vdif = (int8_t *)malloc(vf->block_size);
+    int8_t *out_buffer_8_vdif = vf->buffer;
 
     while  (offset_out_vdif < vf->block_size) {
 
         // Add the current header
-        memcpy( (out_buffer_8_vdif + offset_out_vdif), vhdr, VDIF_HEADER_BYTES );
+        memcpy( (out_buffer_8_vdif + offset_out_vdif), &(vf->vhdr), VDIF_HEADER_BYTES );
 
         // Offset into the output array
         offset_out_vdif += VDIF_HEADER_BYTES;
 
-        // Convert from float to int8
-        float2int8_trunc( data_buffer_ptr, vf->sizeof_beam, -126.0, 127.0,
-                          (out_buffer_8_vdif + offset_out_vdif) );
-        to_offset_binary( (out_buffer_8_vdif + offset_out_vdif),
-                          vf->sizeof_beam );
+        // Convert from float to (offset binary) int8
+        vmQuantiseVDIF( data_buffer_ptr, vf->sizeof_beam, vf->nchan,
+                vf->iscomplex + 1, NULL, NULL, -126.0, 127.0,
+                (out_buffer_8_vdif + offset_out_vdif) );
 
         offset_out_vdif += vf->frame_length - VDIF_HEADER_BYTES; // increment output offset
         data_buffer_ptr += vf->sizeof_beam;
-        nextVDIFHeader( vhdr, vf->frame_rate );
+        nextVDIFHeader( &(vf->vhdr), vf->frame_rate );
     }
 
     // Write a full second's worth of samples
-    vdif_write_data( vf, out_buffer_8_vdif );
-    /*
-    for (int i = 0; i < 96; i++)
-    {
-        printf("%02x ", *(uint8_t *)(out_buffer_8_vdif + i));
-        if ((i % 16) == 15) printf("\n");
-        if ((i % 16) == 7) printf(" ");
-    }
-    printf("...\n");
-    */
-
-    free( out_buffer_8_vdif );
+    vdif_write_data( vf );
 }
 
 /**
  * Write VDIF data to file.
  *
  * @param vf A struct containing metadata about the target VDIF file
- * @param output The buffer to be written to file
  *
- * @todo Make sure that the header file is unneccesarily re-written each time
- * this function is called. If so, put this bit somewhere more sensible.
+ * The second of frames in `vf&rarr;buffer` is handed over to the write
+ * queue, to be appended to the (already open) `.vdif` file in the
+ * background, and an empty buffer is taken in its place. If the output is
+ * going to shared memory instead (see vmOpenVDIFShm()), the second of
+ * frames is copied into the ring buffer, and `vf&rarr;buffer` is reused.
+ *
+ * \see vmOpenVDIFFiles()
  */
-void vdif_write_data( struct vdifinfo *vf, int8_t *output )
+void vdif_write_data( struct vdifinfo *vf )
 {
-    // form the filename
-    // there is a standard naming convention
-    char  filename[1030];
-    sprintf( filename, "%s.vdif", vf->basefilename );
+    if (vf->shm != NULL)
+    {
+        vmShmRingWrite( vf->shm, vf->buffer );
+        return;
+    }
 
-    //fprintf(stderr,"Attempting to open VDIF file for writing: %s\n",filename);
-    FILE *fs = fopen( filename, "a" );
-    fwrite( output, vf->block_size, 1, fs );
-    fclose( fs );
+    vf->buffer = (int8_t *)vmWriteQueueSwapToFile( vf->wq, vf->buffer, vf->block_size, vf->fp );
+}
+
+/**
+ * Fills in the ASCII header that describes a VDIF stream.
+ *
+ * @param vf           A struct containing metadata about the target VDIF
+ *                     file
+ * @param ascii_header The header to fill in (of size `MWA_HEADER_SIZE`)
+ * @param datafile     The name of the file (or shared memory) the VDIF
+ *                     frames are written to
+ */
+static void vdif_make_header( struct vdifinfo *vf, char *ascii_header, const char *datafile )
+{
+    strcpy( ascii_header, MWA_HEADER_INIT );
 
-    // write a CPSR2 test header for DSPSR
-    char ascii_header[MWA_HEADER_SIZE] = MWA_HEADER_INIT;
-    
     ascii_header_set( ascii_header, "TELESCOPE",  "%s", vf->telescope   );
     ascii_header_set( ascii_header, "MODE",       "%s", vf->obs_mode    );
     ascii_header_set( ascii_header, "INSTRUMENT", "%s", "VDIF"          );
-    ascii_header_set( ascii_header, "DATAFILE",   "%s", filename        );
+    ascii_header_set( ascii_header, "DATAFILE",   "%s", datafile        );
 
     ascii_header_set( ascii_header, "MJD_START",  "%f", vf->MJD_start   );
     ascii_header_set( ascii_header, "MJD_EPOCH",  "%f", vf->MJD_epoch   );
@@ -135,12 +227,36 @@ void vdif_write_data( struct vdifinfo *vf, int8_t *output )
     ascii_header_set( ascii_header, "NBIT",       "%d", vf->bits        );
     ascii_header_set( ascii_header, "NDIM",       "%d", vf->iscomplex+1 );
     ascii_header_set( ascii_header, "NPOL",       "%d", vf->npol        );
+}
+
+/**
+ * Write the ASCII header file that accompanies a VDIF file.
+ *
+ * @param vf A struct containing metadata about the target VDIF file
+ *
+ * A CPSR2-style header (for DSPSR) is written to `[basefilename].hdr`.
+ * None of its contents change during an observation, so this need only be
+ * done once.
+ */
+void vdif_write_header( struct vdifinfo *vf )
+{
+    char filename[1030];
+    sprintf( filename, "%s.vdif", vf->basefilename );
+
+    // write a CPSR2 test header for DSPSR
+    char ascii_header[MWA_HEADER_SIZE];
+    vdif_make_header( vf, ascii_header, filename );
 
     sprintf( filename, "%s.hdr", vf->basefilename );
-    fs = fopen( filename,"w" );
+    FILE *fs = fopen( filename,"w" );
+    if (fs == NULL)
+    {
+        fprintf( stderr, "error: vdif_write_header: could not open '%s' for "
+                "writing\n", filename );
+        exit(EXIT_FAILURE);
+    }
     fwrite( ascii_header, MWA_HEADER_SIZE, 1, fs );
     fclose( fs );
-
 }
 
 /**
@@ -180,7 +296,7 @@ void vmPopulateVDIFHeader(
         vm->vf[p].iscomplex         = 1;   // (it is complex data)
         vm->vf[p].nchan             = 2;   // I am hardcoding this to 2 channels per thread - one per pol
         vm->vf[p].samples_per_frame = 128; // Hardcoding to 128 time-samples per frame
-        vm->vf[p].sample_rate       = vm->fine_sample_rate * vm->nfine_chan; // For coarse channelised data
+        vm->vf[p].sample_rate       = vm->obs_metadata->coarse_chan_width_hz; // For (critically sampled) coarse channelised data
         vm->vf[p].BW                = vm->obs_metadata->coarse_chan_width_hz / 1e6;  // (MHz)
 
         vm->vf[p].dataarraylength = (vm->vf[p].nchan * (vm->vf[p].iscomplex+1) * vm->vf[p].samples_per_frame); // = 512
@@ -188,7 +304,16 @@ void vmPopulateVDIFHeader(
         vm->vf[p].threadid      = 0;
         sprintf( vm->vf[p].stationid, "mw" );
 
-        vm->vf[p].frame_rate = vm->fine_sample_rate;                                                      // = 10000
+        // Each second must be made up of whole frames
+        if (vm->vf[p].sample_rate % vm->vf[p].samples_per_frame != 0)
+        {
+            fprintf( stderr, "error: vmPopulateVDIFHeader: sample rate (%d Hz) "
+                    "is not a multiple of %lu samples per frame\n",
+                    vm->vf[p].sample_rate, vm->vf[p].samples_per_frame );
+            exit(EXIT_FAILURE);
+        }
+
+        vm->vf[p].frame_rate = vm->vf[p].sample_rate / vm->vf[p].samples_per_frame;                      // = 10000
         vm->vf[p].block_size = vm->vf[p].frame_length * vm->vf[p].frame_rate;                              // = 5440000
 
         // A single frame (128 samples). Remember vf.nchan is kludged to npol
@@ -215,6 +340,7 @@ void vmPopulateVDIFHeader(
         vm->vf[p].b_scales   = (float *)malloc( sizeof(float) * vm->vf[p].nchan );
         vm->vf[p].b_offsets  = (float *)malloc( sizeof(float) * vm->vf[p].nchan );
         vm->vf[p].got_scales = 1;
+        vm->vf[p].shm        = NULL;
 
         strncpy( vm->vf[p].telescope, "MWA", 24);
         strncpy( vm->vf[p].obs_mode,  "PSR", 8);
@@ -259,3 +385,129 @@ void to_offset_binary(int8_t *i, int n)
     }
 }
 
+
+/**
+ * Opens the VDIF output files, ready for writing.
+ *
+ * @param vm       The VCSBeam context struct
+ * @param nbuffers The number of seconds (across all pointings) that can be
+ *                 waiting to be written at once
+ *
+ * This should be called after vmPopulateVDIFHeader(). For each pointing,
+ * the `.vdif` file is opened (and stays open until vmCloseVDIFFiles() is
+ * called), the `.hdr` file is written, and a (pinned) buffer for one
+ * second of frames is allocated. The pointings share a write queue with a
+ * single writer thread, so that converting the next second's data
+ * overlaps with writing out the previous one. Each pointing starts from
+ * its own copy of the frame header in `vm&rarr;vhdr`.
+ *
+ * \see vmCloseVDIFFiles()
+ */
+void vmOpenVDIFFiles( vcsbeam_context *vm, int nbuffers )
+{
+    write_queue *wq = vmInitWriteQueue( vm->vf[0].block_size, nbuffers, 1 );
+
+    char filename[1030];
+    unsigned int p;
+    for (p = 0; p < vm->npointing; p++)
+    {
+        struct vdifinfo *vf = &(vm->vf[p]);
+
+        sprintf( filename, "%s.vdif", vf->basefilename );
+        vf->fp = fopen( filename, "w" );
+        if (vf->fp == NULL)
+        {
+            fprintf( stderr, "error: vmOpenVDIFFiles: could not open '%s' for "
+                    "writing\n", filename );
+            exit(EXIT_FAILURE);
+        }
+
+        vdif_write_header( vf );
+
+        vf->vhdr = vm->vhdr;
+        vf->wq   = wq;
+        gpuMallocHost( (void **)&(vf->buffer), vf->block_size );
+    }
+}
+
+/**
+ * Finishes writing the VDIF output files, and closes them.
+ *
+ * @param vm The VCSBeam context struct
+ *
+ * This blocks until everything handed over by vdif_write_data() has been
+ * written.
+ */
+void vmCloseVDIFFiles( vcsbeam_context *vm )
+{
+    // Flush everything still queued (the queue is shared by all pointings)
+    vmFreeWriteQueue( vm->vf[0].wq );
+
+    unsigned int p;
+    for (p = 0; p < vm->npointing; p++)
+    {
+        fclose( vm->vf[p].fp );
+        gpuHostFree( vm->vf[p].buffer );
+
+        vm->vf[p].fp     = NULL;
+        vm->vf[p].buffer = NULL;
+        vm->vf[p].wq     = NULL;
+    }
+}
+
+/**
+ * Opens shared memory ring buffers for the VDIF output, ready for writing.
+ *
+ * @param vm      The VCSBeam context struct
+ * @param nblocks The number of seconds each ring buffer can hold
+ *
+ * This can be called instead of vmOpenVDIFFiles(), after
+ * vmPopulateVDIFHeader(). For each pointing, a ring buffer (see
+ * vmCreateShmRing()) named `/[basefilename].vdif` is created, each block of
+ * which holds one second of VDIF frames. Its ASCII header is the same as
+ * would have been written to the `.hdr` file, with the addition of the
+ * size of each block.
+ *
+ * \see vmCloseVDIFShm()
+ */
+void vmOpenVDIFShm( vcsbeam_context *vm, int nblocks )
+{
+    char name[1030];
+    char ascii_header[MWA_HEADER_SIZE];
+    unsigned int p;
+    for (p = 0; p < vm->npointing; p++)
+    {
+        struct vdifinfo *vf = &(vm->vf[p]);
+
+        sprintf( name, "/%s.vdif", vf->basefilename );
+
+        vdif_make_header( vf, ascii_header, name );
+        ascii_header_set( ascii_header, "HDR_SIZE",   "%d", SHM_RING_HEADER_SIZE );
+        ascii_header_set( ascii_header, "RESOLUTION", "%d", vf->block_size       );
+        ascii_header_set( ascii_header, "NBLOCKS",    "%d", nblocks              );
+
+        vf->shm    = vmCreateShmRing( name, ascii_header, vf->block_size, nblocks );
+        vf->vhdr   = vm->vhdr;
+        vf->fp     = NULL;
+        vf->wq     = NULL;
+        vf->buffer = (int8_t *)malloc( vf->block_size );
+    }
+}
+
+/**
+ * Marks the VDIF shared memory ring buffers as finished, and removes them.
+ *
+ * @param vm The VCSBeam context struct
+ */
+void vmCloseVDIFShm( vcsbeam_context *vm )
+{
+    unsigned int p;
+    for (p = 0; p < vm->npointing; p++)
+    {
+        vmFreeShmRing( vm->vf[p].shm );
+        free( vm->vf[p].buffer );
+
+        vm->vf[p].shm    = NULL;
+        vm->vf[p].buffer = NULL;
+    }
+}
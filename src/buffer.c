@@ -4,10 +4,17 @@
  *                                                      *
  ********************************************************/
 
+#define _GNU_SOURCE // For O_DIRECT
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <time.h>
 #include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <mwalib.h>
 
 #include "vcsbeam.h"
@@ -85,7 +92,14 @@ host_buffer *vmInitReadBuffer( size_t read_size, size_t copy_size )
  */
 void vmFreeReadBuffer( host_buffer *rb )
 {
-    gpuHostFree( rb->buffer );
+    // If there is no buffer, silently do nothing
+    if (rb == NULL)
+        return;
+
+    // (The buffer may not own any memory, e.g. if it was handed over to
+    // vmInitMmapReader())
+    if (rb->buffer != NULL)
+        gpuHostFree( rb->buffer );
 
     free( rb );
 }
@@ -122,3 +136,1538 @@ vm_error vmReadBufferCopyMargin( host_buffer *rb )
 
     return VM_SUCCESS;
 }
+
+/**
+ * The main loop of a write queue's writer thread.
+ *
+ * @param arg A pointer to the `write_queue`
+ *
+ * Takes items off the queue in order, writes each one to its file, and
+ * returns the buffer to the queue's pool of free buffers. Exits once the
+ * queue has been shut down and there is nothing left to write.
+ */
+static void *vmWriteQueueWorker( void *arg )
+{
+    write_queue *wq = (write_queue *)arg;
+    write_queue_item item;
+
+    while (1)
+    {
+        // Wait for something to write
+        pthread_mutex_lock( &wq->mutex );
+        while (wq->npending == 0 && !wq->shutdown)
+            pthread_cond_wait( &wq->item_ready, &wq->mutex );
+
+        if (wq->npending == 0) // (and therefore shutdown)
+        {
+            pthread_mutex_unlock( &wq->mutex );
+            break;
+        }
+
+        item = wq->pending[wq->pending_head];
+        wq->pending_head = (wq->pending_head + 1) % wq->nbuffers;
+        wq->npending--;
+        pthread_mutex_unlock( &wq->mutex );
+
+        // Write it out (without holding the lock)
+        if (item.file != NULL)
+        {
+            // Append to an already open file
+            if (fwrite( item.buffer, 1, item.size, item.file ) != item.size)
+            {
+                fprintf( stderr, "error: vmWriteQueueWorker: could not "
+                        "append %lu bytes to file\n", item.size );
+                exit(EXIT_FAILURE);
+            }
+        }
+        else
+        {
+            FILE *f = fopen( item.filename, "w" );
+            if (f == NULL)
+            {
+                fprintf( stderr, "error: vmWriteQueueWorker: could not open "
+                        "'%s' for writing\n", item.filename );
+                exit(EXIT_FAILURE);
+            }
+            if (fwrite( item.buffer, 1, item.size, f ) != item.size)
+            {
+                fprintf( stderr, "error: vmWriteQueueWorker: could not write "
+                        "%lu bytes to '%s'\n", item.size, item.filename );
+                exit(EXIT_FAILURE);
+            }
+            fclose( f );
+            free( item.filename );
+        }
+
+        // Return the buffer to the pool
+        pthread_mutex_lock( &wq->mutex );
+        wq->free_buffers[wq->nfree++] = item.buffer;
+        pthread_cond_signal( &wq->buffer_free );
+        pthread_mutex_unlock( &wq->mutex );
+    }
+
+    return NULL;
+}
+
+/**
+ * Initialise a queue for writing buffers to file in the background.
+ *
+ * @param buffer_size The size (in bytes) of each buffer
+ * @param nbuffers    The number of buffers to allocate for the queue
+ * @param nwriters    The number of threads doing the writing
+ *
+ * @return A pointer to a newly allocated write queue
+ *
+ * The queue owns a pool of `nbuffers` (pinned) host buffers, all of size
+ * `buffer_size`. A producer hands over a full buffer with
+ * vmWriteQueueSwap(), which returns an empty buffer from the pool in
+ * exchange, so that the producer can carry on while the data is written out
+ * by one of the `nwriters` writer threads. Because buffers are only ever
+ * exchanged, never copied, the full buffers handed over must also have been
+ * allocated with `gpuMallocHost()` and be of size `buffer_size`.
+ *
+ * The more buffers in the pool, the longer a burst of slow writes can be
+ * absorbed before the producer has to wait.
+ *
+ * \see vmWriteQueueSwap()
+ * \see vmFreeWriteQueue()
+ */
+write_queue *vmInitWriteQueue( size_t buffer_size, int nbuffers, int nwriters )
+{
+    if (nbuffers < 1 || nwriters < 1)
+    {
+        fprintf( stderr, "error: vmInitWriteQueue: number of buffers (%d) "
+                "and writers (%d) must both be >= 1\n", nbuffers, nwriters );
+        exit(EXIT_FAILURE);
+    }
+
+    write_queue *wq = (write_queue *)malloc( sizeof(write_queue) );
+
+    wq->buffer_size = buffer_size;
+    wq->nbuffers    = nbuffers;
+
+    // Allocate the pool of buffers, which all start off free
+    wq->free_buffers = (void **)malloc( nbuffers * sizeof(void *) );
+    wq->pending      = (write_queue_item *)malloc( nbuffers * sizeof(write_queue_item) );
+
+    int b;
+    for (b = 0; b < nbuffers; b++)
+        gpuMallocHost( &(wq->free_buffers[b]), buffer_size );
+
+    wq->nfree        = nbuffers;
+    wq->pending_head = 0;
+    wq->npending     = 0;
+    wq->shutdown     = false;
+
+    pthread_mutex_init( &wq->mutex, NULL );
+    pthread_cond_init( &wq->item_ready, NULL );
+    pthread_cond_init( &wq->buffer_free, NULL );
+
+    // Start the writers
+    wq->nwriters = nwriters;
+    wq->writers  = (pthread_t *)malloc( nwriters * sizeof(pthread_t) );
+
+    int w;
+    for (w = 0; w < nwriters; w++)
+    {
+        if (pthread_create( &wq->writers[w], NULL, vmWriteQueueWorker, wq ) != 0)
+        {
+            fprintf( stderr, "error: vmInitWriteQueue: could not create "
+                    "writer thread\n" );
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return wq;
+}
+
+/**
+ * Hand a full buffer over to a write queue in exchange for an empty one.
+ *
+ * @param wq          The write queue
+ * @param full_buffer The buffer containing data to be written
+ * @param size        The number of bytes of `full_buffer` to write
+ * @param filename    The file to write to (which will be overwritten)
+ *
+ * @return An empty buffer of size `wq&rarr;buffer_size`, which now belongs
+ *         to the caller
+ *
+ * If all of the queue's buffers are waiting to be written, this blocks
+ * until one of them has been.
+ * After this call, `full_buffer` belongs to the queue and must not be
+ * touched again by the caller.
+ */
+void *vmWriteQueueSwap( write_queue *wq, void *full_buffer, size_t size, const char *filename )
+{
+    if (size > wq->buffer_size)
+    {
+        fprintf( stderr, "error: vmWriteQueueSwap: requested size (%lu) "
+                "exceeds the buffer size (%lu)\n", size, wq->buffer_size );
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutex_lock( &wq->mutex );
+
+    // Wait for a free buffer to swap in
+    while (wq->nfree == 0)
+        pthread_cond_wait( &wq->buffer_free, &wq->mutex );
+
+    void *empty_buffer = wq->free_buffers[--wq->nfree];
+
+    // Queue up the full one (there is always room, since the queue never
+    // holds more than nbuffers items)
+    write_queue_item *item = &wq->pending[(wq->pending_head + wq->npending) % wq->nbuffers];
+    item->buffer   = full_buffer;
+    item->size     = size;
+    item->filename = strdup( filename );
+    item->file     = NULL;
+    wq->npending++;
+
+    pthread_cond_signal( &wq->item_ready );
+    pthread_mutex_unlock( &wq->mutex );
+
+    return empty_buffer;
+}
+
+/**
+ * Hand a full buffer over to a write queue, to be appended to an open file,
+ * in exchange for an empty one.
+ *
+ * @param wq          The write queue
+ * @param full_buffer The buffer containing data to be written
+ * @param size        The number of bytes of `full_buffer` to write
+ * @param file        The (open) file to append to
+ *
+ * @return An empty buffer of size `wq&rarr;buffer_size`, which now belongs
+ *         to the caller
+ *
+ * This is the same as vmWriteQueueSwap(), except that the data are appended
+ * to a file that stays open (and is closed by the caller once the queue
+ * has been freed), instead of overwriting a file that is opened for the
+ * purpose. So that appends to the same file happen in the order they were
+ * queued, the queue must have only one writer thread.
+ */
+void *vmWriteQueueSwapToFile( write_queue *wq, void *full_buffer, size_t size, FILE *file )
+{
+    if (wq->nwriters != 1)
+    {
+        fprintf( stderr, "error: vmWriteQueueSwapToFile: appending needs a "
+                "queue with exactly one writer (not %d)\n", wq->nwriters );
+        exit(EXIT_FAILURE);
+    }
+
+    if (size > wq->buffer_size)
+    {
+        fprintf( stderr, "error: vmWriteQueueSwapToFile: requested size (%lu) "
+                "exceeds the buffer size (%lu)\n", size, wq->buffer_size );
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutex_lock( &wq->mutex );
+
+    // Wait for a free buffer to swap in
+    while (wq->nfree == 0)
+        pthread_cond_wait( &wq->buffer_free, &wq->mutex );
+
+    void *empty_buffer = wq->free_buffers[--wq->nfree];
+
+    write_queue_item *item = &wq->pending[(wq->pending_head + wq->npending) % wq->nbuffers];
+    item->buffer   = full_buffer;
+    item->size     = size;
+    item->filename = NULL;
+    item->file     = file;
+    wq->npending++;
+
+    pthread_cond_signal( &wq->item_ready );
+    pthread_mutex_unlock( &wq->mutex );
+
+    return empty_buffer;
+}
+
+/**
+ * Finish writing everything in a write queue, and free it.
+ *
+ * @param wq The write queue to be freed
+ *
+ * This blocks until all pending buffers have been written, then stops the
+ * writer threads and frees the pool of buffers.
+ */
+void vmFreeWriteQueue( write_queue *wq )
+{
+    // If there is no queue, silently do nothing
+    if (wq == NULL)
+        return;
+
+    // Tell the writers to stop once everything has been written
+    pthread_mutex_lock( &wq->mutex );
+    wq->shutdown = true;
+    pthread_cond_broadcast( &wq->item_ready );
+    pthread_mutex_unlock( &wq->mutex );
+
+    int w;
+    for (w = 0; w < wq->nwriters; w++)
+        pthread_join( wq->writers[w], NULL );
+
+    // All buffers are now back in the pool
+    int b;
+    for (b = 0; b < wq->nfree; b++)
+        gpuHostFree( wq->free_buffers[b] );
+
+    pthread_mutex_destroy( &wq->mutex );
+    pthread_cond_destroy( &wq->item_ready );
+    pthread_cond_destroy( &wq->buffer_free );
+
+    free( wq->writers );
+    free( wq->free_buffers );
+    free( wq->pending );
+    free( wq );
+}
+
+/**
+ * Gets the full path of the voltage file containing the given GPS second.
+ *
+ * @param[in]  vm              The VCSBeam context struct
+ * @param[in]  coarse_chan_idx The (mwalib) idx of the coarse channel
+ * @param[in]  gps_second      The GPS second
+ * @param[out] path            A buffer (of at least 2*MAX_COMMAND_LENGTH
+ *                             bytes) for the path
+ *
+ * @return The GPS second at the start of the file
+ *
+ * If the file has been staged to local storage (see vmInitStager()), the
+ * path of the local copy is given instead.
+ */
+static uint64_t vmGetVoltFilePath( vcsbeam_context *vm, int coarse_chan_idx, uint64_t gps_second, char *path )
+{
+    uint64_t t0_gps_second = vm->obs_metadata->metafits_timesteps[0].gps_time_ms/1000;
+    uint64_t first_gps = t0_gps_second +
+        ((gps_second - t0_gps_second) / vm->seconds_per_file) * vm->seconds_per_file;
+
+    char filename[MAX_COMMAND_LENGTH];
+    memset( filename, 0, MAX_COMMAND_LENGTH );
+    vmGetVoltFilename( vm, coarse_chan_idx, first_gps, filename );
+    sprintf( path, "%s/%s", vm->datadir, filename );
+
+    // Read from the local copy, if there is one
+    if (vm->stager != NULL)
+        vmStagerGetPath( vm->stager, coarse_chan_idx, first_gps, path );
+
+    return first_gps;
+}
+
+/**
+ * Reads one or more seconds of MWAX voltages, leaving out the RF inputs
+ * that are not needed.
+ *
+ * @param vm              The VCSBeam context struct
+ * @param gps_second      The first GPS second to read
+ * @param nseconds        The number of (consecutive) seconds to read
+ * @param coarse_chan_idx The (mwalib) idx of the coarse channel to read
+ * @param dest            Where to put the data
+ * @param size            The number of bytes to read (exactly `nseconds`
+ *                        seconds)
+ *
+ * Within each voltage block of an MWAX file, each RF input's samples are
+ * contiguous. This reads each run of consecutive wanted inputs in one go
+ * (with `pread()`), straight from the file, and fills the inputs marked in
+ * `vm&rarr;skip_rf_input` with zeros instead of reading them. The
+ * resulting buffer is laid out exactly as if all inputs had been read with
+ * mwalib.
+ */
+static void vmReadSecondsSkippingInputs( vcsbeam_context *vm, uint64_t gps_second, int nseconds,
+        int coarse_chan_idx, void *dest, size_t size )
+{
+    size_t nblocks    = vm->vcs_metadata->num_voltage_blocks_per_second;
+    size_t block_size = vm->vcs_metadata->voltage_block_size_bytes;
+    size_t ninputs    = vm->obs_metadata->num_rf_inputs;
+    size_t input_size = block_size / ninputs;
+
+    if (size != nseconds*nblocks*block_size)
+    {
+        fprintf( stderr, "error: vmReadSecondsSkippingInputs: requested size "
+                "(%lu bytes) is not %d second(s) of data (%lu bytes)\n",
+                size, nseconds, nseconds*nblocks*block_size );
+        exit(EXIT_FAILURE);
+    }
+
+    char path[2*MAX_COMMAND_LENGTH];
+    int fd = -1;
+    uint64_t first_gps = 0;
+
+    int s;
+    size_t b, i, j;
+    for (s = 0; s < nseconds; s++)
+    {
+        // (Re)open the file if this second is in a different one
+        uint64_t file_gps = vmGetVoltFilePath( vm, coarse_chan_idx, gps_second + s, path );
+        if (fd < 0 || file_gps != first_gps)
+        {
+            if (fd >= 0)
+                close( fd );
+
+            fd = open( path, O_RDONLY );
+            if (fd < 0)
+            {
+                fprintf( stderr, "error: vmReadSecondsSkippingInputs: could not open "
+                        "'%s' for reading\n", path );
+                exit(EXIT_FAILURE);
+            }
+            first_gps = file_gps;
+        }
+
+        off_t second_offset = vm->vcs_metadata->data_file_header_size_bytes +
+            vm->vcs_metadata->delay_block_size_bytes +
+            (gps_second + s - first_gps) * nblocks * block_size;
+
+        for (b = 0; b < nblocks; b++)
+        {
+            char *block = (char *)dest + (s*nblocks + b)*block_size;
+            off_t block_offset = second_offset + b*block_size;
+
+            for (i = 0; i < ninputs; i = j)
+            {
+                // Find the run of inputs [i,j) that are all either wanted or not
+                for (j = i + 1; j < ninputs && vm->skip_rf_input[j] == vm->skip_rf_input[i]; j++);
+
+                char  *to     = block + i*input_size;
+                size_t nbytes = (j - i)*input_size;
+
+                if (vm->skip_rf_input[i])
+                {
+                    memset( to, 0, nbytes );
+                    continue;
+                }
+
+                off_t from = block_offset + i*input_size;
+                while (nbytes > 0)
+                {
+                    ssize_t nread = pread( fd, to, nbytes, from );
+                    if (nread <= 0)
+                    {
+                        fprintf( stderr, "error: vmReadSecondsSkippingInputs: could "
+                                "not read GPS second %lu from '%s'\n", gps_second + s, path );
+                        exit(EXIT_FAILURE);
+                    }
+                    to     += nread;
+                    from   += nread;
+                    nbytes -= nread;
+                }
+            }
+        }
+    }
+
+    close( fd );
+}
+
+/**
+ * Reads part of a file opened with `O_DIRECT`, keeping several reads in
+ * flight at once.
+ *
+ * @param dr     The direct reader
+ * @param fd     The file descriptor
+ * @param dest   Where to put the data
+ * @param offset Where (in bytes) to start reading in the file
+ * @param size   The number of bytes to read
+ *
+ * @return `true` if all `size` bytes were read, `false` otherwise
+ *
+ * The range is split into reads of (at most) `dr&rarr;chunk_size` bytes, of
+ * which up to `dr&rarr;queue_depth` are queued with io_uring at any one
+ * time. Without liburing, the reads are done one after another with
+ * `pread()`. The arguments must all satisfy the alignment requirements of
+ * `O_DIRECT`.
+ */
+static bool vmDirectReadRange( direct_reader *dr, int fd, char *dest, off_t offset, size_t size )
+{
+    size_t nchunks = (size + dr->chunk_size - 1) / dr->chunk_size;
+    size_t c;
+
+#ifdef HAVE_LIBURING
+    size_t nsubmitted = 0;
+    size_t ncompleted = 0;
+    bool   ok = true;
+
+    while (ncompleted < nsubmitted || (ok && nsubmitted < nchunks))
+    {
+        // Top up the submission queue
+        while (ok && nsubmitted < nchunks && nsubmitted - ncompleted < (size_t)dr->queue_depth)
+        {
+            struct io_uring_sqe *sqe = io_uring_get_sqe( &(dr->ring) );
+            if (sqe == NULL)
+                break;
+
+            c = nsubmitted;
+            size_t nbytes = (c == nchunks - 1 ? size - c*dr->chunk_size : dr->chunk_size);
+            io_uring_prep_read( sqe, fd, dest + c*dr->chunk_size, nbytes, offset + c*dr->chunk_size );
+            io_uring_sqe_set_data64( sqe, c );
+            nsubmitted++;
+        }
+
+        int res = io_uring_submit( &(dr->ring) );
+        if (res < 0)
+        {
+            fprintf( stderr, "error: vmDirectReadRange: could not submit "
+                    "reads: %s\n", strerror(-res) );
+            exit(EXIT_FAILURE);
+        }
+
+        // Wait for (at least) one read to finish
+        struct io_uring_cqe *cqe;
+        if (io_uring_wait_cqe( &(dr->ring), &cqe ) < 0)
+        {
+            // Nothing more can be reaped, so nothing is still writing into dest
+            return false;
+        }
+
+        c = io_uring_cqe_get_data64( cqe );
+        size_t nbytes = (c == nchunks - 1 ? size - c*dr->chunk_size : dr->chunk_size);
+        if (cqe->res < 0 || (size_t)cqe->res != nbytes)
+            ok = false;
+
+        io_uring_cqe_seen( &(dr->ring), cqe );
+        ncompleted++;
+    }
+
+    return ok;
+#else
+    for (c = 0; c < nchunks; c++)
+    {
+        size_t nbytes = (c == nchunks - 1 ? size - c*dr->chunk_size : dr->chunk_size);
+        ssize_t nread = pread( fd, dest + c*dr->chunk_size, nbytes, offset + c*dr->chunk_size );
+        if (nread < 0 || (size_t)nread != nbytes)
+            return false;
+    }
+
+    return true;
+#endif
+}
+
+/**
+ * Reads one or more seconds of MWAX voltages with `O_DIRECT`.
+ *
+ * @param vm              The VCSBeam context struct
+ * @param gps_second      The first GPS second to read
+ * @param nseconds        The number of (consecutive) seconds to read
+ * @param coarse_chan_idx The (mwalib) idx of the coarse channel to read
+ * @param dest            Where to put the data
+ * @param size            The number of bytes to read (exactly `nseconds`
+ *                        seconds)
+ *
+ * @return `true` if the data were read, `false` if they could not be read
+ *         this way (in which case the caller should read them some other
+ *         way)
+ *
+ * The seconds in each voltage file are contiguous, so each file's share of
+ * the request is a single range, which is read with vmDirectReadRange().
+ * This fails (without reading anything) if the destination, the size of a
+ * second, or the offset of the first voltage block is not suitably aligned,
+ * and fails if the filesystem does not support `O_DIRECT`.
+ */
+static bool vmDirectReadSeconds( vcsbeam_context *vm, uint64_t gps_second, int nseconds,
+        int coarse_chan_idx, void *dest, size_t size )
+{
+    size_t second_size = vm->vcs_metadata->num_voltage_blocks_per_second *
+                         vm->vcs_metadata->voltage_block_size_bytes;
+    off_t data_offset  = vm->vcs_metadata->data_file_header_size_bytes +
+                         vm->vcs_metadata->delay_block_size_bytes;
+
+    if (size != nseconds*second_size ||
+            (uintptr_t)dest % DIRECT_IO_ALIGNMENT != 0 ||
+            second_size % DIRECT_IO_ALIGNMENT != 0 ||
+            data_offset % DIRECT_IO_ALIGNMENT != 0)
+        return false;
+
+    char path[2*MAX_COMMAND_LENGTH];
+    int s, n;
+    for (s = 0; s < nseconds; s += n)
+    {
+        uint64_t first_gps = vmGetVoltFilePath( vm, coarse_chan_idx, gps_second + s, path );
+
+        // Read as many of the seconds as are in this file
+        n = vm->seconds_per_file - (gps_second + s - first_gps);
+        if (n > nseconds - s)
+            n = nseconds - s;
+
+        int fd = open( path, O_RDONLY | O_DIRECT );
+        if (fd < 0)
+            return false;
+
+        bool ok = vmDirectReadRange( vm->direct, fd, (char *)dest + s*second_size,
+                data_offset + (gps_second + s - first_gps)*second_size, n*second_size );
+
+        close( fd );
+
+        if (!ok)
+            return false;
+    }
+
+    return true;
+}
+
+/**
+ * Reads one or more seconds of voltages straight from the files.
+ *
+ * @param vm              The VCSBeam context struct
+ * @param gps_second      The first GPS second to read
+ * @param nseconds        The number of (consecutive) seconds to read
+ * @param coarse_chan_idx The (mwalib) idx of the coarse channel to read
+ * @param dest            Where to put the data
+ * @param size            The number of bytes to read (exactly `nseconds`
+ *                        seconds)
+ *
+ * This is used instead of mwalib when the files are being staged (see
+ * vmInitStager()), since mwalib only knows the files' original locations.
+ * The seconds in each file are contiguous (after the header and, for MWAX,
+ * the delay block), so each file's share of the request is a single range.
+ */
+static void vmReadSecondsFromFiles( vcsbeam_context *vm, uint64_t gps_second, int nseconds,
+        int coarse_chan_idx, void *dest, size_t size )
+{
+    size_t second_size = vm->vcs_metadata->num_voltage_blocks_per_second *
+                         vm->vcs_metadata->voltage_block_size_bytes;
+    off_t data_offset  = vm->vcs_metadata->data_file_header_size_bytes +
+                         vm->vcs_metadata->delay_block_size_bytes;
+
+    if (size != nseconds*second_size)
+    {
+        fprintf( stderr, "error: vmReadSecondsFromFiles: requested size "
+                "(%lu bytes) is not %d second(s) of data (%lu bytes)\n",
+                size, nseconds, nseconds*second_size );
+        exit(EXIT_FAILURE);
+    }
+
+    char path[2*MAX_COMMAND_LENGTH];
+    int s, n;
+    for (s = 0; s < nseconds; s += n)
+    {
+        uint64_t first_gps = vmGetVoltFilePath( vm, coarse_chan_idx, gps_second + s, path );
+
+        // Read as many of the seconds as are in this file
+        n = vm->seconds_per_file - (gps_second + s - first_gps);
+        if (n > nseconds - s)
+            n = nseconds - s;
+
+        int fd = open( path, O_RDONLY );
+        if (fd < 0)
+        {
+            fprintf( stderr, "error: vmReadSecondsFromFiles: could not open "
+                    "'%s' for reading\n", path );
+            exit(EXIT_FAILURE);
+        }
+
+        char  *to     = (char *)dest + s*second_size;
+        off_t  from   = data_offset + (gps_second + s - first_gps)*second_size;
+        size_t nbytes = n*second_size;
+        while (nbytes > 0)
+        {
+            ssize_t nread = pread( fd, to, nbytes, from );
+            if (nread <= 0)
+            {
+                fprintf( stderr, "error: vmReadSecondsFromFiles: could not "
+                        "read GPS second %lu from '%s'\n", gps_second + s, path );
+                exit(EXIT_FAILURE);
+            }
+            to     += nread;
+            from   += nread;
+            nbytes -= nread;
+        }
+
+        close( fd );
+    }
+}
+
+/**
+ * Reads one or more seconds of voltages from the observation files.
+ *
+ * @param vm              The VCSBeam context struct
+ * @param gps_second      The first GPS second to read
+ * @param nseconds        The number of (consecutive) seconds to read
+ * @param coarse_chan_idx The (mwalib) idx of the coarse channel to read
+ * @param dest            Where to put the data
+ * @param size            The number of bytes to read
+ * @param error_message   A buffer (of ERROR_MESSAGE_LEN bytes) for mwalib's
+ *                        error messages
+ *
+ * The data are read via mwalib (in a single request), unless some RF
+ * inputs of an MWAX observation have been marked as not needed (see
+ * vmSetSkippedRFInputs()), in which case only the needed ones are read, or
+ * a direct reader has been set up (see vmInitDirectReader()), in which case
+ * the page cache is bypassed where possible. Files that have been staged to
+ * local storage (see vmInitStager()) are read from there, and compressed
+ * files (see vmInitZstdReader()) are decompressed.
+ * This only touches the parts of `vm` that do not change while reading, so
+ * it is safe to call from a background thread (see vmInitReadAhead()).
+ */
+void vmReadSeconds( vcsbeam_context *vm, uint64_t gps_second, int nseconds, int coarse_chan_idx,
+        void *dest, size_t size, char *error_message )
+{
+    if (vm->zstd != NULL)
+    {
+        vmZstdReadSeconds( vm, gps_second, nseconds, coarse_chan_idx, dest, size );
+        return;
+    }
+
+    if (vm->skip_rf_input != NULL && vm->num_skipped_rf_inputs > 0)
+    {
+        vmReadSecondsSkippingInputs( vm, gps_second, nseconds, coarse_chan_idx, dest, size );
+        return;
+    }
+
+    if (vm->direct != NULL &&
+            vmDirectReadSeconds( vm, gps_second, nseconds, coarse_chan_idx, dest, size ))
+        return;
+
+    if (vm->stager != NULL)
+    {
+        vmReadSecondsFromFiles( vm, gps_second, nseconds, coarse_chan_idx, dest, size );
+        return;
+    }
+
+    if (mwalib_voltage_context_read_second(
+                vm->vcs_context,
+                gps_second,
+                nseconds,
+                coarse_chan_idx,
+                dest,
+                size,
+                error_message,
+                ERROR_MESSAGE_LEN ) != MWALIB_SUCCESS)
+    {
+        fprintf( stderr, "error: mwalib_voltage_context_read_file failed: %s", error_message );
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * The main loop of a read-ahead's reader thread.
+ *
+ * @param arg A pointer to the `read_ahead`
+ *
+ * Reads the seconds in `ra&rarr;gps_seconds` in order (starting from
+ * `ra&rarr;first_idx`), each into a free read buffer, and queues them up to
+ * be handed out by vmReadAheadNextSecond(). Exits once all the seconds have
+ * been read, or once the read-ahead is stopped.
+ */
+static void *vmReadAheadWorker( void *arg )
+{
+    read_ahead *ra = (read_ahead *)arg;
+    host_buffer *rb;
+    char error_message[ERROR_MESSAGE_LEN];
+
+    int s;
+    for (s = ra->first_idx; s < ra->nseconds; s++)
+    {
+        // Wait for somewhere to put the next second
+        pthread_mutex_lock( &ra->mutex );
+        while (ra->nfree == 0 && !ra->shutdown)
+            pthread_cond_wait( &ra->buffer_free, &ra->mutex );
+
+        if (ra->shutdown)
+        {
+            pthread_mutex_unlock( &ra->mutex );
+            break;
+        }
+
+        rb = ra->free_buffers[--ra->nfree];
+        pthread_mutex_unlock( &ra->mutex );
+
+        // Read it in (without holding the lock)
+        vmReadSeconds( ra->vm, ra->gps_seconds[s], 1, ra->coarse_chan_idx,
+                rb->read_ptr, rb->read_size, error_message );
+
+        // Queue it up to be handed out
+        pthread_mutex_lock( &ra->mutex );
+        ra->ready[(ra->ready_head + ra->nready) % ra->nbuffers] = rb;
+        ra->nready++;
+        pthread_cond_signal( &ra->second_ready );
+        pthread_mutex_unlock( &ra->mutex );
+    }
+
+    return NULL;
+}
+
+/**
+ * Start a read-ahead's reader thread at the context's current GPS second.
+ *
+ * @param vm The VCSBeam context struct
+ */
+static void vmStartReadAhead( vcsbeam_context *vm )
+{
+    read_ahead *ra = vm->reader;
+
+    ra->vm              = vm;
+    ra->gps_seconds     = vm->gps_seconds_to_process;
+    ra->nseconds        = vm->num_gps_seconds_to_process;
+    ra->first_idx       = vm->current_gps_idx;
+    ra->nhanded_out     = 0;
+    ra->coarse_chan_idx = vm->coarse_chan_idxs_to_process[0];
+    ra->shutdown        = false;
+
+    if (pthread_create( &ra->reader, NULL, vmReadAheadWorker, ra ) != 0)
+    {
+        fprintf( stderr, "error: vmStartReadAhead: could not create "
+                "reader thread\n" );
+        exit(EXIT_FAILURE);
+    }
+
+    ra->running = true;
+}
+
+/**
+ * Stop a read-ahead's reader thread, and discard any seconds it has read
+ * that have not yet been handed out.
+ *
+ * @param ra The read-ahead to be stopped
+ */
+static void vmStopReadAhead( read_ahead *ra )
+{
+    pthread_mutex_lock( &ra->mutex );
+    ra->shutdown = true;
+    pthread_cond_broadcast( &ra->buffer_free );
+    pthread_mutex_unlock( &ra->mutex );
+
+    pthread_join( ra->reader, NULL );
+
+    // Return the unclaimed seconds' buffers to the pool
+    while (ra->nready > 0)
+    {
+        ra->free_buffers[ra->nfree++] = ra->ready[ra->ready_head];
+        ra->ready_head = (ra->ready_head + 1) % ra->nbuffers;
+        ra->nready--;
+    }
+    ra->ready_head = 0;
+
+    ra->running = false;
+}
+
+/**
+ * Set up a background thread to read voltage data ahead of time.
+ *
+ * @param vm     The VCSBeam context struct
+ * @param nahead The maximum number of seconds to read ahead
+ *
+ * Once this is called, vmReadNextSecond() no longer reads from disk itself,
+ * but hands over the next second that has already been read by the reader
+ * thread, so that reading the next `nahead` seconds can overlap with the
+ * processing of the current one. To make this possible, `nahead` extra read
+ * buffers (of the same size as `vm&rarr;v`) are allocated, and `vm&rarr;v`
+ * is swapped between them on each call to vmReadNextSecond(). The usual
+ * rules still apply: a second must be unlocked (i.e. fully consumed) before
+ * the next one is requested, at which point its buffer is given back to the
+ * reader thread.
+ *
+ * The reader thread is started lazily on the first call to
+ * vmReadNextSecond(), and is restarted if the context has been rewound or
+ * pointed at a different coarse channel or set of seconds in the meantime
+ * (e.g. with vmSetChannelContextCoarseChan()).
+ *
+ * \see vmReadAheadNextSecond()
+ * \see vmFreeReadAhead()
+ */
+void vmInitReadAhead( vcsbeam_context *vm, int nahead )
+{
+    if (nahead < 1)
+    {
+        fprintf( stderr, "error: vmInitReadAhead: number of seconds to read "
+                "ahead (%d) must be >= 1\n", nahead );
+        exit(EXIT_FAILURE);
+    }
+
+    if (vm->v == NULL)
+    {
+        fprintf( stderr, "error: vmInitReadAhead: read buffer has not been "
+                "allocated\n" );
+        exit(EXIT_FAILURE);
+    }
+
+    if (vm->mapper != NULL || vm->batch != NULL)
+    {
+        fprintf( stderr, "error: vmInitReadAhead: cannot be used together "
+                "with memory-mapped or batched reading\n" );
+        exit(EXIT_FAILURE);
+    }
+
+    read_ahead *ra = (read_ahead *)malloc( sizeof(read_ahead) );
+
+    // The context's existing read buffer is used as one of the pool, and is
+    // considered to be "handed out" to begin with
+    ra->nbuffers     = nahead + 1;
+    ra->buffers      = (host_buffer **)malloc( ra->nbuffers * sizeof(host_buffer *) );
+    ra->free_buffers = (host_buffer **)malloc( ra->nbuffers * sizeof(host_buffer *) );
+    ra->ready        = (host_buffer **)malloc( ra->nbuffers * sizeof(host_buffer *) );
+
+    ra->buffers[0] = vm->v;
+    ra->nfree      = 0;
+
+    int b;
+    for (b = 1; b < ra->nbuffers; b++)
+    {
+        ra->buffers[b] = vmInitReadBuffer( vm->v->read_size, vm->v->copy_size );
+        ra->free_buffers[ra->nfree++] = ra->buffers[b];
+    }
+
+    ra->ready_head = 0;
+    ra->nready     = 0;
+    ra->running    = false;
+    ra->shutdown   = false;
+
+    pthread_mutex_init( &ra->mutex, NULL );
+    pthread_cond_init( &ra->second_ready, NULL );
+    pthread_cond_init( &ra->buffer_free, NULL );
+
+    vm->reader = ra;
+}
+
+/**
+ * Hand out the next second read by a read-ahead's reader thread.
+ *
+ * @param vm The VCSBeam context struct
+ *
+ * @return The read buffer containing the second `vm&rarr;current_gps_idx`
+ *
+ * This blocks until the second has been read. The margin (if any) of the
+ * current read buffer `vm&rarr;v` is copied to the returned buffer (see
+ * vmReadBufferCopyMargin()), and `vm&rarr;v` is then given back to the
+ * reader thread, so it must not be touched again until it is handed out
+ * again. This is normally only called from vmReadNextSecond(), which takes
+ * care of replacing `vm&rarr;v` with the returned buffer.
+ */
+host_buffer *vmReadAheadNextSecond( vcsbeam_context *vm )
+{
+    read_ahead *ra = vm->reader;
+
+    // If the context has moved on to different data since the reader
+    // thread was started, what it has read is of no use
+    if (ra->running &&
+            (ra->gps_seconds != vm->gps_seconds_to_process ||
+             ra->nseconds != vm->num_gps_seconds_to_process ||
+             ra->coarse_chan_idx != vm->coarse_chan_idxs_to_process[0] ||
+             ra->first_idx + ra->nhanded_out != (int)vm->current_gps_idx))
+    {
+        vmStopReadAhead( ra );
+    }
+
+    if (!ra->running)
+        vmStartReadAhead( vm );
+
+    // Wait for the next second to be ready
+    pthread_mutex_lock( &ra->mutex );
+    while (ra->nready == 0)
+        pthread_cond_wait( &ra->second_ready, &ra->mutex );
+
+    host_buffer *rb = ra->ready[ra->ready_head];
+    ra->ready_head = (ra->ready_head + 1) % ra->nbuffers;
+    ra->nready--;
+    pthread_mutex_unlock( &ra->mutex );
+
+    // Carry the margin over from the previous second
+    if (vm->v->copy_size > 0)
+        memcpy( rb->copy_to_ptr, vm->v->copy_from_ptr, vm->v->copy_size );
+
+    // Give the previous second's buffer back to the reader
+    pthread_mutex_lock( &ra->mutex );
+    ra->free_buffers[ra->nfree++] = vm->v;
+    pthread_cond_signal( &ra->buffer_free );
+    pthread_mutex_unlock( &ra->mutex );
+
+    ra->nhanded_out++;
+
+    return rb;
+}
+
+/**
+ * Stop reading ahead, and free the extra read buffers.
+ *
+ * @param vm The VCSBeam context struct
+ *
+ * The read buffer currently held in `vm&rarr;v` is kept (and still
+ * belongs to `vm`); all the others are freed.
+ */
+void vmFreeReadAhead( vcsbeam_context *vm )
+{
+    read_ahead *ra = vm->reader;
+
+    // If there is no read-ahead, silently do nothing
+    if (ra == NULL)
+        return;
+
+    if (ra->running)
+        vmStopReadAhead( ra );
+
+    int b;
+    for (b = 0; b < ra->nbuffers; b++)
+        if (ra->buffers[b] != vm->v)
+            vmFreeReadBuffer( ra->buffers[b] );
+
+    pthread_mutex_destroy( &ra->mutex );
+    pthread_cond_destroy( &ra->second_ready );
+    pthread_cond_destroy( &ra->buffer_free );
+
+    free( ra->buffers );
+    free( ra->free_buffers );
+    free( ra->ready );
+    free( ra );
+
+    vm->reader = NULL;
+}
+
+/**
+ * Look up an integer-valued keyword in an MWAX voltage file header.
+ *
+ * @param[in]  header      The (ASCII) header
+ * @param[in]  header_size The size (in bytes) of the header
+ * @param[in]  key         The keyword to look for
+ * @param[out] value       The keyword's value
+ *
+ * @return `true` if the keyword was found, `false` otherwise
+ *
+ * The header consists of lines of the form "KEY VALUE", padded out with
+ * NUL characters.
+ */
+static bool vmMwaxHeaderValue( const char *header, size_t header_size, const char *key, long long *value )
+{
+    size_t keylen = strlen( key );
+    const char *line = header;
+    const char *end  = header + header_size;
+
+    while (line < end && *line != '\0')
+    {
+        if (line + keylen < end &&
+                strncmp( line, key, keylen ) == 0 &&
+                (line[keylen] == ' ' || line[keylen] == '\t'))
+        {
+            return (sscanf( line + keylen, "%lld", value ) == 1);
+        }
+
+        // Move on to the next line
+        while (line < end && *line != '\n' && *line != '\0')
+            line++;
+        if (line < end && *line == '\n')
+            line++;
+    }
+
+    return false;
+}
+
+/**
+ * Unmap the file currently mapped by an mmap reader.
+ *
+ * @param mr The mmap reader
+ */
+static void vmMmapReaderUnmap( mmap_reader *mr )
+{
+    if (mr->filename == NULL)
+        return;
+
+    munmap( mr->map, mr->map_size );
+    close( mr->fd );
+    free( mr->filename );
+
+    mr->filename    = NULL;
+    mr->map         = NULL;
+    mr->map_size    = 0;
+    mr->last_second = NULL;
+}
+
+/**
+ * Map an MWAX voltage file into memory.
+ *
+ * @param vm        The VCSBeam context struct
+ * @param filename  The file to be mapped
+ * @param first_gps The GPS second at the start of the file
+ *
+ * The location of the first voltage block is worked out from the header
+ * size (HDR_SIZE in the header, which should agree with mwalib) and the size
+ * of the delay metadata block that follows it. The file must be large
+ * enough to hold all the voltage blocks mwalib says it should.
+ */
+static void vmMmapReaderMap( vcsbeam_context *vm, const char *filename, uint64_t first_gps )
+{
+    mmap_reader *mr = vm->mapper;
+
+    vmMmapReaderUnmap( mr );
+
+    mr->fd = open( filename, O_RDONLY );
+    if (mr->fd < 0)
+    {
+        fprintf( stderr, "error: vmMmapReaderMap: could not open '%s' for "
+                "reading\n", filename );
+        exit(EXIT_FAILURE);
+    }
+
+    struct stat st;
+    if (fstat( mr->fd, &st ) != 0)
+    {
+        fprintf( stderr, "error: vmMmapReaderMap: could not stat '%s'\n", filename );
+        exit(EXIT_FAILURE);
+    }
+
+    mr->map_size = st.st_size;
+    if (mr->map_size < vm->vcs_metadata->expected_voltage_data_file_size_bytes)
+    {
+        fprintf( stderr, "error: vmMmapReaderMap: '%s' is too small "
+                "(%lu bytes, expected %lu)\n", filename, mr->map_size,
+                vm->vcs_metadata->expected_voltage_data_file_size_bytes );
+        exit(EXIT_FAILURE);
+    }
+
+    mr->map = mmap( NULL, mr->map_size, PROT_READ, MAP_SHARED, mr->fd, 0 );
+    if (mr->map == MAP_FAILED)
+    {
+        fprintf( stderr, "error: vmMmapReaderMap: could not map '%s' into "
+                "memory\n", filename );
+        exit(EXIT_FAILURE);
+    }
+
+    // The file is read once, from start to finish
+    madvise( mr->map, mr->map_size, MADV_SEQUENTIAL );
+
+    // Find where the voltage blocks start
+    size_t header_size = vm->vcs_metadata->data_file_header_size_bytes;
+    long long value;
+
+    if (vmMwaxHeaderValue( (const char *)mr->map, header_size, "HDR_SIZE", &value ) &&
+            (size_t)value != header_size)
+    {
+        fprintf( stderr, "error: vmMmapReaderMap: '%s' has a header size of "
+                "%lld bytes, but mwalib expects %lu\n", filename, value, header_size );
+        exit(EXIT_FAILURE);
+    }
+
+    if (vmMwaxHeaderValue( (const char *)mr->map, header_size, "SUBOBS_ID", &value ) &&
+            (uint64_t)value != first_gps)
+    {
+        fprintf( stderr, "error: vmMmapReaderMap: '%s' starts at GPS second "
+                "%lld, but %lu was expected\n", filename, value, first_gps );
+        exit(EXIT_FAILURE);
+    }
+
+    mr->filename    = strdup( filename );
+    mr->first_gps   = first_gps;
+    mr->data_offset = header_size + vm->vcs_metadata->delay_block_size_bytes;
+}
+
+/**
+ * Set up a reader that maps MWAX voltage files directly into memory.
+ *
+ * @param vm The VCSBeam context struct
+ *
+ * Once this is called, vmReadNextSecond() no longer copies each second of
+ * data out of the voltage files into the read buffer. Instead, the file
+ * containing the second is mapped into memory (see vmMmapReaderGetSecond())
+ * and the read buffer `vm&rarr;v` is pointed straight at the relevant
+ * voltage blocks, which are then uploaded to the GPU directly from the page
+ * cache. The pinned memory originally allocated for the read buffer is no
+ * longer needed, and is freed.
+ *
+ * This only works for MWAX observations, whose voltage blocks for one
+ * second are contiguous within a file. For other observations, a warning is
+ * logged and the usual (mwalib) reader is kept. It also cannot be combined
+ * with vmInitReadAhead() (the kernel's own read-ahead, prompted by
+ * `madvise()`, takes its place).
+ *
+ * \see vmMmapReaderGetSecond()
+ * \see vmFreeMmapReader()
+ */
+void vmInitMmapReader( vcsbeam_context *vm )
+{
+    if (vm->obs_metadata->mwa_version != VCSMWAXv2)
+    {
+        logger_timed_message( vm->log, "Memory-mapped reading is only "
+                "available for MWAX observations; reading via mwalib instead" );
+        return;
+    }
+
+    if (vm->v == NULL)
+    {
+        fprintf( stderr, "error: vmInitMmapReader: read buffer has not been "
+                "allocated\n" );
+        exit(EXIT_FAILURE);
+    }
+
+    if (vm->reader != NULL || vm->batch != NULL)
+    {
+        fprintf( stderr, "error: vmInitMmapReader: cannot be used together "
+                "with read-ahead or batched reading\n" );
+        exit(EXIT_FAILURE);
+    }
+
+    if (vm->zstd != NULL)
+    {
+        fprintf( stderr, "error: vmInitMmapReader: cannot be used with "
+                "compressed input files\n" );
+        exit(EXIT_FAILURE);
+    }
+
+    if (vm->v->copy_size != 0)
+    {
+        fprintf( stderr, "error: vmInitMmapReader: read buffers with a "
+                "margin are not supported\n" );
+        exit(EXIT_FAILURE);
+    }
+
+    mmap_reader *mr = (mmap_reader *)malloc( sizeof(mmap_reader) );
+
+    mr->filename    = NULL;
+    mr->map         = NULL;
+    mr->map_size    = 0;
+    mr->last_second = NULL;
+    mr->second_size = vm->vcs_metadata->num_voltage_blocks_per_second *
+                      vm->vcs_metadata->voltage_block_size_bytes;
+
+    if (mr->second_size != vm->v->read_size)
+    {
+        fprintf( stderr, "error: vmInitMmapReader: one second of voltages "
+                "(%lu bytes) does not match the read size (%lu bytes)\n",
+                mr->second_size, vm->v->read_size );
+        exit(EXIT_FAILURE);
+    }
+
+    // The read buffer will only ever point into the mapped file
+    gpuHostFree( vm->v->buffer );
+    vm->v->buffer        = NULL;
+    vm->v->read_ptr      = NULL;
+    vm->v->copy_from_ptr = NULL;
+    vm->v->copy_to_ptr   = NULL;
+
+    vm->mapper = mr;
+}
+
+/**
+ * Get a pointer to one second of MWAX voltages, straight from the file.
+ *
+ * @param vm              The VCSBeam context struct
+ * @param gps_second      The GPS second to get
+ * @param coarse_chan_idx The (mwalib) idx of the coarse channel to get
+ *
+ * @return A pointer to the start of the second's voltage blocks
+ *
+ * The file containing the second is mapped into memory if it isn't
+ * already. The kernel is advised that the following second will be needed
+ * soon, and that the previously returned second is no longer needed, so that
+ * only a couple of seconds' worth of each file is resident at any one time.
+ * The returned pointer is valid until the next call.
+ */
+void *vmMmapReaderGetSecond( vcsbeam_context *vm, uint64_t gps_second, int coarse_chan_idx )
+{
+    mmap_reader *mr = vm->mapper;
+
+    // Work out which file the second lives in
+    char path[2*MAX_COMMAND_LENGTH];
+    uint64_t first_gps = vmGetVoltFilePath( vm, coarse_chan_idx, gps_second, path );
+
+    if (mr->filename == NULL || strcmp( mr->filename, path ) != 0)
+        vmMmapReaderMap( vm, path, first_gps );
+
+    char *second = (char *)mr->map + mr->data_offset +
+        (gps_second - first_gps) * mr->second_size;
+
+    if (second + mr->second_size > (char *)mr->map + mr->map_size)
+    {
+        fprintf( stderr, "error: vmMmapReaderGetSecond: GPS second %lu "
+                "lies beyond the end of '%s'\n", gps_second, mr->filename );
+        exit(EXIT_FAILURE);
+    }
+
+    // madvise() needs page-aligned addresses
+    uintptr_t page = sysconf( _SC_PAGESIZE );
+    uintptr_t map_start = (uintptr_t)mr->map;
+    uintptr_t map_end   = map_start + mr->map_size;
+
+    // The previous second can be dropped (only the pages wholly within it)
+    if (mr->last_second != NULL)
+    {
+        uintptr_t from = ((uintptr_t)mr->last_second + page - 1) / page * page;
+        uintptr_t to   = ((uintptr_t)mr->last_second + mr->second_size) / page * page;
+        if (to > from)
+            madvise( (void *)from, to - from, MADV_DONTNEED );
+    }
+
+    // The next second will be wanted soon
+    uintptr_t from = ((uintptr_t)second + mr->second_size) / page * page;
+    uintptr_t to   = (uintptr_t)second + 2*mr->second_size;
+    if (to > map_end)
+        to = map_end;
+    if (to > from)
+        madvise( (void *)from, to - from, MADV_WILLNEED );
+
+    mr->last_second = second;
+
+    return second;
+}
+
+/**
+ * Stop reading via memory maps, and unmap any mapped file.
+ *
+ * @param vm The VCSBeam context struct
+ *
+ * The read buffer `vm&rarr;v` is left without any memory of its own, so it
+ * should only be freed (with vmFreeVHost()) after this.
+ */
+void vmFreeMmapReader( vcsbeam_context *vm )
+{
+    mmap_reader *mr = vm->mapper;
+
+    // If there is no mmap reader, silently do nothing
+    if (mr == NULL)
+        return;
+
+    vmMmapReaderUnmap( mr );
+
+    if (vm->v != NULL)
+    {
+        vm->v->buffer   = NULL;
+        vm->v->read_ptr = NULL;
+    }
+
+    free( mr );
+
+    vm->mapper = NULL;
+}
+
+/**
+ * Set up a reader that reads several seconds of voltages at a time.
+ *
+ * @param vm           The VCSBeam context struct
+ * @param max_nseconds The maximum number of seconds to read at once
+ *
+ * Once this is called, vmReadNextSecond() only goes to disk when the second
+ * it needs is not already in the current batch, in which case it reads the
+ * next batch of (up to) `max_nseconds` consecutive seconds in a single
+ * request (see vmBatchReaderGetSecond()). Otherwise, it just points the read
+ * buffer `vm&rarr;v` at the second within the batch. Fewer, larger reads
+ * are much more efficient on parallel filesystems.
+ *
+ * The batch buffer is pinned, and takes the place of the pinned memory
+ * originally allocated for `vm&rarr;v`, which is freed. It cannot be combined
+ * with vmInitReadAhead() or vmInitMmapReader().
+ *
+ * \see vmBatchReaderGetSecond()
+ * \see vmFreeBatchReader()
+ */
+void vmInitBatchReader( vcsbeam_context *vm, int max_nseconds )
+{
+    if (max_nseconds < 1)
+    {
+        fprintf( stderr, "error: vmInitBatchReader: number of seconds per "
+                "read (%d) must be >= 1\n", max_nseconds );
+        exit(EXIT_FAILURE);
+    }
+
+    if (vm->v == NULL)
+    {
+        fprintf( stderr, "error: vmInitBatchReader: read buffer has not been "
+                "allocated\n" );
+        exit(EXIT_FAILURE);
+    }
+
+    if (vm->reader != NULL || vm->mapper != NULL)
+    {
+        fprintf( stderr, "error: vmInitBatchReader: cannot be used together "
+                "with read-ahead or memory-mapped reading\n" );
+        exit(EXIT_FAILURE);
+    }
+
+    if (vm->v->copy_size != 0)
+    {
+        fprintf( stderr, "error: vmInitBatchReader: read buffers with a "
+                "margin are not supported\n" );
+        exit(EXIT_FAILURE);
+    }
+
+    batch_reader *br = (batch_reader *)malloc( sizeof(batch_reader) );
+
+    br->second_size  = vm->v->read_size;
+    br->max_nseconds = max_nseconds;
+    gpuMallocHost( &(br->buffer), max_nseconds * br->second_size );
+
+    br->gps_seconds     = NULL;
+    br->first_idx       = 0;
+    br->nseconds        = 0;
+    br->coarse_chan_idx = -1;
+
+    // The read buffer will only ever point into the batch
+    gpuHostFree( vm->v->buffer );
+    vm->v->buffer        = NULL;
+    vm->v->read_ptr      = NULL;
+    vm->v->copy_from_ptr = NULL;
+    vm->v->copy_to_ptr   = NULL;
+
+    vm->batch = br;
+}
+
+/**
+ * Get a pointer to one second of voltages within the current batch.
+ *
+ * @param vm              The VCSBeam context struct
+ * @param gps_second      The GPS second to get (which must be
+ *                        `vm&rarr;gps_seconds_to_process[vm&rarr;current_gps_idx]`)
+ * @param coarse_chan_idx The (mwalib) idx of the coarse channel to get
+ *
+ * @return A pointer to the start of the second's data
+ *
+ * If the second is not in the current batch, a new batch is read, starting
+ * at `gps_second`. A batch holds as many consecutive seconds (still to be
+ * processed) as will fit, except that, for MWAX observations, a batch never
+ * extends past the end of the voltage file, so that each batch is a single
+ * contiguous read.
+ * The returned pointer is valid until the next batch is read.
+ */
+void *vmBatchReaderGetSecond( vcsbeam_context *vm, uint64_t gps_second, int coarse_chan_idx )
+{
+    batch_reader *br = vm->batch;
+    int idx = vm->current_gps_idx;
+
+    if (br->nseconds == 0 ||
+            br->gps_seconds != vm->gps_seconds_to_process ||
+            br->coarse_chan_idx != coarse_chan_idx ||
+            idx < br->first_idx ||
+            idx >= br->first_idx + br->nseconds)
+    {
+        // Work out how many seconds are left in the current file
+        int file_nseconds = br->max_nseconds;
+        if (vm->obs_metadata->mwa_version == VCSMWAXv2)
+        {
+            uint64_t t0_gps_second = vm->obs_metadata->metafits_timesteps[0].gps_time_ms/1000;
+            file_nseconds = vm->seconds_per_file - (gps_second - t0_gps_second) % vm->seconds_per_file;
+        }
+
+        // Take as many consecutive seconds as are allowed
+        int n = 1;
+        while (n < br->max_nseconds && n < file_nseconds &&
+                idx + n < (int)vm->num_gps_seconds_to_process &&
+                vm->gps_seconds_to_process[idx + n] == gps_second + n)
+            n++;
+
+        vmReadSeconds( vm, gps_second, n, coarse_chan_idx,
+                br->buffer, n * br->second_size, vm->error_message );
+
+        br->gps_seconds     = vm->gps_seconds_to_process;
+        br->first_idx       = idx;
+        br->nseconds        = n;
+        br->coarse_chan_idx = coarse_chan_idx;
+    }
+
+    return (char *)br->buffer + (idx - br->first_idx) * br->second_size;
+}
+
+/**
+ * Stop reading in batches, and free the batch buffer.
+ *
+ * @param vm The VCSBeam context struct
+ *
+ * The read buffer `vm&rarr;v` is left without any memory of its own, so it
+ * should only be freed (with vmFreeVHost()) after this.
+ */
+void vmFreeBatchReader( vcsbeam_context *vm )
+{
+    batch_reader *br = vm->batch;
+
+    // If there is no batch reader, silently do nothing
+    if (br == NULL)
+        return;
+
+    gpuHostFree( br->buffer );
+
+    if (vm->v != NULL)
+    {
+        vm->v->buffer   = NULL;
+        vm->v->read_ptr = NULL;
+    }
+
+    free( br );
+
+    vm->batch = NULL;
+}
+
+/**
+ * Set up a reader that reads MWAX voltage files with `O_DIRECT`.
+ *
+ * @param vm          The VCSBeam context struct
+ * @param queue_depth The number of reads to keep in flight at once
+ *
+ * Once this is called, vmReadSeconds() (and so vmReadNextSecond(), whether
+ * or not it reads ahead or in batches) reads the voltage files directly into
+ * the (pinned, and therefore page-aligned) read buffers, bypassing the page
+ * cache. Voltages are only ever read once, so caching them only adds a copy
+ * and crowds out other jobs on the node. If liburing is available, each
+ * read is split into chunks, up to `queue_depth` of which are kept in flight
+ * with io_uring; otherwise they are read one after the other.
+ *
+ * This only works for MWAX observations, whose voltage blocks for one
+ * second are contiguous within a file. For other observations, a warning is
+ * logged and the usual (mwalib) reader is kept. Any read that cannot be done
+ * this way (e.g. because the filesystem does not support `O_DIRECT`) falls
+ * back to mwalib too. It has no effect on memory-mapped reading, nor when
+ * the RF inputs of flagged tiles are skipped.
+ *
+ * The reads are only ever issued by one thread at a time (the read-ahead
+ * thread, if there is one), so each context needs its own direct reader.
+ *
+ * \see vmFreeDirectReader()
+ */
+void vmInitDirectReader( vcsbeam_context *vm, int queue_depth )
+{
+    if (vm->obs_metadata->mwa_version != VCSMWAXv2)
+    {
+        logger_timed_message( vm->log, "Direct I/O is only available for "
+                "MWAX observations; reading via mwalib instead" );
+        return;
+    }
+
+    if (queue_depth < 1)
+    {
+        fprintf( stderr, "error: vmInitDirectReader: queue depth (%d) must "
+                "be >= 1\n", queue_depth );
+        exit(EXIT_FAILURE);
+    }
+
+    if (vm->zstd != NULL)
+    {
+        fprintf( stderr, "error: vmInitDirectReader: cannot be used with "
+                "compressed input files\n" );
+        exit(EXIT_FAILURE);
+    }
+
+    direct_reader *dr = (direct_reader *)malloc( sizeof(direct_reader) );
+
+    dr->queue_depth = queue_depth;
+    dr->chunk_size  = DIRECT_IO_CHUNK_SIZE;
+
+#ifdef HAVE_LIBURING
+    int res = io_uring_queue_init( queue_depth, &(dr->ring), 0 );
+    if (res < 0)
+    {
+        fprintf( stderr, "error: vmInitDirectReader: could not set up "
+                "io_uring: %s\n", strerror(-res) );
+        exit(EXIT_FAILURE);
+    }
+#else
+    logger_timed_message( vm->log, "Built without liburing; direct I/O reads "
+            "will not be queued" );
+#endif
+
+    vm->direct = dr;
+}
+
+/**
+ * Stop reading with `O_DIRECT`.
+ *
+ * @param vm The VCSBeam context struct
+ */
+void vmFreeDirectReader( vcsbeam_context *vm )
+{
+    direct_reader *dr = vm->direct;
+
+    // If there is no direct reader, silently do nothing
+    if (dr == NULL)
+        return;
+
+#ifdef HAVE_LIBURING
+    io_uring_queue_exit( &(dr->ring) );
+#endif
+
+    free( dr );
+
+    vm->direct = NULL;
+}
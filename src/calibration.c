@@ -73,7 +73,6 @@ void vmLoadRTSSolution( vcsbeam_context *vm )
     uintptr_t nantpol = vm->cal_metadata->num_ant_pols; // = 2 (P, Q)
     uintptr_t nchan   = vm->cal_metadata->num_corr_fine_chans_per_coarse;
     uintptr_t vcs_nchan = vm->nfine_chan;
-    uintptr_t interp_factor = vcs_nchan / nchan;
     uintptr_t ant, ch; // For loop variables
 
     // Write out the channel --> gpubox number mapping
@@ -146,7 +145,9 @@ void vmLoadRTSSolution( vcsbeam_context *vm )
 
     // Form the "fine channel" DI gain (the "D" in Eqs. (28-30), Ord et al. (2019))
     // Do this for each of the _voltage_ observation's fine channels (use
-    // nearest-neighbour interpolation). This is "applying the bandpass" corrections.
+    // nearest-neighbour interpolation, which works whether the voltage fine
+    // channels are narrower or wider than the calibration channels). This is
+    // "applying the bandpass" corrections.
     uintptr_t cal_ch, obs_ant, dd_idx;
     uintptr_t d_idx;
     uintptr_t i; // (i)dx into rf_inputs
@@ -178,7 +179,7 @@ void vmLoadRTSSolution( vcsbeam_context *vm )
             // SM: Daniel Mitchell confirmed in an email dated 23 Mar 2017 that the
             // Bandpass matrices (Db) should be multiplied on the _right_ of the
             // DI Jones matrices (Dd).
-            cal_ch = ch / interp_factor;
+            cal_ch = ((2*ch + 1)*nchan) / (2*vcs_nchan);
             if (use_bandpass)
                 mult2x2d( Dd[dd_idx], Db[dd_idx][cal_ch], &(vm->D[d_idx]) );
             else
@@ -447,7 +448,6 @@ void vmLoadOffringaSolution( vcsbeam_context *vm )
     uint32_t ninput = vm->cal_metadata->num_rf_inputs;
     uintptr_t nantpol = vm->cal_metadata->num_ant_pols; // = 2 (P, Q)
     uintptr_t vcs_nchan = vm->nfine_chan;
-    uintptr_t interp_factor = vcs_nchan / nchan;
     uintptr_t nvispol = vm->cal_metadata->num_visibility_pols; // = 4 (PP, PQ, QP, QQ)
 
     // Make another dummy matrix for reading in
@@ -468,7 +468,6 @@ void vmLoadOffringaSolution( vcsbeam_context *vm )
     fprintf( stderr, "ninput = vm->cal_metadata->num_rf_inputs = %u\n", ninput );
     fprintf( stderr, "nantpol = vm->cal_metadata->num_ant_pols = %lu (should be 2)\n", nantpol );
     fprintf( stderr, "vcs_nchan = vm->nfine_chan = %lu\n", vcs_nchan );
-    fprintf( stderr, "interp_factor = vcs_nchan / nchan = %lu\n", interp_factor );
     fprintf( stderr, "nvispol = vm->cal_metadata->num_visibility_pols = %lu (should be 4)\n", nvispol );
 
     fprintf( stderr, "Quantities read from binary file, DEBUG\n" );
@@ -499,13 +498,11 @@ void vmLoadOffringaSolution( vcsbeam_context *vm )
         fprintf( stdout, "than the requested (%u) channels.\n", nChan );
         nChan = channelCount;
         nchan = nChan / vm->mpi_size;
-        interp_factor = vcs_nchan / nchan;
         fprintf( stdout, "Assuming calibration channels are "
                 "%d kHz\n", vm->cal_metadata->coarse_chan_width_hz / nchan / 1000 );
 #ifdef DEBUG
     fprintf( stderr, "New nChan = %u\n", nChan );
     fprintf( stderr, "New nchan = %u\n", nchan );
-    fprintf( stderr, "New interp_factor = %lu\n", interp_factor );
 #endif
     }
     if (coarse_chan_idx >= (int)vm->cal_metadata->num_metafits_coarse_chans)
@@ -538,9 +535,13 @@ void vmLoadOffringaSolution( vcsbeam_context *vm )
         // Get the antenna number
         ant = rfinput->ant;
 
-        // Loop over channels
-        for (ch = 0; ch < nchan; ch++)
+        // Loop over the voltage fine channels, and pick out the calibration
+        // channel that is nearest to each one (nearest-neighbour
+        // interpolation)
+        for (vch = 0; vch < vcs_nchan; vch++)
         {
+            ch = ((2*vch + 1)*nchan) / (2*vcs_nchan);
+
             // Translate from "fine channel number within coarse channel"
             // to "fine channel number within whole observation"
             Ch = ch + coarse_chan_idx * nchan;
@@ -565,15 +566,11 @@ void vmLoadOffringaSolution( vcsbeam_context *vm )
             if (isnan(Dread[0].x))
                 memset( Dread, 0, JONES_SIZE_BYTES );
 
-            // Copy this matrix into every corresponding "voltage" fine channel
-            for (vch = ch*interp_factor; vch < (ch + 1)*interp_factor; vch++)
-            {
-                // Get the destination index
-                d_idx = D_IDX(ant,vch,0,0,vcs_nchan,nantpol);
+            // Get the destination index
+            d_idx = D_IDX(ant,vch,0,0,vcs_nchan,nantpol);
 
-                // Copy it across
-                cp2x2( Dread, &(vm->D[d_idx]) );
-            }
+            // Copy it across
+            cp2x2( Dread, &(vm->D[d_idx]) );
         }
     }
 
@@ -971,7 +968,7 @@ void vmSetCustomTileFlags( vcsbeam_context *vm )
     char     *tilename; // The tilename in question
     Antenna  *Ant;      // The Antenna struct for a given tilename
     uint32_t  ant;      // The corresponding antenna number
-    uintptr_t nchan   = vm->obs_metadata->num_volt_fine_chans_per_coarse;
+    uintptr_t nchan   = vm->nfine_chan;
     uintptr_t nantpol = vm->obs_metadata->num_ant_pols; // = 2 (P, Q)
     uintptr_t ch;       // A particular fine channel
     uintptr_t d_idx;    // Idx into the D array
@@ -0,0 +1,575 @@
+/********************************************************
+ *                                                      *
+ * Licensed under the Academic Free License version 3.0 *
+ *                                                      *
+ ********************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#include <mwalib.h>
+
+#include "vcsbeam.h"
+
+/**
+ * The work shared by the threads decompressing one range of a file.
+ */
+struct zstd_job
+{
+    zstd_reader      *zr;
+    int               first_frame;     // The first frame to decompress (the start of the compressed buffer)
+    int               next_frame;      // The next frame to be claimed by a thread
+    int               last_frame;      // One past the last frame to decompress
+    char             *dest;            // Where the decompressed range goes
+    uint64_t          start;           // The start of the range (in the decompressed file)
+    uint64_t          end;             // The end of the range (in the decompressed file)
+    bool              ok;              // Cleared if any frame fails to decompress
+    pthread_mutex_t   mutex;
+};
+
+struct zstd_worker
+{
+    struct zstd_job  *job;
+    int               thread;          // Which of the reader's contexts/scratch buffers to use
+};
+
+/**
+ * Reads a little-endian 32-bit unsigned integer.
+ */
+static uint32_t vmZstdReadLE32( const uint8_t *ptr )
+{
+    return (uint32_t)ptr[0] | ((uint32_t)ptr[1] << 8) |
+        ((uint32_t)ptr[2] << 16) | ((uint32_t)ptr[3] << 24);
+}
+
+/**
+ * Opens a compressed file and reads its seek table.
+ *
+ * @param zr       The zstd reader
+ * @param filename The compressed file
+ *
+ * The file must be in the zstd seekable format, i.e. a series of
+ * independent zstd frames followed by a skippable frame holding the
+ * (compressed and decompressed) size of each one. Such files are made by,
+ * e.g., `t2sz` or zstd's `seekable_compression` example; a frame size of one
+ * voltage block is a good choice. If `filename` is already open, nothing is
+ * done.
+ */
+static void vmZstdOpen( zstd_reader *zr, const char *filename )
+{
+    if (zr->filename != NULL && strcmp( zr->filename, filename ) == 0)
+        return;
+
+    // Close the previous file
+    if (zr->filename != NULL)
+    {
+        close( zr->fd );
+        free( zr->filename );
+        free( zr->c_offsets );
+        free( zr->d_offsets );
+        zr->filename = NULL;
+    }
+
+    zr->fd = open( filename, O_RDONLY );
+    if (zr->fd < 0)
+    {
+        fprintf( stderr, "error: vmZstdOpen: could not open '%s' for reading\n",
+                filename );
+        exit(EXIT_FAILURE);
+    }
+
+    struct stat st;
+    fstat( zr->fd, &st );
+    size_t file_size = st.st_size;
+
+    // Read the seek table's footer
+    uint8_t footer[ZSTD_SEEKABLE_FOOTER];
+    if (file_size < ZSTD_SEEKABLE_FOOTER ||
+            pread( zr->fd, footer, ZSTD_SEEKABLE_FOOTER, file_size - ZSTD_SEEKABLE_FOOTER ) != ZSTD_SEEKABLE_FOOTER ||
+            vmZstdReadLE32( footer + 5 ) != ZSTD_SEEKABLE_MAGIC)
+    {
+        fprintf( stderr, "error: vmZstdOpen: '%s' is not in the zstd seekable "
+                "format\n", filename );
+        exit(EXIT_FAILURE);
+    }
+
+    zr->nframes = vmZstdReadLE32( footer );
+    size_t entry_size = (footer[4] & 0x80 ? 12 : 8); // (with or without checksums)
+    size_t table_size = zr->nframes * entry_size;
+
+    // The table sits inside a skippable frame (with an 8-byte header)
+    if (table_size + ZSTD_SEEKABLE_FOOTER + 8 > file_size)
+    {
+        fprintf( stderr, "error: vmZstdOpen: seek table of '%s' is corrupt\n",
+                filename );
+        exit(EXIT_FAILURE);
+    }
+
+    uint8_t *table = (uint8_t *)malloc( table_size );
+    if (pread( zr->fd, table, table_size, file_size - ZSTD_SEEKABLE_FOOTER - table_size ) != (ssize_t)table_size)
+    {
+        fprintf( stderr, "error: vmZstdOpen: could not read seek table of "
+                "'%s'\n", filename );
+        exit(EXIT_FAILURE);
+    }
+
+    zr->c_offsets = (uint64_t *)malloc( (zr->nframes + 1) * sizeof(uint64_t) );
+    zr->d_offsets = (uint64_t *)malloc( (zr->nframes + 1) * sizeof(uint64_t) );
+    zr->c_offsets[0] = 0;
+    zr->d_offsets[0] = 0;
+
+    size_t max_frame_size = 0;
+    int f;
+    for (f = 0; f < zr->nframes; f++)
+    {
+        uint32_t csize = vmZstdReadLE32( table + f*entry_size );
+        uint32_t dsize = vmZstdReadLE32( table + f*entry_size + 4 );
+        zr->c_offsets[f+1] = zr->c_offsets[f] + csize;
+        zr->d_offsets[f+1] = zr->d_offsets[f] + dsize;
+        if (dsize > max_frame_size)
+            max_frame_size = dsize;
+    }
+
+    free( table );
+
+    if (zr->c_offsets[zr->nframes] + 8 + table_size + ZSTD_SEEKABLE_FOOTER != file_size)
+    {
+        fprintf( stderr, "error: vmZstdOpen: seek table of '%s' does not "
+                "match the file size\n", filename );
+        exit(EXIT_FAILURE);
+    }
+
+    // Make sure each thread can hold a whole frame
+    if (max_frame_size > zr->scratch_size)
+    {
+        int t;
+        for (t = 0; t < zr->nthreads; t++)
+        {
+            free( zr->scratch[t] );
+            zr->scratch[t] = malloc( max_frame_size );
+        }
+        zr->scratch_size = max_frame_size;
+    }
+
+    zr->filename = (char *)malloc( strlen( filename ) + 1 );
+    strcpy( zr->filename, filename );
+}
+
+/**
+ * The main loop of a decompressing thread.
+ *
+ * @param arg A pointer to a `struct zstd_worker`
+ *
+ * Each thread claims frames in turn until none are left. A frame that lies
+ * wholly inside the wanted range is decompressed straight into place;
+ * otherwise, it is decompressed into the thread's scratch buffer, and only
+ * the wanted part is copied.
+ */
+static void *vmZstdWorker( void *arg )
+{
+    struct zstd_worker *w = (struct zstd_worker *)arg;
+    struct zstd_job *job = w->job;
+    zstd_reader *zr = job->zr;
+
+    while (1)
+    {
+        pthread_mutex_lock( &(job->mutex) );
+        int f = job->next_frame++;
+        pthread_mutex_unlock( &(job->mutex) );
+
+        if (f >= job->last_frame)
+            break;
+
+        uint64_t d0 = zr->d_offsets[f];
+        uint64_t d1 = zr->d_offsets[f+1];
+
+        // The part of the frame that is wanted
+        uint64_t from = (d0 > job->start ? d0 : job->start);
+        uint64_t to   = (d1 < job->end   ? d1 : job->end);
+
+        bool whole = (from == d0 && to == d1);
+        void *out  = (whole ? (void *)(job->dest + (d0 - job->start)) : zr->scratch[w->thread]);
+
+        bool ok = false;
+#ifdef HAVE_ZSTD
+        const char *src   = (char *)zr->cbuffer + (zr->c_offsets[f] - zr->c_offsets[job->first_frame]);
+        size_t      csize = zr->c_offsets[f+1] - zr->c_offsets[f];
+        size_t      res   = ZSTD_decompressDCtx( zr->dctxs[w->thread], out, d1 - d0, src, csize );
+        ok = (!ZSTD_isError( res ) && res == d1 - d0);
+#endif
+
+        if (ok && !whole)
+            memcpy( job->dest + (from - job->start), (char *)out + (from - d0), to - from );
+
+        if (!ok)
+        {
+            pthread_mutex_lock( &(job->mutex) );
+            job->ok = false;
+            pthread_mutex_unlock( &(job->mutex) );
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Decompresses part of a compressed file.
+ *
+ * @param zr       The zstd reader
+ * @param filename The compressed file
+ * @param dest     Where to put the decompressed data
+ * @param offset   Where (in the decompressed file) to start
+ * @param size     The number of (decompressed) bytes to get
+ *
+ * The compressed frames overlapping the range are read in one go, and then
+ * decompressed by `zr&rarr;nthreads` threads (including the calling one).
+ */
+static void vmZstdReadRange( zstd_reader *zr, const char *filename, char *dest,
+        uint64_t offset, size_t size )
+{
+    vmZstdOpen( zr, filename );
+
+    uint64_t end = offset + size;
+    if (end > zr->d_offsets[zr->nframes])
+    {
+        fprintf( stderr, "error: vmZstdReadRange: '%s' is too short (%lu "
+                "bytes when decompressed, but bytes up to %lu requested)\n",
+                filename, zr->d_offsets[zr->nframes], end );
+        exit(EXIT_FAILURE);
+    }
+
+    // Find the frames that overlap [offset, end)
+    int first = 0, last;
+    while (zr->d_offsets[first+1] <= offset)
+        first++;
+    for (last = first; last < zr->nframes && zr->d_offsets[last] < end; last++);
+
+    // Read all the compressed frames at once
+    size_t csize = zr->c_offsets[last] - zr->c_offsets[first];
+    if (csize > zr->cbuffer_size)
+    {
+        free( zr->cbuffer );
+        zr->cbuffer = malloc( csize );
+        zr->cbuffer_size = csize;
+    }
+
+    char  *to     = (char *)zr->cbuffer;
+    off_t  from   = zr->c_offsets[first];
+    size_t nbytes = csize;
+    while (nbytes > 0)
+    {
+        ssize_t nread = pread( zr->fd, to, nbytes, from );
+        if (nread <= 0)
+        {
+            fprintf( stderr, "error: vmZstdReadRange: could not read from "
+                    "'%s'\n", filename );
+            exit(EXIT_FAILURE);
+        }
+        to     += nread;
+        from   += nread;
+        nbytes -= nread;
+    }
+
+    // Decompress them in parallel
+    struct zstd_job job;
+    job.zr          = zr;
+    job.first_frame = first;
+    job.next_frame  = first;
+    job.last_frame  = last;
+    job.dest        = dest;
+    job.start       = offset;
+    job.end         = end;
+    job.ok          = true;
+    pthread_mutex_init( &(job.mutex), NULL );
+
+    int nthreads = zr->nthreads;
+    if (nthreads > last - first)
+        nthreads = last - first;
+
+    pthread_t threads[nthreads];
+    struct zstd_worker workers[nthreads];
+    int t;
+    for (t = 0; t < nthreads; t++)
+    {
+        workers[t].job    = &job;
+        workers[t].thread = t;
+        if (t > 0)
+            pthread_create( &(threads[t]), NULL, vmZstdWorker, &(workers[t]) );
+    }
+
+    vmZstdWorker( &(workers[0]) );
+
+    for (t = 1; t < nthreads; t++)
+        pthread_join( threads[t], NULL );
+
+    pthread_mutex_destroy( &(job.mutex) );
+
+    if (!job.ok)
+    {
+        fprintf( stderr, "error: vmZstdReadRange: could not decompress '%s'\n",
+                filename );
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Creates a new zstd reader.
+ *
+ * @param nthreads The number of frames to decompress at once
+ *
+ * @return A pointer to the new reader
+ */
+static zstd_reader *vmNewZstdReader( int nthreads )
+{
+    zstd_reader *zr = (zstd_reader *)malloc( sizeof(zstd_reader) );
+
+    zr->placeholder_dir = NULL;
+    zr->nthreads        = nthreads;
+    zr->filename        = NULL;
+    zr->fd              = -1;
+    zr->nframes         = 0;
+    zr->c_offsets       = NULL;
+    zr->d_offsets       = NULL;
+    zr->cbuffer         = NULL;
+    zr->cbuffer_size    = 0;
+    zr->scratch_size    = 0;
+
+    zr->scratch = (void **)malloc( nthreads * sizeof(void *) );
+#ifdef HAVE_ZSTD
+    zr->dctxs   = (ZSTD_DCtx **)malloc( nthreads * sizeof(ZSTD_DCtx *) );
+#endif
+
+    int t;
+    for (t = 0; t < nthreads; t++)
+    {
+        zr->scratch[t] = NULL;
+#ifdef HAVE_ZSTD
+        zr->dctxs[t]   = ZSTD_createDCtx();
+#endif
+    }
+
+    return zr;
+}
+
+/**
+ * Set up a reader for zstd-compressed input files.
+ *
+ * @param vm       The VCSBeam context struct
+ * @param nthreads The number of frames to decompress at once
+ *
+ * This must be called before vmBindObsData(). Afterwards, each input file
+ * VOLTFILE is expected to be found (in `vm&rarr;datadir`) only as
+ * VOLTFILE.zst, in the zstd seekable format (see vmZstdOpen()), and
+ * vmReadSeconds() (and so vmReadNextSecond(), whether or not it reads ahead
+ * or in batches) decompresses the frames covering each read in parallel,
+ * straight into the read buffer. This avoids decompressing whole
+ * observations to scratch space first.
+ *
+ * mwalib still needs to see the uncompressed files, so empty (sparse)
+ * stand-ins of the right size are made for it in a temporary directory
+ * (see vmZstdMakePlaceholder()). These are never read.
+ *
+ * Compressed input cannot be combined with memory-mapped or direct I/O
+ * reading, nor with staging, and leaving out flagged RF inputs saves no
+ * reading (the whole of each frame must be decompressed anyway).
+ *
+ * \see vmFreeZstdReader()
+ */
+void vmInitZstdReader( vcsbeam_context *vm, int nthreads )
+{
+#ifndef HAVE_ZSTD
+    fprintf( stderr, "error: vmInitZstdReader: vcsbeam was built without "
+            "zstd support\n" );
+    exit(EXIT_FAILURE);
+#endif
+
+    if (nthreads < 1)
+    {
+        fprintf( stderr, "error: vmInitZstdReader: number of threads (%d) "
+                "must be >= 1\n", nthreads );
+        exit(EXIT_FAILURE);
+    }
+
+    if (vm->filenames != NULL)
+    {
+        fprintf( stderr, "error: vmInitZstdReader: must be called before "
+                "vmBindObsData()\n" );
+        exit(EXIT_FAILURE);
+    }
+
+    zstd_reader *zr = vmNewZstdReader( nthreads );
+
+    const char *tmpdir = getenv( "TMPDIR" );
+    zr->placeholder_dir = (char *)malloc( strlen( tmpdir ? tmpdir : "/tmp" ) + 16 );
+    sprintf( zr->placeholder_dir, "%s/vcsbeam_XXXXXX", (tmpdir ? tmpdir : "/tmp") );
+    if (mkdtemp( zr->placeholder_dir ) == NULL)
+    {
+        fprintf( stderr, "error: vmInitZstdReader: could not create a "
+                "temporary directory in '%s'\n", (tmpdir ? tmpdir : "/tmp") );
+        exit(EXIT_FAILURE);
+    }
+
+    vm->zstd = zr;
+}
+
+/**
+ * Creates a reader that decompresses the same way as another.
+ *
+ * @param zr The zstd reader to copy
+ *
+ * @return A pointer to the new reader
+ *
+ * A reader can only be used by one thread at a time, so each channel
+ * context (see vmInitChannelContext()) gets its own. The copy does not own
+ * the stand-in files.
+ */
+zstd_reader *vmCopyZstdReader( zstd_reader *zr )
+{
+    return vmNewZstdReader( zr->nthreads );
+}
+
+/**
+ * Makes a stand-in for a compressed input file.
+ *
+ * @param         vm   The VCSBeam context struct
+ * @param[in,out] path The path of the (uncompressed) input file, which is
+ *                     replaced by the path of the stand-in
+ *
+ * The stand-in is an empty (sparse) file with the same name and size as the
+ * uncompressed file (as given by the seek table of `path`.zst), which is
+ * enough for mwalib to work out the observation's layout.
+ */
+void vmZstdMakePlaceholder( vcsbeam_context *vm, char *path )
+{
+    zstd_reader *zr = vm->zstd;
+
+    char compressed[MAX_COMMAND_LENGTH + 8];
+    sprintf( compressed, "%s.zst", path );
+    vmZstdOpen( zr, compressed );
+
+    char placeholder[2*MAX_COMMAND_LENGTH];
+    sprintf( placeholder, "%s/%s", zr->placeholder_dir, basename( path ) );
+
+    int fd = open( placeholder, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+    if (fd < 0 || ftruncate( fd, zr->d_offsets[zr->nframes] ) != 0)
+    {
+        fprintf( stderr, "error: vmZstdMakePlaceholder: could not create "
+                "'%s'\n", placeholder );
+        exit(EXIT_FAILURE);
+    }
+    close( fd );
+
+    strcpy( path, placeholder );
+}
+
+/**
+ * Reads one or more seconds of voltages from compressed files.
+ *
+ * @param vm              The VCSBeam context struct
+ * @param gps_second      The first GPS second to read
+ * @param nseconds        The number of (consecutive) seconds to read
+ * @param coarse_chan_idx The (mwalib) idx of the coarse channel to read
+ * @param dest            Where to put the data
+ * @param size            The number of bytes to read (exactly `nseconds`
+ *                        seconds)
+ *
+ * The seconds in each (decompressed) file are contiguous (after the header
+ * and, for MWAX, the delay block), so each file's share of the request is a
+ * single range, which is decompressed with vmZstdReadRange().
+ */
+void vmZstdReadSeconds( vcsbeam_context *vm, uint64_t gps_second, int nseconds, int coarse_chan_idx,
+        void *dest, size_t size )
+{
+    size_t second_size = vm->vcs_metadata->num_voltage_blocks_per_second *
+                         vm->vcs_metadata->voltage_block_size_bytes;
+    uint64_t data_offset = vm->vcs_metadata->data_file_header_size_bytes +
+                           vm->vcs_metadata->delay_block_size_bytes;
+
+    if (size != nseconds*second_size)
+    {
+        fprintf( stderr, "error: vmZstdReadSeconds: requested size "
+                "(%lu bytes) is not %d second(s) of data (%lu bytes)\n",
+                size, nseconds, nseconds*second_size );
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t t0_gps_second = vm->obs_metadata->metafits_timesteps[0].gps_time_ms/1000;
+    char filename[MAX_COMMAND_LENGTH];
+    char path[2*MAX_COMMAND_LENGTH + 8];
+
+    int s, n;
+    for (s = 0; s < nseconds; s += n)
+    {
+        uint64_t first_gps = t0_gps_second +
+            ((gps_second + s - t0_gps_second) / vm->seconds_per_file) * vm->seconds_per_file;
+
+        memset( filename, 0, MAX_COMMAND_LENGTH );
+        vmGetVoltFilename( vm, coarse_chan_idx, first_gps, filename );
+        sprintf( path, "%s/%s.zst", vm->datadir, filename );
+
+        // Read as many of the seconds as are in this file
+        n = vm->seconds_per_file - (gps_second + s - first_gps);
+        if (n > nseconds - s)
+            n = nseconds - s;
+
+        vmZstdReadRange( vm->zstd, path, (char *)dest + s*second_size,
+                data_offset + (gps_second + s - first_gps)*second_size, n*second_size );
+    }
+}
+
+/**
+ * Stop reading compressed files.
+ *
+ * @param vm The VCSBeam context struct
+ *
+ * If the reader owns the stand-in files, they are removed, so this must be
+ * called before vmDestroyFilenames().
+ */
+void vmFreeZstdReader( vcsbeam_context *vm )
+{
+    zstd_reader *zr = vm->zstd;
+
+    // If there is no zstd reader, silently do nothing
+    if (zr == NULL)
+        return;
+
+    if (zr->placeholder_dir != NULL)
+    {
+        int i;
+        for (i = 0; i < vm->nfiles; i++)
+            unlink( vm->filenames[i] );
+        rmdir( zr->placeholder_dir );
+        free( zr->placeholder_dir );
+    }
+
+    if (zr->filename != NULL)
+    {
+        close( zr->fd );
+        free( zr->filename );
+        free( zr->c_offsets );
+        free( zr->d_offsets );
+    }
+
+    int t;
+    for (t = 0; t < zr->nthreads; t++)
+    {
+        free( zr->scratch[t] );
+#ifdef HAVE_ZSTD
+        ZSTD_freeDCtx( zr->dctxs[t] );
+#endif
+    }
+
+    free( zr->scratch );
+#ifdef HAVE_ZSTD
+    free( zr->dctxs );
+#endif
+    free( zr->cbuffer );
+    free( zr );
+
+    vm->zstd = NULL;
+}
@@ -59,7 +59,11 @@ gpuDoubleComplex *roots_of_unity( int N )
  *                For both ANALYSIS and SYNTHESIS filters, this should be
  *                the number of ANALYSIS channels.
  *
- * @todo Change nchans so that it uses `vm&rarr;nfine_chans`
+ * The filter files in RUNTIME_DIR are designed for
+ * #FILTER_NATIVE_NCHANS channels. If `nchans` differs from this, the
+ * coefficients are resampled with vmResampleFilter() so that the filter
+ * keeps the same number of taps and the same shape relative to the
+ * fine channel width.
  */
 void vmLoadFilter( vcsbeam_context *vm, char *filtername, filter_type type, int nchans )
 {
@@ -133,6 +137,20 @@ void vmLoadFilter( vcsbeam_context *vm, char *filtername, filter_type type, int
     for (num_read = 0; num_read < filter->ncoeffs; num_read++)
         fscanf( f, "%lf", &(filter->coeffs[num_read]) );
 
+    // Close the file
+    fclose( f );
+
+    // If the filter was designed for its native number of channels, but a
+    // different number was requested, resample it
+    if (nchans != FILTER_NATIVE_NCHANS && filter->ncoeffs % FILTER_NATIVE_NCHANS == 0)
+    {
+        filter->nchans   = FILTER_NATIVE_NCHANS;
+        filter->ntaps    = filter->ncoeffs / FILTER_NATIVE_NCHANS;
+        filter->twiddles = NULL;
+        vmResampleFilter( filter, nchans );
+        return;
+    }
+
     // Work out the number of taps, and issue a warning if the number
     // of channels does not divide evenly into the number of coefficients
     if (filter->ncoeffs % nchans != 0)
@@ -145,9 +163,84 @@ void vmLoadFilter( vcsbeam_context *vm, char *filtername, filter_type type, int
 
     // Pre-calculate the twiddle factors
     filter->twiddles = roots_of_unity( nchans );
+}
 
-    // Close the file
-    fclose( f );
+/**
+ * Resample a filter so that it can be applied to a different number of
+ * channels.
+ *
+ * @param filter The filter to be resampled
+ * @param nchans The new number of channels
+ *
+ * The number of taps is kept fixed, so the new filter has
+ * `filter&rarr;ntaps * nchans` coefficients. The prototype filter is
+ * stretched (or squashed) by linear interpolation about its centre, so
+ * that its frequency response relative to the channel width is preserved.
+ * The coefficients are then scaled by
+ * \f$\sqrt{K_{\rm old}/K_{\rm new}}\f$ so that the power in each output
+ * channel stays (approximately) the same as with the original filter.
+ *
+ * The twiddle factors are recalculated for the new number of channels.
+ */
+void vmResampleFilter( pfb_filter *filter, int nchans )
+{
+    if (nchans <= 0)
+    {
+        fprintf( stderr, "error: vmResampleFilter: "
+                "number of channels (%d) must be positive\n", nchans );
+        exit(EXIT_FAILURE);
+    }
+
+    int old_ncoeffs = filter->ncoeffs;
+    int new_ncoeffs = filter->ntaps * nchans;
+
+    double *new_coeffs = (double *)malloc( new_ncoeffs * sizeof(double) );
+    if (!new_coeffs)
+    {
+        fprintf( stderr, "error: vmResampleFilter: could not allocate "
+                         "memory\n" );
+        exit(EXIT_FAILURE);
+    }
+
+    // The ratio between old and new sample spacings
+    double ratio = (double)filter->nchans / (double)nchans;
+    double scale = sqrt( ratio );
+
+    int j, n;
+    double x, frac;
+    for (j = 0; j < new_ncoeffs; j++)
+    {
+        // Find the (fractional) position in the old filter that corresponds
+        // to this coefficient, keeping the two filters centred on each other
+        x = (j - 0.5*(new_ncoeffs - 1))*ratio + 0.5*(old_ncoeffs - 1);
+
+        if (x < 0.0 || x > (double)(old_ncoeffs - 1))
+        {
+            new_coeffs[j] = 0.0;
+            continue;
+        }
+
+        n    = (int)x;
+        frac = x - n;
+
+        if (n >= old_ncoeffs - 1)
+            new_coeffs[j] = filter->coeffs[old_ncoeffs - 1];
+        else
+            new_coeffs[j] = (1.0 - frac)*filter->coeffs[n] + frac*filter->coeffs[n+1];
+
+        new_coeffs[j] *= scale;
+    }
+
+    // Swap in the new coefficients
+    free( filter->coeffs );
+    filter->coeffs  = new_coeffs;
+    filter->ncoeffs = new_ncoeffs;
+    filter->nchans  = nchans;
+
+    // Recalculate the twiddle factors
+    if (filter->twiddles != NULL)
+        free( filter->twiddles );
+    filter->twiddles = roots_of_unity( nchans );
 }
 
 /**
@@ -188,6 +281,8 @@ void free_pfb_filter( pfb_filter *filter )
  */
 {
     free( filter->coeffs );
+    if (filter->twiddles != NULL)
+        free( filter->twiddles );
     free( filter );
 
     filter = NULL;
@@ -105,7 +105,8 @@ __global__ void incoh_beam( uint8_t *data, float *incoh )
  * @param p         The pointing number
  * @param soffset   An offset number of samples into `data`
  * @param npol      \f$N_p\f$
- * @param datatype Either `VM_INT4` (if `data` contain 4+4-bit complex integers)
+ * @param datatype One of `VM_INT4` (if `data` contain 4+4-bit complex integers),
+ *                 `VM_FLT` (if `data` contain complex floats),
  *                 or `VM_DBL` (if `data` contain complex doubles).
  *
  * Although this kernel is quite general, in the sense that it could be used
@@ -165,6 +166,14 @@ __global__ void vmApplyJ_kernel( void            *data,
         vq = v[v_IDX(s,c,iQ,nc,ni)];
         vp = v[v_IDX(s,c,iP,nc,ni)];
     }
+    else if (datatype == VM_FLT)
+    {
+        gpuFloatComplex *v = (gpuFloatComplex *)data;
+        gpuFloatComplex fq = v[v_IDX(s,c,iQ,nc,ni)];
+        gpuFloatComplex fp = v[v_IDX(s,c,iP,nc,ni)];
+        vq = make_gpuDoubleComplex( fq.x, fq.y );
+        vp = make_gpuDoubleComplex( fp.x, fp.y );
+    }
     // else send an error message... yet to do
 
     // Calculate the first step (J*v) of the coherent beam
@@ -448,6 +457,125 @@ __global__ void renormalise_channels_kernel( float *S, int nstep, float *offsets
     offsets[p*nstokes*nchan + stokes*nchan + chan] = offset;
 }
 
+/**
+ * CUDA kernel for digitising Stokes parameters to 1, 2, or 4 bits
+ *
+ * @param[in]  S       The original Stokes parameters,
+ *                     with layout \f$N_t \times N_s \times N_f\f$
+ * @param      nstep   \f$N_t\f$
+ * @param      nbits   The number of bits per output sample (1, 2, or 4)
+ * @param[out] offsets The amount of offset needed to recover the original
+ *                     values from the digitised ones
+ * @param[out] scales  The scaling needed to recover the original values
+ *                     from the digitised ones
+ * @param[out] Sscaled The digitised Stokes parameters (one per byte, i.e.
+ *                     not yet packed)
+ *
+ * This is the low-bit counterpart of renormalise_channels_kernel(). With so
+ * few levels, scaling between the minimum and maximum values would leave
+ * almost all samples in one or two levels, so instead, each channel is
+ * digitised with \f$L = 2^\text{nbits}\f$ evenly spaced levels centred on
+ * the channel's mean, \f$\mu\f$, with a spacing, \f$\Delta\f$, that
+ * minimises the digitisation noise for Gaussian-distributed values with
+ * standard deviation \f$\sigma\f$ (Max 1960):
+ * \f[
+ *     \Delta = \begin{cases}
+ *         1.596\,\sigma & \text{nbits} = 1 \\
+ *         0.9957\,\sigma & \text{nbits} = 2 \\
+ *         0.3352\,\sigma & \text{nbits} = 4.
+ *     \end{cases}
+ * \f]
+ * The digitised value is
+ * \f[
+ *     \hat{\bf S} = \left\lfloor \frac{{\bf S} - \mu}{\Delta} + \frac{L}{2} \right\rfloor,
+ * \f]
+ * clipped to the range \f$[0, L-1]\f$, so that the thresholds between
+ * levels lie at \f$\mu + k\Delta\f$, and the scale and offset (which
+ * recover the value in the middle of each level) are
+ * \f{align*}{
+ *     \text{scale} &= \Delta \\
+ *     \text{offset} &= \mu - \left(\frac{L}{2} - \frac12\right)\Delta.
+ * \f}
+ *
+ * The expected thread configuration is
+ * \f$\langle\langle\langle N_b,(N_f, N_s)\rangle\rangle\rangle.\f$
+ *
+ * \see pack_lowbit_kernel()
+ */
+__global__ void requantise_channels_kernel( float *S, int nstep, int nbits, float *offsets, float *scales, uint8_t *Sscaled )
+{
+    // Translate GPU block/thread numbers into meaningful names
+    int chan    = threadIdx.x; /* The (c)hannel number */
+    int nchan   = blockDim.x;  /* The total number of channels */
+
+    int stokes  = threadIdx.y; /* The (stokes) parameter */
+    int nstokes = blockDim.y;  /* Typically, is either 1 (just Stokes I) or 4 (Stokes IQUV) */
+
+    int p       = blockIdx.x;  /* The (p)ointing number */
+
+    // Get the data statistics
+    float val, mean = 0.0, var = 0.0;
+    int i;
+    for (i = 0; i < nstep; i++)
+        mean += S[C_IDX(p,i,stokes,chan,nstep,nstokes,nchan)];
+    mean /= nstep;
+
+    for (i = 0; i < nstep; i++)
+    {
+        val = S[C_IDX(p,i,stokes,chan,nstep,nstokes,nchan)] - mean;
+        var += val*val;
+    }
+    var /= nstep;
+
+    // The optimal level spacing, in units of the standard deviation
+    float spacing = (nbits == 1 ? 1.596 : (nbits == 2 ? 0.9957 : 0.3352));
+
+    float nlevels = (float)(1 << nbits);
+    float scale   = spacing * sqrtf( var );
+    if (scale == 0.0)
+        scale = 1.0; // (All samples are equal, and will land in the same level)
+
+    for (i = 0; i < nstep; i++)
+    {
+        val = floorf( (S[C_IDX(p,i,stokes,chan,nstep,nstokes,nchan)] - mean) / scale + 0.5*nlevels );
+        val = fminf( fmaxf( val, 0.0 ), nlevels - 1.0 );
+        Sscaled[C_IDX(p,i,stokes,chan,nstep,nstokes,nchan)] = (uint8_t)val;
+    }
+
+    // Set the scales and offsets
+    scales[p*nstokes*nchan + stokes*nchan + chan] = scale;
+    offsets[p*nstokes*nchan + stokes*nchan + chan] = mean - (0.5*nlevels - 0.5)*scale;
+}
+
+/**
+ * CUDA kernel for packing low-bit samples into bytes
+ *
+ * @param[in]  unpacked The samples, one per byte
+ * @param      nbits    The number of bits per sample (1, 2, or 4)
+ * @param[out] packed   The packed samples
+ * @param      npacked  The number of bytes in `packed`
+ *
+ * Each byte of `packed` holds \f$8/\text{nbits}\f$ consecutive samples,
+ * with the first sample in the most significant bits, as PSRFITS expects.
+ *
+ * The expected thread configuration is one thread per byte of `packed`.
+ */
+__global__ void pack_lowbit_kernel( uint8_t *unpacked, int nbits, uint8_t *packed, size_t npacked )
+{
+    size_t b = (size_t)blockIdx.x*blockDim.x + threadIdx.x;
+    if (b >= npacked)
+        return;
+
+    int nper = 8 / nbits;
+    uint8_t byte = 0;
+
+    int j;
+    for (j = 0; j < nper; j++)
+        byte |= unpacked[b*nper + j] << (8 - nbits*(j + 1));
+
+    packed[b] = byte;
+}
+
 
 /**
  * Form an incoherent beam.
@@ -654,20 +782,37 @@ void vmSendSToFits( vcsbeam_context *vm, mpi_psrfits *mpfs )
 {
     // Flatten the bandpass
     dim3 chan_stokes(vm->nfine_chan, vm->out_nstokes);
-    renormalise_channels_kernel<<<vm->npointing, chan_stokes, 0, vm->streams[0]>>>( (float *)vm->d_S, vm->fine_sample_rate, vm->d_offsets, vm->d_scales, vm->d_Cscaled );
-    ( gpuPeekAtLastError() );
+    if (vm->out_nbits == 8)
+    {
+        renormalise_channels_kernel<<<vm->npointing, chan_stokes, 0, vm->streams[0]>>>( (float *)vm->d_S, vm->fine_sample_rate, vm->d_offsets, vm->d_scales, vm->d_Cscaled );
+        ( gpuPeekAtLastError() );
+    }
+    else
+    {
+        // Digitise to fewer bits, and pack them (so that less has to be
+        // copied, spliced, and written)
+        requantise_channels_kernel<<<vm->npointing, chan_stokes, 0, vm->streams[0]>>>( (float *)vm->d_S, vm->fine_sample_rate, vm->out_nbits, vm->d_offsets, vm->d_scales, vm->d_Cunpacked );
+        ( gpuPeekAtLastError() );
+
+        int nthreads = 256;
+        int nblocks  = (vm->Cscaled_size + nthreads - 1) / nthreads;
+        pack_lowbit_kernel<<<nblocks, nthreads, 0, vm->streams[0]>>>( vm->d_Cunpacked, vm->out_nbits, vm->d_Cscaled, vm->Cscaled_size );
+        ( gpuPeekAtLastError() );
+    }
     ( gpuDeviceSynchronize() );
 
     (gpuMemcpy( vm->offsets, vm->d_offsets, vm->offsets_size, gpuMemcpyDeviceToHost ));
     (gpuMemcpy( vm->scales,  vm->d_scales,  vm->scales_size,  gpuMemcpyDeviceToHost ));
     (gpuMemcpy( vm->Cscaled, vm->d_Cscaled, vm->Cscaled_size, gpuMemcpyDeviceToHost ));
 
+    size_t bytes_per_subint = mpfs[0].coarse_chan_pf.sub.bytes_per_subint;
+
     unsigned int p;
     for (p = 0; p < vm->npointing; p++)
     {
         memcpy( mpfs[p].coarse_chan_pf.sub.dat_offsets, &(vm->offsets[p*vm->nfine_chan*vm->out_nstokes]), vm->nfine_chan*vm->out_nstokes*sizeof(float) );
         memcpy( mpfs[p].coarse_chan_pf.sub.dat_scales, &(vm->scales[p*vm->nfine_chan*vm->out_nstokes]), vm->nfine_chan*vm->out_nstokes*sizeof(float) );
-        memcpy( mpfs[p].coarse_chan_pf.sub.data, &(vm->Cscaled[p*vm->fine_sample_rate*vm->nfine_chan*vm->out_nstokes]), vm->fine_sample_rate*vm->nfine_chan*vm->out_nstokes );
+        memcpy( mpfs[p].coarse_chan_pf.sub.data, &(vm->Cscaled[p*bytes_per_subint]), bytes_per_subint );
     }
 
 }
@@ -727,58 +872,6 @@ gpuDoubleComplex ****create_detected_beam( int npointing, int nsamples, int ncha
 }
 
 
-/*
-* Create a 1-D host buffer containing the fine-channelised complex voltage samples which
-* will be given to the IPFB.
-*/
-gpuDoubleComplex *create_data_buffer_fine( int npointing, int nsamples, int nchan, int npol )
-{
-    int buffer_size = npointing * nsamples * nchan * npol * sizeof(gpuDoubleComplex);
-    
-    // Allocate host memory for buffer
-    gpuDoubleComplex *data_buffer_fine;
-    data_buffer_fine = (gpuDoubleComplex *)malloc( buffer_size );
-
-    // Initialise buffer to zeros
-    memset( data_buffer_fine, 0, buffer_size );
-
-    return data_buffer_fine;
-}
-
-
-/*
-* Copy the fine-channelised beamformed voltages into a data buffer so that it can
-* be given to the IPFB.
-*/
-void prepare_data_buffer_fine( gpuDoubleComplex *data_buffer_fine, vcsbeam_context *vm,
-                    uintptr_t timestep_idx )
-{
-    // Get shortcut variables
-    uintptr_t nchan = vm->nfine_chan;
-    uintptr_t npol  = vm->obs_metadata->num_ant_pols; // = 2
-    int file_no = timestep_idx % 2;
-
-    // Copy the beamformed data from e into the data buffer
-    // Make sure we put it back into the correct half of the array, depending
-    // on whether this is an even or odd second.
-    int offset = file_no % 2 * vm->fine_sample_rate;
-
-    int p,s,ch,pol,i,j;
-    for (p   = 0; p   < vm->npointing;        p++   )
-    for (s   = 0; s   < vm->fine_sample_rate; s++   )
-    for (ch  = 0; ch  < nchan;                ch++  )
-    for (pol = 0; pol < npol;                 pol++ )
-    {
-        // Calculate index for e
-        i = B_IDX(p,s,ch,pol,vm->fine_sample_rate,nchan,npol);
-
-        // Calculate index for data_buffer_fine
-        j = B_IDX(p,s+offset,ch,pol,vm->fine_sample_rate,nchan,npol);
-
-        data_buffer_fine[j] = vm->e[i];
-    }
-}
-
 /**
  * (Deprecated) Allocates memory on the CPU and GPU simultaneously.
  *
@@ -42,6 +42,7 @@ vcsbeam_context *vmInit( bool use_mpi )
         vm->mpi_rank = PERFORMANCE_NO_MPI;
     }
     vm->writer = 0;
+    vm->next_writer = vm->writer;
 
     // TODO: Change this to give user flexibility of how to use mpi structure
     vm->ncoarse_chans   = vm->mpi_size;
@@ -52,6 +53,16 @@ vcsbeam_context *vmInit( bool use_mpi )
 
     // Initialise data pointers to NULL
     vm->v           = NULL;
+    vm->reader      = NULL;
+    vm->mapper      = NULL;
+    vm->batch       = NULL;
+    vm->direct      = NULL;
+    vm->stager      = NULL;
+    vm->zstd        = NULL;
+
+    // Read all RF inputs unless told otherwise
+    vm->skip_rf_input         = NULL;
+    vm->num_skipped_rf_inputs = 0;
     vm->d_v         = NULL;
     vm->S           = NULL;
     vm->d_S         = NULL;
@@ -107,6 +118,9 @@ vcsbeam_context *vmInit( bool use_mpi )
     vm->output_fine_channels = false;
     vm->output_coarse_channels = false;
 
+    // 8-bit PSRFITS output
+    vm->out_nbits = 8;
+
     // No filters
     vm->analysis_filter = NULL;
     vm->synth_filter    = NULL;
@@ -173,6 +187,13 @@ void vmBindObsData(
     uint32_t first_gps_second = parse_begin_string( vm->obs_metadata, first_gps_second_str ) + gps_second_offset;
     int first_coarse_chan_idx = parse_coarse_chan_string( vm->obs_metadata, first_coarse_chan_str ) + coarse_chan_idx_offset;
 
+    // If the number of seconds is invalid (<= 0), process as many as possible
+    if (num_gps_seconds_to_process <= 0)
+    {
+        num_gps_seconds_to_process = vm->obs_metadata->num_metafits_timesteps -
+            (first_gps_second - vm->obs_metadata->metafits_timesteps[0].gps_time_ms/1000);
+    }
+
     // Get the voltage context and metadata
     vm->num_gps_seconds_to_process  = num_gps_seconds_to_process;
     vm->num_coarse_chans_to_process = num_coarse_chans_to_process;
@@ -359,9 +380,23 @@ void destroy_vcsbeam_context( vcsbeam_context *vm )
     if (vm->fpfb != NULL)
         vmFreeForwardPFB( vm->fpfb );
 
+    // GPU FFT plans left over from forward PFBs
+    vmFreeFFTPlanCache();
+
     // Read buffer
+    vmFreeReadAhead( vm );
+    vmFreeMmapReader( vm );
+    vmFreeBatchReader( vm );
+    vmFreeDirectReader( vm );
     vmFreeVHost( vm );
 
+    // Staged and compressed input files
+    vmFreeStager( vm );
+    vmFreeZstdReader( vm );
+
+    if (vm->skip_rf_input != NULL)
+        free( vm->skip_rf_input );
+
     // Input data info
     if (vm->datadir != NULL)
         free( vm->datadir );
@@ -376,6 +411,162 @@ void destroy_vcsbeam_context( vcsbeam_context *vm )
     free( vm );
 }
 
+/**
+ * Creates a VCSBeam context for processing a single coarse channel
+ * alongside others.
+ *
+ * @param vm A VCSBeam context that has already been bound to an observation
+ *           with vmBindObsData()
+ * @return A pointer to a newly allocated "channel" context
+ *
+ * The new context shares everything that is read-only once an observation
+ * has been bound (the mwalib contexts and metadata, the list of GPS seconds,
+ * and any loaded filters) with `vm`, but has its own read buffer, logger, and
+ * (once vmInitForwardPFB() is called on it) forward PFB. This allows several
+ * coarse channels to be read and processed concurrently, each in its own
+ * thread, without loading the metadata or filters more than once.
+ *
+ * The coarse channel to be processed is selected with
+ * vmSetChannelContextCoarseChan(). Channel contexts must be freed with
+ * vmDestroyChannelContext() (not destroy_vcsbeam_context()), before `vm`
+ * itself is destroyed.
+ */
+vcsbeam_context *vmInitChannelContext( vcsbeam_context *vm )
+{
+    // Start with a (shallow) copy of the parent context
+    vcsbeam_context *cvm = (vcsbeam_context *)malloc( sizeof(vcsbeam_context) );
+    memcpy( cvm, vm, sizeof(vcsbeam_context) );
+
+    // A channel context never owns MPI
+    cvm->use_mpi = false;
+
+    // Only one coarse channel at a time
+    cvm->num_coarse_chans_to_process = 1;
+    cvm->coarse_chan_idxs_to_process = (int *)malloc( sizeof(int) );
+    cvm->coarse_chan_idxs_to_process[0] = vm->coarse_chan_idxs_to_process[0];
+
+    // Start at the beginning
+    cvm->current_gps_idx = 0;
+    cvm->chunk_to_load   = 0;
+
+    // Per-channel processing state
+    cvm->fpfb   = NULL;
+    cvm->v      = NULL;
+    cvm->reader = NULL;
+    cvm->mapper = NULL;
+    cvm->batch  = NULL;
+    cvm->direct = NULL;
+    cvm->zstd   = (vm->zstd != NULL ? vmCopyZstdReader( vm->zstd ) : NULL);
+    vmMallocVHost( cvm );
+
+    // A separate logger, with the same stopwatches and start time as the
+    // parent's
+    cvm->log = create_logger( vm->log->fout, vm->log->world_rank );
+    cvm->log->begintime = vm->log->begintime;
+
+    int i;
+    for (i = 0; i < vm->log->nstopwatches; i++)
+        logger_add_stopwatch( cvm->log,
+                vm->log->stopwatches[i].name,
+                vm->log->stopwatches[i].description );
+
+    return cvm;
+}
+
+/**
+ * Selects which coarse channel a channel context will process.
+ *
+ * @param cvm A channel context created with vmInitChannelContext()
+ * @param c The index into the parent context's
+ *          `coarse_chan_idxs_to_process` array
+ * @param vm The parent context
+ *
+ * This also rewinds `cvm` to the first GPS second, and resets the forward
+ * PFB's filter history (if a forward PFB has been initialised), so that the
+ * same channel context can be reused for several coarse channels in turn.
+ */
+void vmSetChannelContextCoarseChan( vcsbeam_context *cvm, vcsbeam_context *vm, int c )
+{
+    if (c < 0 || c >= vm->num_coarse_chans_to_process)
+    {
+        fprintf( stderr, "error: vmSetChannelContextCoarseChan: "
+                "channel index (%d) must be between 0 and %d\n",
+                c, vm->num_coarse_chans_to_process - 1 );
+        exit(EXIT_FAILURE);
+    }
+
+    cvm->coarse_chan_idxs_to_process[0] = vm->coarse_chan_idxs_to_process[c];
+
+    cvm->current_gps_idx = 0;
+    cvm->chunk_to_load   = 0;
+
+    if (cvm->fpfb != NULL)
+        vmResetForwardPFB( cvm->fpfb );
+}
+
+/**
+ * Selects which GPS seconds a channel context will process.
+ *
+ * @param cvm A channel context created with vmInitChannelContext()
+ * @param vm The parent context
+ * @param first The index into the parent context's `gps_seconds_to_process`
+ *              array of the first second to be processed
+ * @param nseconds The number of seconds to be processed
+ *
+ * This allows the seconds of a coarse channel to be split into segments
+ * that are processed independently (e.g. in different threads). It also
+ * rewinds `cvm` to the first second of the segment, but does not touch the
+ * forward PFB's filter history: either reset it (vmResetForwardPFB()) or
+ * prime it with the preceding second (vmPrimeForwardPFB()).
+ *
+ * This should be called after vmSetChannelContextCoarseChan(), which
+ * rewinds `cvm` but leaves the selected seconds alone.
+ */
+void vmSetChannelContextSeconds( vcsbeam_context *cvm, vcsbeam_context *vm, int first, int nseconds )
+{
+    if (first < 0 || nseconds < 1 || first + nseconds > vm->num_gps_seconds_to_process)
+    {
+        fprintf( stderr, "error: vmSetChannelContextSeconds: seconds "
+                "[%d, %d) are outside the range of seconds to be processed "
+                "[0, %d)\n", first, first + nseconds, vm->num_gps_seconds_to_process );
+        exit(EXIT_FAILURE);
+    }
+
+    cvm->gps_seconds_to_process     = vm->gps_seconds_to_process + first;
+    cvm->num_gps_seconds_to_process = nseconds;
+
+    cvm->current_gps_idx = 0;
+    cvm->chunk_to_load   = 0;
+}
+
+/**
+ * Frees a channel context created with vmInitChannelContext().
+ *
+ * @param cvm The channel context to be freed
+ *
+ * Only the memory owned by the channel context (its read buffer(s), logger,
+ * forward PFB, and list of coarse channels) is freed; everything shared with
+ * the parent context is left alone.
+ */
+void vmDestroyChannelContext( vcsbeam_context *cvm )
+{
+    free( cvm->coarse_chan_idxs_to_process );
+
+    if (cvm->fpfb != NULL)
+        vmFreeForwardPFB( cvm->fpfb );
+
+    vmFreeReadAhead( cvm );
+    vmFreeMmapReader( cvm );
+    vmFreeBatchReader( cvm );
+    vmFreeDirectReader( cvm );
+    vmFreeZstdReader( cvm );
+    vmFreeVHost( cvm );
+
+    destroy_logger( cvm->log );
+
+    free( cvm );
+}
+
 /**
  * Sets flags governing whether the PFB and inverse PFB routines are run
  * depending on the input and output channelisations.
@@ -433,24 +624,15 @@ void vmSetOutputChannelisation( vcsbeam_context *vm, bool out_fine, bool out_coa
  *
  * The memory is allocated as a `host_buffer` struct (see vmInitReadBuffer()
  * for a full description).
- * The amount of memory allocated depends on whether the observation is
- * Legacy or MWAX.
- *
- * If the input is legacy, the read buffer can be just enough
- * for one second's worth of data.
- *
- * However, for MWAX, the read buffer must be slightly bigger
- * to accommodate the PFB's extra taps.
- * (For now, this is fixed to one voltage block. Changing this
- * will break the gpu kernels that do the fine PFB, for which
- * the offset into the data is currently hard-coded.)
+ * The read buffer is just enough for one second's worth of data, for both
+ * Legacy and MWAX observations. (The extra taps needed by the forward PFB on
+ * MWAX data are kept on the GPU between chunks; see vmResetForwardPFB().)
  */
 void vmMallocVHost( vcsbeam_context *vm )
 {
-    if (vm->obs_metadata->mwa_version == VCSLegacyRecombined)
+    if (vm->obs_metadata->mwa_version == VCSLegacyRecombined ||
+            vm->obs_metadata->mwa_version == VCSMWAXv2)
         vm->v = vmInitReadBuffer( vm->bytes_per_second, 0 );
-    else if (vm->obs_metadata->mwa_version == VCSMWAXv2)
-        vm->v = vmInitReadBuffer( vm->bytes_per_second, vm->vcs_metadata->voltage_block_size_bytes );
 }
 
 /**
@@ -573,6 +755,7 @@ void vmMallocPQIdxsHost( vcsbeam_context *vm )
 void vmFreeVHost( vcsbeam_context *vm )
 {
     vmFreeReadBuffer( vm->v );
+    vm->v = NULL;
 }
 
 /**
@@ -946,9 +1129,6 @@ vm_error vmReadNextSecond( vcsbeam_context *vm )
     if (timestep_idx >= ntimesteps)
         return VM_END_OF_DATA;
 
-    // Now lock the buffer!
-    vm->v->locked = true;
-
     int coarse_chan_idx = vm->coarse_chan_idxs_to_process[0];
     sprintf( vm->log_message, "--- Processing GPS second %ld [%lu/%lu], Coarse channel %lu [%d/%d] ---",
                 gps_second,
@@ -961,31 +1141,49 @@ vm_error vmReadNextSecond( vcsbeam_context *vm )
 
     logger_start_stopwatch( vm->log, "read", true );
 
-    vmReadBufferCopyMargin( vm->v );
-
-    /*
-    mwalib_voltage_context_display(
-            vm->vcs_context,
-            vm->error_message,
-            ERROR_MESSAGE_LEN);
-    */
+    if (vm->mapper != NULL)
+    {
+        // Point the read buffer straight at the data in the (mapped) file
+        vm->v->buffer   = vmMmapReaderGetSecond( vm, gps_second, coarse_chan_idx );
+        vm->v->read_ptr = vm->v->buffer;
+    }
+    else if (vm->batch != NULL)
+    {
+        // Point the read buffer at the second within the current batch,
+        // reading the next batch first if needed
+        vm->v->buffer   = vmBatchReaderGetSecond( vm, gps_second, coarse_chan_idx );
+        vm->v->read_ptr = vm->v->buffer;
+    }
+    else if (vm->reader != NULL)
+    {
+        // Swap in the second that has (hopefully) already been read in the
+        // background. The time spent here is just the time spent waiting.
+        vm->v = vmReadAheadNextSecond( vm );
+    }
+    else
+    {
+        vmReadBufferCopyMargin( vm->v );
 
-    if (mwalib_voltage_context_read_second(
+        /*
+        mwalib_voltage_context_display(
                 vm->vcs_context,
-                gps_second,
-                1,
-                coarse_chan_idx,
-                vm->v->read_ptr,
-                vm->v->read_size,
                 vm->error_message,
-                ERROR_MESSAGE_LEN ) != MWALIB_SUCCESS)
-    {
-        fprintf( stderr, "error: mwalib_voltage_context_read_file failed: %s", vm->error_message );
-        exit(EXIT_FAILURE);
+                ERROR_MESSAGE_LEN);
+        */
+
+        vmReadSeconds( vm, gps_second, 1, coarse_chan_idx,
+                vm->v->read_ptr, vm->v->read_size, vm->error_message );
     }
 
     logger_stop_stopwatch( vm->log, "read" );
 
+    // Let the stager know it can evict the file once all its seconds are read
+    if (vm->stager != NULL)
+        vmStagerConsumeSecond( vm->stager, coarse_chan_idx, gps_second );
+
+    // Now lock the buffer!
+    vm->v->locked = true;
+
     // Increment the count of number of seconds read
     vm->current_gps_idx++;
 
@@ -1070,6 +1268,11 @@ void vmCreateStatistics( vcsbeam_context *vm, mpi_psrfits *mpfs )
     gpuMalloc( (void **)&vm->d_scales,  vm->scales_size );
     gpuMalloc( (void **)&vm->d_Cscaled, vm->Cscaled_size );
 
+    // Low-bit samples are digitised one per byte before being packed
+    vm->d_Cunpacked = NULL;
+    if (vm->out_nbits < 8)
+        gpuMalloc( (void **)&vm->d_Cunpacked, vm->npointing*nchan*vm->out_nstokes*vm->fine_sample_rate );
+
     gpuMallocHost( (void **)&vm->offsets, vm->offsets_size );
     gpuMallocHost( (void **)&vm->scales,  vm->scales_size );
     gpuMallocHost( (void **)&vm->Cscaled, vm->Cscaled_size );
@@ -1092,6 +1295,9 @@ void vmDestroyStatistics( vcsbeam_context *vm )
     gpuFree( vm->d_offsets );
     gpuFree( vm->d_scales );
     gpuFree( vm->d_Cscaled );
+
+    if (vm->d_Cunpacked != NULL)
+        gpuFree( vm->d_Cunpacked );
 }
 
 /**
@@ -1183,6 +1389,10 @@ void vmCreateFilenames( vcsbeam_context *vm )
 
             sprintf( vm->filenames[f_idx], "%s/%s",
                     vm->datadir, filename );
+
+            // mwalib can't read compressed files, so give it a stand-in
+            if (vm->zstd != NULL)
+                vmZstdMakePlaceholder( vm, vm->filenames[f_idx] );
         }
     }
 }
@@ -1560,6 +1770,84 @@ void vmSetNumNotFlaggedRFInputs( vcsbeam_context *vm )
             vm->num_not_flagged++;
 }
 
+/**
+ * Marks the RF inputs that do not need to be read from the voltage files.
+ *
+ * @param vm The VCSBeam context struct
+ *
+ * If calibration solutions have been read in (i.e. `vm&rarr;D` is set),
+ * both inputs of every antenna whose Jones matrices are zero for all fine
+ * channels are marked, since these (flagged) antennas contribute nothing to
+ * the beam. This covers the tiles flagged in the calibration solution as
+ * well as those flagged with vmSetCustomTileFlags(), so this should be
+ * called after them. Otherwise, the inputs flagged in the observation's
+ * metafits file are marked.
+ *
+ * The marked inputs are then filled with zeros instead of being read (see
+ * vmReadSeconds()). This is only possible for MWAX observations, in which
+ * each input's samples are contiguous; for Legacy observations, nothing is
+ * marked. It also has no effect if reading is done by vmInitMmapReader().
+ * This must be called before the first call to vmReadNextSecond().
+ */
+void vmSetSkippedRFInputs( vcsbeam_context *vm )
+{
+    if (vm->obs_metadata->mwa_version != VCSMWAXv2)
+    {
+        logger_timed_message( vm->log, "Flagged RF inputs can only be skipped "
+                "for MWAX observations; reading all inputs instead" );
+        return;
+    }
+
+    uintptr_t ninputs = vm->obs_metadata->num_rf_inputs;
+    uintptr_t nchan   = vm->nfine_chan;
+    uintptr_t npol    = vm->obs_metadata->num_ant_pols; // = 2 (P, Q)
+
+    if (vm->skip_rf_input == NULL)
+        vm->skip_rf_input = (bool *)malloc( ninputs * sizeof(bool) );
+
+    vm->num_skipped_rf_inputs = 0;
+
+    uintptr_t i, ch, d_idx, el;
+    uint32_t ant;
+    char pol;
+    bool skip;
+    for (i = 0; i < ninputs; i++)
+    {
+        ant = vm->obs_metadata->rf_inputs[i].ant;
+        pol = *(vm->obs_metadata->rf_inputs[i].pol);
+
+        if (vm->D != NULL)
+        {
+            // Skip only if all the antenna's Jones matrices are zero
+            skip = true;
+            for (ch = 0; ch < nchan && skip; ch++)
+            {
+                d_idx = D_IDX(ant,ch,0,0,nchan,npol);
+                for (el = 0; el < npol*npol; el++)
+                {
+                    if (gpuCreal(vm->D[d_idx + el]) != 0.0 || gpuCimag(vm->D[d_idx + el]) != 0.0)
+                    {
+                        skip = false;
+                        break;
+                    }
+                }
+            }
+        }
+        else
+            skip = vm->obs_metadata->rf_inputs[i].flagged;
+
+        // The MWAX voltage files are ordered by antenna, then polarisation
+        vm->skip_rf_input[2*ant + (pol - 'X')] = skip;
+
+        if (skip)
+            vm->num_skipped_rf_inputs++;
+    }
+
+    sprintf( vm->log_message, "Skipping %d (flagged) of %lu RF inputs when reading",
+            vm->num_skipped_rf_inputs, ninputs );
+    logger_timed_message( vm->log, vm->log_message );
+}
+
 /**
  * Finds a matching RF input in the given metadata.
  *
@@ -9,6 +9,7 @@
 #include <stdint.h>
 #include <math.h>
 #include <string.h>
+#include <pthread.h>
 #include "gpu_fft.hpp"
 #include "gpu_macros.h"
 
@@ -97,15 +98,40 @@ inline void gpuAssert(gpuError_t code, const char *file, int line, bool abort=tr
  *    device memory, in order that it can make use of cuFFT.
  */
 
+/**
+ * Fetches a single input sample, from either the current chunk or the filter
+ * history.
+ *
+ * @param[in] indata The current chunk of input data, with the MWAX layout
+ * @param[in] history The filter history (the last \f$PK\f$ samples of each
+ *                    RF input preceding `indata`)
+ * @param t The sample index, relative to the start of `indata`. Negative
+ *          values index into `history`.
+ * @param i The RF input
+ * @param I The number of RF inputs
+ * @param H The number of samples of history per RF input (\f$PK\f$)
+ * @return The requested sample
+ */
+__device__ inline char2 vmFetchSample( char2 *indata, char2 *history, int t, int i, int I, int H )
+{
+    if (t < 0)
+        return history[i*H + H + t];
+
+    return indata[vMWAX_IDX((unsigned int)t, i, I)];
+}
+
 /**
  * Performs the weighted overlap-add part of the PFB algorithm.
  *
  * @param[in] indata The input data, \f$x[n]\f$,
  *                   with layout equivalent to the buffer populated by
  *                   mwalib (see [the MWAX voltage format][MWAXHTR])
+ * @param[in] history The last \f$PK\f$ samples of each RF input preceding
+ *                    `indata` (see vmFetchSample())
  * @param[in] filter_coeffs The PFB filter coefficients, \f$h[n]\f$
  * @param[out] weighted_overlap_array The result of the weighted
  *             overlap-add operation, \f$b[n]\f$
+ * @param M The stride of the PFB (\f$M = K\f$ for a critically sampled PFB)
  *
  * The weighted overlap-add part of the PFB algorithm is the equation
  * \f[
@@ -118,8 +144,8 @@ inline void gpuAssert(gpuError_t code, const char *file, int line, bool abort=tr
  *
  * \todo Add data layout information to this docstring.
  */
-__global__ void vmWOLA_kernel( char2 *indata,
-        int *filter_coeffs, void *weighted_overlap_array )
+__global__ void vmWOLA_kernel( char2 *indata, char2 *history,
+        int *filter_coeffs, void *weighted_overlap_array, int M )
 {
     // Parse the block and thread idxs:
     //   <<<(nspectra,I,P),(K)>>>
@@ -139,31 +165,29 @@ __global__ void vmWOLA_kernel( char2 *indata,
     int    i = blockIdx.y;
     int    p = blockIdx.z;
 
-    int    M = K; // This enforces a critical sampled PFB
     int    n = threadIdx.x;
 
     int   *h = filter_coeffs;
     char2 *x = indata;
     int2  *b = (int2 *)weighted_overlap_array;
 
-    // Because we have included a whole voltage block at the beginning of the
-    // buffer, index "m" actually needs to start at N-P, where N is the number
-    // of M-length strides in a voltage block, and P is the number of taps.
-    // For MWAX data, N is always 500.
-    int mprime = m + 500 - P;
+    // The filter window for spectrum m ends just before sample m*M of this
+    // chunk, and so starts P*K samples earlier than that. For the first few
+    // spectra, this reaches back into the history of the previous chunk.
+    int H = P*K;
 
     // Now calculate the index into the various arrays that also
     // takes into account the fact that these arrays contain all RF inputs.
     // MEMO TO SELF: My current going theory is that I don't have to do any
     // re-ordering of the antennas, as that is dealt with elsewhere.
     int h_idx = K*P - K*p - n - 1; // This reverses the filter (think "convolution")
-    unsigned int x_idx = vMWAX_IDX((unsigned int)(mprime*M + p*K + n), i, I);
+    int          t     = m*M + (p - P)*K + n;
     unsigned int b_idx = m*(K*I) + i*(K) + n; // This puts each set of K samples to
                                               // be FFT'd in a contiguous memory block
 
     // Now perform the weighted overlap-add operation
     int   hval = h[h_idx];
-    char2 xval = x[x_idx];
+    char2 xval = vmFetchSample( x, history, t, i, I, H );
 
     // In keeping with the original FPGA implementation, the result now needs to
     // be demoted and rounded.
@@ -178,6 +202,92 @@ __global__ void vmWOLA_kernel( char2 *indata,
 //if (m == 0 && i == 0) printf( "%u %d %d %d %d %d %d %d %d %d %d %d %d\n", n, p, K, P, h_idx, hval, xval.x, xval.y, X, Y, b_idx, b[b_idx].x, b[b_idx].y );
 }
 
+/**
+ * Performs the weighted overlap-add part of the PFB algorithm in floating
+ * point.
+ *
+ * @param[in] indata The input data, \f$x[n]\f$,
+ *                   with layout equivalent to the buffer populated by
+ *                   mwalib (see [the MWAX voltage format][MWAXHTR])
+ * @param[in] history The last \f$PK\f$ samples of each RF input preceding
+ *                    `indata` (see vmFetchSample())
+ * @param[in] filter_coeffs The (real-valued) PFB filter coefficients,
+ *                          \f$h[n]\f$
+ * @param[out] weighted_overlap_array The result of the weighted
+ *             overlap-add operation, \f$b[n]\f$
+ * @param M The stride of the PFB (\f$M = K\f$ for a critically sampled PFB)
+ * @param P The number of taps
+ *
+ * This computes the same quantity as vmWOLA_kernel(), but without requiring
+ * the filter coefficients to be integers. Instead of assigning one thread per
+ * tap and accumulating the result with atomic operations, each thread
+ * computes a single element of \f$b_m[n]\f$ by looping over all \f$P\f$
+ * taps (i.e. the polyphase formulation), using fused multiply-adds. Hence,
+ * `weighted_overlap_array` does not need to be zeroed beforehand, and the
+ * result is already in the floating point format expected by the FFT.
+ *
+ * The expected thread configuration is
+ * \f$ \langle\langle\langle (\text{nspectra},I), K \rangle\rangle\rangle \f$
+ */
+__global__ void vmWOLA_float_kernel( char2 *indata, char2 *history,
+        float *filter_coeffs, gpuFloatComplex *weighted_overlap_array, int M, int P )
+{
+    // Parse the block and thread idxs:
+    //   <<<(nspectra,I),(K)>>>
+    // (see vmWOLA_kernel() for the meaning of the symbols)
+    int    I = gridDim.y;
+    int    K = blockDim.x;
+
+    int    m = blockIdx.x;
+    int    i = blockIdx.y;
+    int    n = threadIdx.x;
+
+    int    H = P*K; // The length of the filter history
+
+    float           *h = filter_coeffs;
+    char2           *x = indata;
+    gpuFloatComplex *b = weighted_overlap_array;
+
+    float X = 0.0f, Y = 0.0f;
+    int p, h_idx, t;
+    char2 xval;
+    for (p = 0; p < P; p++)
+    {
+        h_idx = K*P - K*p - n - 1; // This reverses the filter (think "convolution")
+        t     = m*M + (p - P)*K + n;
+
+        xval = vmFetchSample( x, history, t, i, I, H );
+        X = fmaf( h[h_idx], (float)xval.x, X );
+        Y = fmaf( h[h_idx], (float)xval.y, Y );
+    }
+
+    unsigned int b_idx = m*(K*I) + i*(K) + n;
+    b[b_idx].x = X;
+    b[b_idx].y = Y;
+}
+
+/**
+ * Saves the end of the current chunk as the filter history for the next one.
+ *
+ * @param[in] indata The current chunk of input data, with the MWAX layout
+ * @param[out] history The filter history, to be overwritten
+ * @param nsamples The number of samples (per RF input) in `indata`
+ * @param H The number of samples of history per RF input (\f$PK\f$)
+ *
+ * The expected thread configuration is
+ * \f$\langle\langle\langle I, N \rangle\rangle\rangle\f$,
+ * for any number of threads \f$N\f$.
+ */
+__global__ void vmUpdateHistory_kernel( char2 *indata, char2 *history, int nsamples, int H )
+{
+    int I = gridDim.x;
+    int i = blockIdx.x;
+
+    int h;
+    for (h = threadIdx.x; h < H; h += blockDim.x)
+        history[i*H + h] = indata[vMWAX_IDX((unsigned int)(nsamples - H + h), i, I)];
+}
+
 /**
  * CUDA kernel for performing the rounding and demotion step of the forward
  * PFB.
@@ -276,6 +386,9 @@ __global__ void int2float( void *data, double scale )
  * @param i_idx An array of indexes for the desired ordering of the RF inputs
  *              (i.e. antenna/polarisation combinations)
  * @param flags PFB configuration settings
+ * @param M The stride of the PFB
+ * @param m0 The index of the first spectrum in this chunk, relative to the
+ *           start of the second
  *
  * This is the final step in the forward fine PFB algorithm.
  * At this point, the FFTED array contains the Fourier-transformed data that
@@ -283,18 +396,28 @@ __global__ void int2float( void *data, double scale )
  * to pack it into the same layout (and optionally also the same format) as
  * the VCS recombined data.
  *
+ * If the PFB is oversampled (\f$M < K\f$), the start of each spectrum's
+ * window is not (in general) a multiple of \f$K\f$ samples, and the FFT
+ * output must also be corrected by the phase ramp
+ * \f[
+ *     X_k[m] \rightarrow X_k[m] e^{-2\pi jk(mM \bmod K)/K}
+ * \f]
+ * so that each fine channel is a continuous time series. This has no effect
+ * in the critically sampled case.
+ *
  * The relevant values for `flags` are (see vmInitForwardPFB() for the full
  * table):
  *
  * | Flag name | Description |
  * | :-------- | :---------- |
  * | `PFB_COMPLEX_INT4`    | Typecast the output into (4+4)-bit complex integers |
+ * | `PFB_COMPLEX_FLOAT32` | Typecast the output into (32+32)-bit complex floats |
  * | `PFB_COMPLEX_FLOAT64` | Typecast the output into (64+64)-bit complex floats |
  *
  * The expected thread configuration is
  * \f$\langle\langle\langle(\text{nspectra},K),I\rangle\rangle\rangle\f$.
  */
-__global__ void pack_into_recombined_format( gpuFloatComplex *ffted, void *outdata, int *i_idx, pfb_flags flags )
+__global__ void pack_into_recombined_format( gpuFloatComplex *ffted, void *outdata, int *i_idx, pfb_flags flags, int M, int m0 )
 {
     // Parse the kernel signature, using the same mathematical notation
     // described above
@@ -321,6 +444,17 @@ __global__ void pack_into_recombined_format( gpuFloatComplex *ffted, void *outda
     double re = b[b_idx].x / K;
     double im = b[b_idx].y / K;
 
+    // Apply the phase correction for oversampled PFBs
+    int shift = (int)(((long long)(m0 + m) * M) % K);
+    if (shift != 0)
+    {
+        double s, c, tmp;
+        sincos( -2.0*M_PI*(double)(((long long)k*shift) % K)/(double)K, &s, &c );
+        tmp = re*c - im*s;
+        im  = re*s + im*c;
+        re  = tmp;
+    }
+
     // Put the packed value back into global memory at the appropriate place
     if (flags & PFB_COMPLEX_INT4)
     {
@@ -330,6 +464,14 @@ __global__ void pack_into_recombined_format( gpuFloatComplex *ffted, void *outda
         else
             X[X_idx] = PACK_NIBBLES(im, re);
     }
+    else if (flags & PFB_COMPLEX_FLOAT32)
+    {
+        gpuFloatComplex *X = (gpuFloatComplex *)outdata;
+        if (flags & PFB_IMAG_PART_FIRST)
+            X[X_idx] = make_gpuFloatComplex( re, im );
+        else
+            X[X_idx] = make_gpuFloatComplex( im, re );
+    }
     else // Currently, default is gpuDoubleComplex
     {
         gpuDoubleComplex *X = (gpuDoubleComplex *)outdata;
@@ -342,6 +484,188 @@ __global__ void pack_into_recombined_format( gpuFloatComplex *ffted, void *outda
     __syncthreads();
 }
 
+/**
+ * An entry in the cache of GPU FFT plans (see vmGetFFTPlan()).
+ */
+typedef struct fft_plan_cache_entry_t
+{
+    int          n;        // The size of each FFT
+    int          batch;    // The number of FFTs per execution
+    bool         in_use;   // Whether the plan is currently held by a forward PFB
+    gpufftHandle plan;     // The plan itself
+} fft_plan_cache_entry;
+
+#define FFT_PLAN_CACHE_SIZE 16
+
+static fft_plan_cache_entry fft_plan_cache[FFT_PLAN_CACHE_SIZE];
+static int                  fft_plan_cache_nentries = 0;
+static pthread_mutex_t      fft_plan_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Creates a new 1D, complex-to-complex GPU FFT plan.
+ *
+ * @param n The size of each FFT
+ * @param batch The number of FFTs per execution
+ * @return A handle to the plan
+ */
+static gpufftHandle vmCreateFFTPlan( int n, int batch )
+{
+    gpufftHandle plan;
+
+    int rank     = 1;       // i.e. a 1D FFT
+    int *inembed = NULL;    // Setting this to null makes all subsequent "data layout" parameters ignored
+                            // to use the default layout (contiguous data in memory)
+
+    gpufftResult res = gpufftPlanMany( &plan, rank, &n,
+            inembed, 0, 0, NULL, 0, 0,  // <-- Here are all the ignored data layout parameters
+            GPUFFT_C2C, batch );
+    if (res != GPUFFT_SUCCESS)
+    {
+        fprintf( stderr, "GPUFFT error: Plan creation failed with error code %d\n", res );
+        exit(EXIT_FAILURE);
+    }
+
+    return plan;
+}
+
+/**
+ * Gets a 1D, complex-to-complex GPU FFT plan, creating it if necessary.
+ *
+ * @param n The size of each FFT
+ * @param batch The number of FFTs per execution
+ * @return A handle to the plan
+ *
+ * Plans are cached, keyed by (`n`, `batch`), so that a forward PFB with the
+ * same dimensions as one that has already been freed (e.g. for the next
+ * coarse channel) can reuse its plan, without paying the planning cost (or
+ * allocating the plan's work area) again. (The FFT direction is not part of
+ * the key, since it is given at execution time.) Every call must be matched
+ * by a call to vmReleaseFFTPlan().
+ *
+ * A plan is only ever held by one forward PFB at a time, because cuFFT and
+ * hipFFT only allow concurrent use from different host threads of
+ * different plans. Forward PFBs that exist at the same time (e.g. in
+ * different worker threads) therefore each get their own plan. If all
+ * `FFT_PLAN_CACHE_SIZE` cached plans are in use, the new plan is not
+ * cached at all, and is destroyed again when it is released. The cache
+ * itself is protected by a mutex, so forward PFBs may be created and
+ * destroyed from different threads.
+ */
+static gpufftHandle vmGetFFTPlan( int n, int batch )
+{
+    pthread_mutex_lock( &fft_plan_cache_mutex );
+
+    int e;
+    for (e = 0; e < fft_plan_cache_nentries; e++)
+    {
+        if (!fft_plan_cache[e].in_use && fft_plan_cache[e].n == n && fft_plan_cache[e].batch == batch)
+        {
+            fft_plan_cache[e].in_use = true;
+            gpufftHandle plan = fft_plan_cache[e].plan;
+            pthread_mutex_unlock( &fft_plan_cache_mutex );
+            return plan;
+        }
+    }
+
+    // Not found, so construct a new one, making room for it by throwing
+    // out an unused plan (of some other size) if necessary
+    if (fft_plan_cache_nentries == FFT_PLAN_CACHE_SIZE)
+    {
+        for (e = 0; e < fft_plan_cache_nentries; e++)
+            if (!fft_plan_cache[e].in_use)
+                break;
+
+        if (e == fft_plan_cache_nentries)
+        {
+            // Every cached plan is in use, so this one goes uncached
+            pthread_mutex_unlock( &fft_plan_cache_mutex );
+            return vmCreateFFTPlan( n, batch );
+        }
+
+        gpufftDestroy( fft_plan_cache[e].plan );
+
+        // Fill the gap with the last entry
+        fft_plan_cache_nentries--;
+        fft_plan_cache[e] = fft_plan_cache[fft_plan_cache_nentries];
+    }
+
+    fft_plan_cache_entry *entry = &fft_plan_cache[fft_plan_cache_nentries];
+
+    entry->plan   = vmCreateFFTPlan( n, batch );
+    entry->n      = n;
+    entry->batch  = batch;
+    entry->in_use = true;
+    fft_plan_cache_nentries++;
+
+    gpufftHandle plan = entry->plan;
+    pthread_mutex_unlock( &fft_plan_cache_mutex );
+
+    return plan;
+}
+
+/**
+ * Releases a GPU FFT plan obtained from vmGetFFTPlan().
+ *
+ * @param plan The plan to be released
+ *
+ * A cached plan is kept in the cache, ready to be handed out again by
+ * vmGetFFTPlan(). It is only destroyed when its place in the cache is
+ * needed for a plan of a different size. A plan that was not cached
+ * (because the cache was full of plans in use) is destroyed straight away.
+ */
+static void vmReleaseFFTPlan( gpufftHandle plan )
+{
+    pthread_mutex_lock( &fft_plan_cache_mutex );
+
+    int e;
+    for (e = 0; e < fft_plan_cache_nentries; e++)
+    {
+        if (fft_plan_cache[e].plan == plan)
+        {
+            fft_plan_cache[e].in_use = false;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock( &fft_plan_cache_mutex );
+
+    if (e == fft_plan_cache_nentries)
+        gpufftDestroy( plan );
+}
+
+/**
+ * Destroys the GPU FFT plans held in the cache.
+ *
+ * Every cached plan that is not currently held by a forward PFB is
+ * destroyed (along with its work area), and removed from the cache. Plans
+ * still in use are left alone; they can be cleared out by calling this
+ * again once their forward PFBs have been freed. This is called by
+ * destroy_vcsbeam_context(), so that the plans do not outlive the
+ * application's last forward PFB.
+ */
+void vmFreeFFTPlanCache( void )
+{
+    pthread_mutex_lock( &fft_plan_cache_mutex );
+
+    int e = 0;
+    while (e < fft_plan_cache_nentries)
+    {
+        if (fft_plan_cache[e].in_use)
+        {
+            e++;
+            continue;
+        }
+
+        gpufftDestroy( fft_plan_cache[e].plan );
+
+        // Fill the gap with the last entry
+        fft_plan_cache_nentries--;
+        fft_plan_cache[e] = fft_plan_cache[fft_plan_cache_nentries];
+    }
+
+    pthread_mutex_unlock( &fft_plan_cache_mutex );
+}
+
 /**
  * Create and initialise a forward_pfb struct.
  *
@@ -351,10 +675,17 @@ __global__ void pack_into_recombined_format( gpuFloatComplex *ffted, void *outda
  *
  * Setting \f$M = K\f$, where \f$K\f$ is the value of
  * `vm&rarr;analysis_filter&rarr;nchans`, will make this a
- * "critically sampled PFB"; setting \f$M > K\f$, an "oversampled PFB".
+ * "critically sampled PFB"; setting \f$M < K\f$, an "oversampled PFB",
+ * with oversampling factor \f$K/M\f$. \f$M\f$ must divide evenly into the
+ * number of samples per second, and the resulting fine channel sample rate
+ * (`vm&rarr;fine_sample_rate`) will be \f$K/M\f$ times higher than in the
+ * critically sampled case.
  *
  * A filter must already be loaded into `vm&rarr;analysis_filter`.
- * **WARNING! The filter will be forcibly typecast to int!!**
+ * **WARNING! If `PFB_EMULATE_FPGA` is set, the filter will be forcibly
+ * typecast to int!!** Otherwise, the filter coefficients are kept as
+ * (32-bit) floats, and the weighted overlap-add is done in floating point
+ * (see vmWOLA_float_kernel()).
  *
  * The GPU processing will be divided up into `vm&rarr;chunks_per_second`,
  * chunks per second, but if this number does not divide the number
@@ -369,11 +700,16 @@ __global__ void pack_into_recombined_format( gpuFloatComplex *ffted, void *outda
  * | `PFB_MALLOC_DEVICE_OUTPUT` | Allocate memory on GPU for the output       |
  * | `PFB_MALLOC_ALL`           | Synonym for <code>PFB_MALLOC_HOST_INPUT \| PFB_MALLOC_HOST_OUTPUT \| PFB_MALLOC_DEVICE_INPUT \| PFB_MALLOC_DEVICE_OUTPUT</code> |
  * | `PFB_COMPLEX_INT4`         | Typecast the output into (4+4)-bit complex integers |
+ * | `PFB_COMPLEX_FLOAT32`      | Typecast the output into (32+32)-bit complex floats |
  * | `PFB_COMPLEX_FLOAT64`      | Typecast the output into (64+64)-bit complex floats |
  * | `PFB_IMAG_PART_FIRST`      | Place the imaginary part of the output in the first (i.e. most significant) position |
  * | `PFB_EMULATE_FPGA`         | Perform the (asymmetric) rounding and demotion step in exactly the same way as the original (Phase 1 & 2) MWA FPGAs |
  * | `PFB_SMART`                | Synonym for <code>PFB_MALLOC_HOST_INPUT \| PFB_MALLOC_DEVICE_INPUT \| PFB_MALLOC_DEVICE_OUTPUT \| PFB_EMULATE_FPGA \| PFB_COMPLEX_INT4</code> |
- * | `PFB_FULL_PRECISION`       | Synonym for <code>PFB_MALLOC_HOST_INPUT \| PFB_MALLOC_DEVICE_INPUT \| PFB_MALLOC_DEVICE_OUTPUT \| PFB_COMPLEX_FLOAT64</code> |
+ * | `PFB_FULL_PRECISION`       | Synonym for <code>PFB_MALLOC_HOST_INPUT \| PFB_MALLOC_DEVICE_INPUT \| PFB_MALLOC_DEVICE_OUTPUT \| PFB_COMPLEX_FLOAT32</code> |
+ *
+ * Since the FFT is performed in single precision, `PFB_COMPLEX_FLOAT32`
+ * preserves the full precision of the result, in half the memory required
+ * by `PFB_COMPLEX_FLOAT64`.
  */
 void vmInitForwardPFB( vcsbeam_context *vm, int M, pfb_flags flags )
 {
@@ -399,6 +735,22 @@ void vmInitForwardPFB( vcsbeam_context *vm, int M, pfb_flags flags )
     // error or warning is generated otherwise, not even if the inferred
     // number of taps (P) is 0.
 
+    // One GPU thread is used per output channel
+    if (fpfb->K > 1024)
+    {
+        fprintf( stderr, "error: vmInitForwardPFB: number of channels "
+                "K (=%d) must not exceed 1024\n", fpfb->K );
+        exit(EXIT_FAILURE);
+    }
+
+    if (M <= 0 || M > fpfb->K || nsamples % M != 0)
+    {
+        fprintf( stderr, "error: vmInitForwardPFB: stride M (=%d) must be "
+                "between 1 and K (=%d), and must divide evenly into the "
+                "number of samples per second (=%u)\n", M, fpfb->K, nsamples );
+        exit(EXIT_FAILURE);
+    }
+
     // Set up the idxs for the "rf input" output order,
     // and copy to device
     (gpuMallocHost( (void **)&(fpfb->i_output_idx),   fpfb->I*sizeof(int) ));
@@ -420,19 +772,38 @@ void vmInitForwardPFB( vcsbeam_context *vm, int M, pfb_flags flags )
 
     (gpuMemcpyAsync( fpfb->d_i_output_idx, fpfb->i_output_idx, fpfb->I*sizeof(int), gpuMemcpyHostToDevice ));
 
-    // Work out the sizes of the various arrays
-    while (fpfb->nspectra % vm->chunks_per_second != 0)
+    // Work out the sizes of the various arrays. Chunks must contain a whole
+    // number of both spectra and voltage blocks
+    while (fpfb->nspectra % vm->chunks_per_second != 0 ||
+            vm->vcs_metadata->num_voltage_blocks_per_second % vm->chunks_per_second != 0)
         vm->chunks_per_second++;
     fpfb->nspectra_per_chunk = fpfb->nspectra / vm->chunks_per_second;
 
     int num_voltage_blocks_per_chunk = vm->vcs_metadata->num_voltage_blocks_per_second / vm->chunks_per_second;
-    fpfb->d_htr_size = (num_voltage_blocks_per_chunk + 1) * vm->vcs_metadata->voltage_block_size_bytes;
+    fpfb->d_htr_size = num_voltage_blocks_per_chunk * vm->vcs_metadata->voltage_block_size_bytes;
+
+    // The filter history must fit inside a single chunk, since it is taken
+    // from the end of each chunk in turn
+    fpfb->nsamples_per_chunk = nsamples / vm->chunks_per_second;
+    if (fpfb->P*fpfb->K > fpfb->nsamples_per_chunk)
+    {
+        fprintf( stderr, "error: vmInitForwardPFB: filter length (=%d) "
+                "exceeds the number of samples per chunk (=%d)\n",
+                fpfb->P*fpfb->K, fpfb->nsamples_per_chunk );
+        exit(EXIT_FAILURE);
+    }
+    fpfb->history_size = fpfb->I * fpfb->P * fpfb->K * sizeof(char2);
 
     if (flags & PFB_COMPLEX_INT4)
     {
         fpfb->vcs_size = fpfb->nspectra * vm->obs_metadata->num_rf_inputs * fpfb->K * sizeof(uint8_t);
         vm->datatype = VM_INT4;
     }
+    else if (flags & PFB_COMPLEX_FLOAT32)
+    {
+        fpfb->vcs_size = fpfb->nspectra * vm->obs_metadata->num_rf_inputs * fpfb->K * sizeof(gpuFloatComplex);
+        vm->datatype = VM_FLT;
+    }
     else // i.e., default is gpuDoubleComplex
     {
         fpfb->vcs_size = fpfb->nspectra * vm->obs_metadata->num_rf_inputs * fpfb->K * sizeof(gpuDoubleComplex);
@@ -449,16 +820,35 @@ void vmInitForwardPFB( vcsbeam_context *vm, int M, pfb_flags flags )
          vm->vcs_metadata->voltage_block_size_bytes) / sizeof(char2);
     fpfb->bytes_per_block = vm->vcs_metadata->voltage_block_size_bytes;
 
-    fpfb->weighted_overlap_add_size = vm->v->buffer_size * (sizeof(gpuFloatComplex) / sizeof(char2)) / vm->chunks_per_second;
-    size_t filter_size = vm->analysis_filter->ncoeffs * sizeof(int);
+    fpfb->weighted_overlap_add_size = fpfb->nspectra_per_chunk * fpfb->I * fpfb->K * sizeof(gpuFloatComplex);
 
-    // Allocate memory for filter and copy across the filter coefficients,
-    // casting to int
-    (gpuMallocHost( (void **)&(fpfb->filter_coeffs),   filter_size ));
-    (gpuMalloc(     (void **)&(fpfb->d_filter_coeffs), filter_size ));
-    for (i = 0; i < vm->analysis_filter->ncoeffs; i++)
-        fpfb->filter_coeffs[i] = (int)vm->analysis_filter->coeffs[i]; // **WARNING! Forcible typecast to int!**
-    (gpuMemcpyAsync( fpfb->d_filter_coeffs, fpfb->filter_coeffs, filter_size, gpuMemcpyHostToDevice ));
+    // Allocate memory for filter and copy across the filter coefficients
+    fpfb->filter_coeffs       = NULL;
+    fpfb->d_filter_coeffs     = NULL;
+    fpfb->filter_coeffs_flt   = NULL;
+    fpfb->d_filter_coeffs_flt = NULL;
+    if (flags & PFB_EMULATE_FPGA)
+    {
+        // Cast to int, as per the original FPGA implementation
+        size_t filter_size = vm->analysis_filter->ncoeffs * sizeof(int);
+        (gpuMallocHost( (void **)&(fpfb->filter_coeffs),   filter_size ));
+        (gpuMalloc(     (void **)&(fpfb->d_filter_coeffs), filter_size ));
+        for (i = 0; i < vm->analysis_filter->ncoeffs; i++)
+            fpfb->filter_coeffs[i] = (int)vm->analysis_filter->coeffs[i]; // **WARNING! Forcible typecast to int!**
+        (gpuMemcpyAsync( fpfb->d_filter_coeffs, fpfb->filter_coeffs, filter_size, gpuMemcpyHostToDevice ));
+    }
+    else
+    {
+        // Keep the real-valued coefficients. The scale factor is equivalent
+        // to the ">> 14" operation applied in fpga_rounding_and_demotion(),
+        // so that the output levels match those of the integer version.
+        size_t filter_size = vm->analysis_filter->ncoeffs * sizeof(float);
+        (gpuMallocHost( (void **)&(fpfb->filter_coeffs_flt),   filter_size ));
+        (gpuMalloc(     (void **)&(fpfb->d_filter_coeffs_flt), filter_size ));
+        for (i = 0; i < vm->analysis_filter->ncoeffs; i++)
+            fpfb->filter_coeffs_flt[i] = (float)(vm->analysis_filter->coeffs[i] / 16384.0);
+        (gpuMemcpyAsync( fpfb->d_filter_coeffs_flt, fpfb->filter_coeffs_flt, filter_size, gpuMemcpyHostToDevice ));
+    }
 
     // Allocate device memory for the other arrays
     if (flags & PFB_MALLOC_HOST_OUTPUT)
@@ -473,29 +863,35 @@ void vmInitForwardPFB( vcsbeam_context *vm, int M, pfb_flags flags )
     if (flags & PFB_MALLOC_DEVICE_OUTPUT)
         (gpuMalloc( (void **)&(fpfb->d_vcs_data), fpfb->d_vcs_size ));
     (gpuMalloc( (void **)&(fpfb->d_weighted_overlap_add), fpfb->weighted_overlap_add_size ));
+    (gpuMalloc( (void **)&(fpfb->d_history), fpfb->history_size ));
+    vmResetForwardPFB( fpfb );
 
-    // Construct the cuFFT plan
-    int rank     = 1;       // i.e. a 1D FFT
-    int n        = fpfb->K; // size of each FFT
-    int *inembed = NULL;    // Setting this to null makes all subsequent "data layout" parameters ignored
-                            // to use the default layout (contiguous data in memory)
-
+    // Get the cuFFT plan (reusing an existing one if possible)
     fpfb->ninputs_per_cufft_batch = 32; // This seems to work, so I'll have to call cuFFT 256/32 = 8 times
     fpfb->cufft_batch_size = fpfb->nspectra_per_chunk * fpfb->ninputs_per_cufft_batch;
-
-    gpufftResult res = gpufftPlanMany( &(fpfb->plan), rank, &n,
-            inembed, 0, 0, NULL, 0, 0,  // <-- Here are all the ignored data layout parameters
-            GPUFFT_C2C, fpfb->cufft_batch_size );
-    if (res != GPUFFT_SUCCESS)
-    {
-        fprintf( stderr, "GPUFFT error: Plan creation failed with error code %d\n", res );
-        exit(EXIT_FAILURE);
-    }
+    fpfb->plan = vmGetFFTPlan( fpfb->K, fpfb->cufft_batch_size );
 
     vm->fine_sample_rate = fpfb->nspectra;
     vm->nfine_chan       = fpfb->K;
 }
 
+/**
+ * Clears the filter history of the forward PFB.
+ *
+ * @param fpfb The `forward_pfb` object to be reset.
+ *
+ * The forward PFB keeps the last \f$PK\f$ samples of each RF input from one
+ * chunk to the next, so that consecutive chunks (and seconds) can be fed in
+ * exactly once, without any overlap. This function zeros that history, which
+ * should be done whenever the next chunk to be processed does not directly
+ * follow the previous one (e.g. when skipping to a different part of the
+ * observation). It is called automatically by vmInitForwardPFB().
+ */
+void vmResetForwardPFB( forward_pfb *fpfb )
+{
+    (gpuMemset( fpfb->d_history, 0, fpfb->history_size ));
+}
+
 /**
  * Frees host and device memory allocated in vmInitForwardPFB().
  *
@@ -505,15 +901,18 @@ void vmInitForwardPFB( vcsbeam_context *vm, int M, pfb_flags flags )
  */
 void vmFreeForwardPFB( forward_pfb *fpfb )
 {
-    gpufftDestroy( fpfb->plan );
+    vmReleaseFFTPlan( fpfb->plan );
     (gpuHostFree( fpfb->filter_coeffs ));
+    (gpuHostFree( fpfb->filter_coeffs_flt ));
     (gpuHostFree( fpfb->vcs_data ));
     (gpuHostFree( fpfb->i_output_idx ));
     (gpuFree( fpfb->d_filter_coeffs ));
+    (gpuFree( fpfb->d_filter_coeffs_flt ));
     (gpuFree( fpfb->d_htr_data ));
     (gpuFree( fpfb->d_vcs_data ));
     (gpuFree( fpfb->d_i_output_idx ));
     (gpuFree( fpfb->d_weighted_overlap_add ));
+    (gpuFree( fpfb->d_history ));
     free( fpfb );
 }
 
@@ -527,19 +926,19 @@ void vmFreeForwardPFB( forward_pfb *fpfb )
  * chunk:  0       1       2       3     c
  *                                       ^ from
  *
- *          <--ds-->
- * Device: |--------|
+ *          <--hs->
+ * Device: |-------|
  *         ^ to
  * ```
  * where
  *  - **from** = `vm&rarr;v&rarr;buffer + c*hs`
  *  - **to** = `vm&rarr;fpfb&rarr;d_htr_data`
- *  - **ds** = `vm&rarr;fpfb&rarr;d_htr_size`
- *  - **hs** = `vm&rarr;fpfb&rarr;htr_stride`
+ *  - **hs** = `vm&rarr;fpfb&rarr;htr_stride` (= `vm&rarr;fpfb&rarr;d_htr_size`)
  *  - **c** = `vm&rarr;chunk_to_load % vm&rarr;chunks_per_second`
  *
- * Note that **ds** is not necessarily equal to **hs**, and that **ds** bytes are
- * copied.
+ * Each chunk is copied exactly once; the samples needed from the previous
+ * chunk are kept on the device in the filter history (see
+ * vmResetForwardPFB()).
  */
 void vmUploadForwardPFBChunk( vcsbeam_context *vm )
 {
@@ -563,6 +962,10 @@ void vmUploadForwardPFBChunk( vcsbeam_context *vm )
 /**
  * Calls the vmWOLA_kernel() kernel for the forward PFB data.
  *
+ * If `PFB_EMULATE_FPGA` is not set, vmWOLA_float_kernel() is called
+ * instead. Afterwards, the end of the chunk is saved as the filter history
+ * for the next chunk (see vmUpdateHistory_kernel()).
+ *
  * @todo Keep this as a "pure" forward_pfb function, and make a separate
  *       "vm" function that's exposed.
  */
@@ -571,15 +974,30 @@ void vmWOLAChunk( vcsbeam_context *vm )
     // Shorthand variable
     forward_pfb *fpfb = vm->fpfb;
 
-    dim3 blocks( fpfb->nspectra_per_chunk, fpfb->I, fpfb->P );
     dim3 threads( fpfb->K );
 
     logger_start_stopwatch( vm->log, "pfb-wola", false );
 
-    // Set the d_weighted_overlap_add array to zeros
-    (gpuMemset( fpfb->d_weighted_overlap_add, 0, fpfb->weighted_overlap_add_size ));
+    if (fpfb->flags & PFB_EMULATE_FPGA)
+    {
+        dim3 blocks( fpfb->nspectra_per_chunk, fpfb->I, fpfb->P );
+
+        // Set the d_weighted_overlap_add array to zeros
+        (gpuMemset( fpfb->d_weighted_overlap_add, 0, fpfb->weighted_overlap_add_size ));
 
-    vmWOLA_kernel<<<blocks, threads>>>( fpfb->d_htr_data, fpfb->d_filter_coeffs, fpfb->d_weighted_overlap_add );
+        vmWOLA_kernel<<<blocks, threads>>>( fpfb->d_htr_data, fpfb->d_history, fpfb->d_filter_coeffs, fpfb->d_weighted_overlap_add,
+                fpfb->M );
+    }
+    else
+    {
+        dim3 blocks( fpfb->nspectra_per_chunk, fpfb->I );
+        vmWOLA_float_kernel<<<blocks, threads>>>( fpfb->d_htr_data, fpfb->d_history, fpfb->d_filter_coeffs_flt, fpfb->d_weighted_overlap_add,
+                fpfb->M, fpfb->P );
+    }
+
+    // Carry the end of this chunk over to the next one
+    vmUpdateHistory_kernel<<<fpfb->I, 1024>>>( fpfb->d_htr_data, fpfb->d_history,
+            fpfb->nsamples_per_chunk, fpfb->P*fpfb->K );
     gpuDeviceSynchronize();
     ( gpuPeekAtLastError() );
 
@@ -589,6 +1007,10 @@ void vmWOLAChunk( vcsbeam_context *vm )
 /**
  * Calls the fpga_rounding_and_demotion() kernel for the forward PFB data.
  *
+ * If `PFB_EMULATE_FPGA` is not set, the weighted overlap-add output is
+ * already in floating point (see vmWOLA_float_kernel()), and this function
+ * does nothing.
+ *
  * @todo Keep this as a "pure" forward_pfb function, and make a separate
  *       "vm" function that's exposed.
  */
@@ -597,23 +1019,16 @@ void vmFPGARoundingChunk( vcsbeam_context *vm )
     // Shorthand variable
     forward_pfb *fpfb = vm->fpfb;
 
+    // The floating point WOLA needs no rounding or conversion
+    if (!(fpfb->flags & PFB_EMULATE_FPGA))
+        return;
+
     logger_start_stopwatch( vm->log, "pfb-round", false );
 
-    if (fpfb->flags & PFB_EMULATE_FPGA)
-    {
-        // Perform the weird rounding and demotion described in the appendix of McSweeney et al. (2020)
-        dim3 blocks( fpfb->nspectra_per_chunk, fpfb->I );
-        dim3 threads( fpfb->K );
-        fpga_rounding_and_demotion<<<blocks, threads>>>( fpfb->d_weighted_overlap_add );
-    }
-    else
-    {
-        // Otherwise, just convert the ints to floats in preparation for the gpuFFT
-        dim3 blocks( (2 * fpfb->nspectra_per_chunk * fpfb->I * fpfb->K) / 1024 ); // The factor of 2 is because each thread will deal with a single int, not a single int2
-        dim3 threads( 1024 );
-        double scale = 1.0/16384.0; // equivalent to the ">> 14" operation applied in fpga_rounding_and_demotion()
-        int2float<<<blocks, threads>>>( fpfb->d_weighted_overlap_add, scale );
-    }
+    // Perform the weird rounding and demotion described in the appendix of McSweeney et al. (2020)
+    dim3 blocks( fpfb->nspectra_per_chunk, fpfb->I );
+    dim3 threads( fpfb->K );
+    fpga_rounding_and_demotion<<<blocks, threads>>>( fpfb->d_weighted_overlap_add );
     gpuDeviceSynchronize();
     ( gpuPeekAtLastError() );
 
@@ -662,10 +1077,13 @@ void vmPackChunk( vcsbeam_context *vm )
     dim3 blocks( fpfb->nspectra_per_chunk, fpfb->K );
     dim3 threads( fpfb->I );
 
+    int chunk = vm->chunk_to_load % vm->chunks_per_second;
+    int m0    = chunk * fpfb->nspectra_per_chunk;
+
     logger_start_stopwatch( vm->log, "pfb-pack", false );
 
     pack_into_recombined_format<<<blocks, threads>>>( fpfb->d_weighted_overlap_add,
-            fpfb->d_vcs_data, fpfb->d_i_output_idx, fpfb->flags );
+            fpfb->d_vcs_data, fpfb->d_i_output_idx, fpfb->flags, fpfb->M, m0 );
     gpuDeviceSynchronize();
     ( gpuPeekAtLastError() );
 
@@ -795,6 +1213,65 @@ void vmWritePFBOutputToFile( vcsbeam_context *vm )
     logger_stop_stopwatch( vm->log, "write" );
 }
 
+/**
+ * Hands the result of the forward PFB operation to a write queue.
+ *
+ * @param vm The VCSBeam context struct
+ * @param wq A write queue whose buffers are of size
+ *           `vm&rarr;fpfb&rarr;vcs_size`
+ *
+ * This does the same as vmWritePFBOutputToFile(), except that the file is
+ * written in the background by `wq`'s writer threads.
+ * `vm&rarr;fpfb&rarr;vcs_data` is swapped for an empty buffer from the
+ * queue, so no data is copied, and the next second can be processed straight
+ * away.
+ */
+void vmWritePFBOutputToQueue( vcsbeam_context *vm, write_queue *wq )
+{
+    logger_start_stopwatch( vm->log, "write", true );
+
+    char filename[128];
+    vmGetLegacyVoltFilename( vm,
+            vm->coarse_chan_idxs_to_process[0],
+            vm->gps_seconds_to_process[vm->current_gps_idx-1],
+            filename );
+
+    vm->fpfb->vcs_data = vmWriteQueueSwap( wq, vm->fpfb->vcs_data, vm->fpfb->vcs_size, filename );
+
+    logger_stop_stopwatch( vm->log, "write" );
+}
+
+/**
+ * Primes the forward PFB's filter history with the end of a second of data.
+ *
+ * @param vm The VCSBeam context struct
+ *
+ * The second of data most recently read in with vmReadNextSecond() is not
+ * channelised. Only its last chunk is uploaded to the device, and its last
+ * \f$PK\f$ samples are used as the filter history for the next second.
+ * This allows processing to start part-way through an observation (e.g. when
+ * splitting it into independent time segments) with exactly the same output
+ * as if all the preceding seconds had been processed.
+ */
+void vmPrimeForwardPFB( vcsbeam_context *vm )
+{
+    // Shorthand variable
+    forward_pfb *fpfb = vm->fpfb;
+
+    // Skip ahead to the last chunk of the second
+    vm->chunk_to_load += vm->chunks_per_second - 1 - (vm->chunk_to_load % vm->chunks_per_second);
+
+    // This also releases the read buffer
+    vmUploadForwardPFBChunk( vm );
+
+    vmUpdateHistory_kernel<<<fpfb->I, 1024>>>( fpfb->d_htr_data, fpfb->d_history,
+            fpfb->nsamples_per_chunk, fpfb->P*fpfb->K );
+    gpuDeviceSynchronize();
+    ( gpuPeekAtLastError() );
+
+    vm->chunk_to_load++;
+}
+
 /**
  * \file pfb.cu
  *
@@ -807,8 +1284,8 @@ void vmWritePFBOutputToFile( vcsbeam_context *vm )
 /**
  * CUDA kernel implementing the synthesis PFB.
  *
- * @param[in]  in_real ...
- * @param[in]  in_imag ...
+ * @param[in]  history The last `ntaps` spectra of the previous second
+ * @param[in]  in The spectra of the current second
  * @param[in]  ft_real ...
  * @param[in]  ft_imag ...
  * @param      ntaps ...
@@ -825,7 +1302,10 @@ void vmWritePFBOutputToFile( vcsbeam_context *vm )
  * involves a few terms because of the finiteness of the filter, `f`. To be
  * precise, there are precisely `ntaps` non-zero values.
  *
- * \f$X_k[m]\f$ represents the complex-valued inputs, `in_real` and `in_imag`.
+ * \f$X_k[m]\f$ represents the complex-valued inputs, `history` (for the
+ * first `ntaps` spectra) followed by `in`. Both have layout
+ * \f$N_t \times K \times N_p\f$ (i.e. the layout of a single pointing of
+ * \f${\bf e}\f$; see `B_IDX`).
  * Every possible value of \f$f[n]\,e^{2\pi jkn/K}\f$ is provided in `ft_real`
  * and `ft_imag`.
  *
@@ -840,7 +1320,7 @@ void vmWritePFBOutputToFile( vcsbeam_context *vm )
  * \todo Revamp this function to use cuComplex.
  */
 __global__ void ipfb_kernel(
-    float *in_real, float *in_imag,
+    gpuDoubleComplex *history, gpuDoubleComplex *in,
     float *ft_real, float *ft_imag,
     int ntaps, int npol, float *out )
 {
@@ -867,12 +1347,20 @@ __global__ void ipfb_kernel(
     float out_imag = 0.0;
 
     // Perform the double sum
-    int m, k, f, tw, ft, i;
+    int m, k, f, tw, ft, i, s;
+    float in_real, in_imag;
+    gpuDoubleComplex *X;
     for (m = m0; m < m0 + P; m++)
     {
         // With m now known, we can get the index for the filter
         f = n - m*M;
 
+        // The fine channel time index, m, must be adjusted to ensure that
+        // n=0 corresponds to the first full filter's worth of input samples.
+        // The first P of these come from the previous second.
+        s = m + P;
+        X = (s < P ? history + s*npol*K : in + (s - P)*npol*K);
+
         //printf("n=%d, m=%d, f=%d\n", n, m, f);
         for (k = 0; k < K; k++)
         {
@@ -883,19 +1371,17 @@ __global__ void ipfb_kernel(
             // The index into the ft (= filter/twiddle) array is
             ft = F*tw + f;
 
-            // The "in" index (see cu_invert_pfb() for how the in[] arrays
-            // were packed)
-            // The fine channel time index, m, must be adjusted to ensure that
-            // n=0 corresponds to the first full filter's worth of input samples
-            i = (m+P) * npol * K + \
-                k     * npol     + \
-                pol;
+            // The index into the current spectrum
+            i = k*npol + pol;
+
+            in_real = (float)gpuCreal( X[i] );
+            in_imag = (float)gpuCimag( X[i] );
 
             // Complex multiplication
-            out_real += in_real[i] * ft_real[ft] -
-                        in_imag[i] * ft_imag[ft];
-            out_imag += in_real[i] * ft_imag[ft] +
-                        in_imag[i] * ft_real[ft];
+            out_real += in_real * ft_real[ft] -
+                        in_imag * ft_imag[ft];
+            out_imag += in_real * ft_imag[ft] +
+                        in_imag * ft_real[ft];
         }
     }
 
@@ -910,20 +1396,18 @@ __global__ void ipfb_kernel(
 /**
  * Invert the PFB by applying a resynthesis filter, using GPU acceleration.
  *
- * This function expects `data_buffer_fine` to be a 1D array of complex
- * voltages with indices following the ordering:
+ * This function expects `d_e` to be a 1D array of complex voltages on the
+ * GPU (i.e. `vm&rarr;d_e`), containing one second's worth of data, with
+ * indices following the ordering:
  *
  * ```
  *   pointing, samp, chan, pol
  * ```
  *
- * Although `data_buffer_fine` potentially contains 2 seconds' worth of data,
- * this function only inverts 1 second. The appropriate second is worked out
- * using `file_no`: if it is even, the first half of `data_buffer_fine` is
- * used; if odd, the second half.
- *
- * The IPFB is also given ntaps samples from the end of the previous second,
- * so in total the IPFB is given nsamp+ntaps samples worth of data.
+ * The data are consumed in place. The synthesis filter also needs the last
+ * `ntaps` spectra of the previous second, which are kept on the GPU (in
+ * `g&rarr;d_history`) from one call to the next. Before the first call, this
+ * history is zero (see malloc_ipfb()).
  *
  * The output of the inversion is packed back into `data_buffer_vdif`, a 1D
  * array whose ordering is as follows:
@@ -937,67 +1421,33 @@ __global__ void ipfb_kernel(
  * It is assumed that the inverse filter coefficients have already been loaded
  * to the GPU.
  */
-void cu_invert_pfb( gpuDoubleComplex *data_buffer_fine, int file_no,
-                        int npointing, int nsamples, int nchan, int npol,
-                        int sizeof_buffer,
+void cu_invert_pfb( gpuDoubleComplex *d_e, int npointing, int nsamples,
+                        int nchan, int npol,
                         struct gpu_ipfb_arrays *g, float *data_buffer_vdif )
 {
-    // Setup input values:
-    // The starting sample index is "ntaps" places from the end of the second
-    // half of detected_beam if the file number is even, and "ntaps" places
-    // from the end of the first half of detected_beam if the file number is
-    // odd.
-    int start_s = (file_no % 2 == 0 ? 2*nsamples - g->ntaps : nsamples - g->ntaps);
-
-    int p,s_in,s,ch,pol,i,j;
-    for (p = 0; p < npointing; p++)
-    for (s_in = 0; s_in < nsamples + g->ntaps; s_in++)
-    {
-        // s_in is the sample index in the IPFB buffers, in_real and in_imag
-        // s    is the sample index in data_buffer_fine
-        s = (start_s + s_in) % (2*nsamples);
-        for (ch = 0; ch < nchan; ch++)
-        {
-            for (pol = 0; pol < npol; pol++)
-            {
-                // Calculate the index for the IPFB bufffers, in_real and in_imag;
-                i = B_IDX(p,s_in,ch,pol,nsamples+g->ntaps,nchan,npol);
-
-                // Calculate the index for data_buffer_fine
-                j = B_IDX(p,s,ch,pol,nsamples,nchan,npol);
-                
-                // Copy the data into the IPFB buffers
-                // For the first chunk of data, there is no overlap from the previous
-                // second so the first ntaps samples will be set to zero
-                if (file_no == 0 && s_in < g->ntaps)
-                {
-                    g->in_real[i] = 0.0;
-                    g->in_imag[i] = 0.0;
-                }
-                else
-                {
-                    g->in_real[i] = gpuCreal( data_buffer_fine[j] );
-                    g->in_imag[i] = gpuCimag( data_buffer_fine[j] );
-                }
-            }
-        }
-    }
-    
-    // Copy the data to the device
-    (gpuMemcpy( g->d_in_real, g->in_real, g->in_size, gpuMemcpyHostToDevice ));
-    (gpuMemcpy( g->d_in_imag, g->in_imag, g->in_size, gpuMemcpyHostToDevice ));
-    
-    // Call the kernel
     if (npointing > 1)
     {
         fprintf( stderr, "error: PFB inversion currently only supports a single pointing\n" );
         exit(EXIT_FAILURE);
     }
-    ipfb_kernel<<<nsamples, nchan*npol>>>( g->d_in_real, g->d_in_imag,
+
+    // Call the kernel
+    ipfb_kernel<<<nsamples, nchan*npol>>>( g->d_history, d_e,
                                              g->d_ft_real, g->d_ft_imag,
                                              g->ntaps, npol, g->d_out );
     ( gpuPeekAtLastError() );
 
+    // Keep the last ntaps spectra of each pointing for the next second
+    size_t spectrum_size = nchan * npol;
+    int p;
+    for (p = 0; p < npointing; p++)
+    {
+        (gpuMemcpy( g->d_history + p*g->ntaps*spectrum_size,
+                    d_e + B_IDX(p,nsamples - g->ntaps,0,0,nsamples,nchan,npol),
+                    g->ntaps*spectrum_size*sizeof(gpuDoubleComplex),
+                    gpuMemcpyDeviceToDevice ));
+    }
+
     // Copy the result back into host memory
     (gpuMemcpy( data_buffer_vdif, g->d_out, g->out_size, gpuMemcpyDeviceToHost ));
 }
@@ -1059,26 +1509,32 @@ void malloc_ipfb( struct gpu_ipfb_arrays *g, pfb_filter *filter, int nsamples,
     int nchan = filter->nchans;
     int fil_size = filter->ncoeffs;
 
-    // Flatten the input array (detected_array) for GPU.
-    // We only need one second's worth, plus 12 time samples tacked onto the
-    // beginning (from the previous second)
+    // One GPU thread is used per channel and polarisation
+    if (nchan*npol > 1024)
+    {
+        fprintf( stderr, "error: malloc_ipfb: number of channels (=%d) "
+                "times number of polarisations (=%d) must not exceed 1024\n",
+                nchan, npol );
+        exit(EXIT_FAILURE);
+    }
+
+    // The input is read directly from the beamformer output on the GPU.
+    // We only need to keep the last ntaps spectra from the previous second
 
-    g->ntaps     = ntaps;
-    g->in_size   = npointing * ((nsamples + ntaps) * nchan * npol) * sizeof(float);
-    g->ft_size   = fil_size * nchan * sizeof(float);
-    g->out_size  = npointing * nsamples * filter->nchans * npol * 2 * sizeof(float);
+    g->ntaps        = ntaps;
+    g->history_size = npointing * ntaps * nchan * npol * sizeof(gpuDoubleComplex);
+    g->ft_size      = fil_size * nchan * sizeof(float);
+    g->out_size     = npointing * nsamples * filter->nchans * npol * 2 * sizeof(float);
 
     // Allocate memory on the device
-    (gpuMalloc( (void **)&g->d_in_real, g->in_size ));
-    (gpuMalloc( (void **)&g->d_in_imag, g->in_size ));
+    (gpuMalloc( (void **)&g->d_history, g->history_size ));
+    (gpuMemset( g->d_history, 0, g->history_size )); // There is no "previous second" to begin with
     (gpuMalloc( (void **)&g->d_ft_real, g->ft_size ));
     (gpuMalloc( (void **)&g->d_ft_imag, g->ft_size ));
 
     (gpuMalloc( (void **)&g->d_out, g->out_size ));
 
-    // Allocate memory for host copies of the same
-    g->in_real = (float *)malloc( g->in_size );
-    g->in_imag = (float *)malloc( g->in_size );
+    // Allocate memory for host copies of the filter
     g->ft_real = (float *)malloc( g->ft_size );
     g->ft_imag = (float *)malloc( g->ft_size );
 
@@ -1090,12 +1546,9 @@ void malloc_ipfb( struct gpu_ipfb_arrays *g, pfb_filter *filter, int nsamples,
 void free_ipfb( struct gpu_ipfb_arrays *g )
 {
     // Free memory on host and device
-    free( g->in_real );
-    free( g->in_imag );
     free( g->ft_real );
     free( g->ft_imag );
-    gpuFree( g->d_in_real );
-    gpuFree( g->d_in_imag );
+    gpuFree( g->d_history );
     gpuFree( g->d_ft_real );
     gpuFree( g->d_ft_imag );
     gpuFree( g->d_out );
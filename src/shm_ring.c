@@ -0,0 +1,161 @@
+/********************************************************
+ *                                                      *
+ * Licensed under the Academic Free License version 3.0 *
+ *                                                      *
+ ********************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "vcsbeam.h"
+
+/**
+ * Creates a ring buffer in POSIX shared memory.
+ *
+ * @param name       The name of the shared memory object (e.g.
+ *                   "/beam.dada"), which must start with a '/'
+ * @param header     The ASCII header describing the data (at most
+ *                   `SHM_RING_HEADER_SIZE` bytes, including the trailing
+ *                   null character)
+ * @param block_size The size (in bytes) of each block
+ * @param nblocks    The number of blocks in the ring
+ *
+ * @return A pointer to a newly allocated `shm_ring`
+ *
+ * Any existing shared memory object of the same name is replaced. The
+ * object (which appears as `/dev/shm/[name]` on Linux) is laid out as:
+ *
+ * 1. A `shm_ring_control` block (padded to `SHM_RING_CONTROL_SIZE` bytes),
+ * 2. The ASCII header (padded to `SHM_RING_HEADER_SIZE` bytes),
+ * 3. `nblocks` blocks of `block_size` bytes each.
+ *
+ * \see vmShmRingWrite()
+ * \see vmFreeShmRing()
+ */
+shm_ring *vmCreateShmRing( const char *name, const char *header, size_t block_size, int nblocks )
+{
+    if (nblocks < 1)
+    {
+        fprintf( stderr, "error: vmCreateShmRing: number of blocks (%d) must "
+                "be >= 1\n", nblocks );
+        exit(EXIT_FAILURE);
+    }
+
+    if (strlen( header ) >= SHM_RING_HEADER_SIZE)
+    {
+        fprintf( stderr, "error: vmCreateShmRing: header (%lu bytes) does not "
+                "fit in %d bytes\n", strlen( header ), SHM_RING_HEADER_SIZE );
+        exit(EXIT_FAILURE);
+    }
+
+    shm_ring *ring = (shm_ring *)malloc( sizeof(shm_ring) );
+
+    ring->name = strdup( name );
+    ring->size = SHM_RING_CONTROL_SIZE + SHM_RING_HEADER_SIZE + nblocks*block_size;
+
+    // Start afresh, in case a previous run left one behind
+    shm_unlink( name );
+
+    int fd = shm_open( name, O_CREAT | O_EXCL | O_RDWR, 0644 );
+    if (fd == -1)
+    {
+        fprintf( stderr, "error: vmCreateShmRing: could not create shared "
+                "memory '%s'\n", name );
+        exit(EXIT_FAILURE);
+    }
+
+    if (ftruncate( fd, ring->size ) != 0)
+    {
+        fprintf( stderr, "error: vmCreateShmRing: could not allocate %lu bytes "
+                "of shared memory for '%s'\n", ring->size, name );
+        exit(EXIT_FAILURE);
+    }
+
+    ring->base = mmap( NULL, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    if (ring->base == MAP_FAILED)
+    {
+        fprintf( stderr, "error: vmCreateShmRing: could not map shared memory "
+                "'%s'\n", name );
+        exit(EXIT_FAILURE);
+    }
+
+    // The mapping stays valid after the descriptor is closed
+    close( fd );
+
+    ring->control = (shm_ring_control *)ring->base;
+    ring->header  = (char *)ring->base + SHM_RING_CONTROL_SIZE;
+    ring->blocks  = (char *)ring->base + SHM_RING_CONTROL_SIZE + SHM_RING_HEADER_SIZE;
+
+    strcpy( ring->header, header );
+
+    ring->control->header_size = SHM_RING_HEADER_SIZE;
+    ring->control->block_size  = block_size;
+    ring->control->nblocks     = nblocks;
+    ring->control->writing     = 0;
+    ring->control->nwritten    = 0;
+    ring->control->finished    = 0;
+
+    return ring;
+}
+
+/**
+ * Writes one block into a shared memory ring buffer.
+ *
+ * @param ring The ring buffer
+ * @param data The data to be written, of size
+ *             `ring&rarr;control&rarr;block_size`
+ *
+ * The writer never waits for readers: block `i` (counting from 0) is
+ * written to slot `i % nblocks`, overwriting whatever was there. Like a
+ * seqlock, `writing` is advanced to `i + 1` (and fenced) *before* the slot
+ * is touched, and `nwritten` is advanced to `i + 1` only once the block is
+ * in place.
+ *
+ * Readers must follow the protocol described with `shm_ring_control` (in
+ * vcsbeam.h) to tell whether a block they copied out was torn.
+ */
+void vmShmRingWrite( shm_ring *ring, const void *data )
+{
+    shm_ring_control *control = ring->control;
+
+    uint64_t i = control->nwritten;
+
+    // Announce the overwrite before any of the slot changes, so that a
+    // reader who copied the old block can tell it might be torn
+    __atomic_store_n( &control->writing, i + 1, __ATOMIC_RELAXED );
+    __atomic_thread_fence( __ATOMIC_SEQ_CST );
+
+    memcpy( ring->blocks + (i % control->nblocks)*control->block_size,
+            data, control->block_size );
+
+    // Make sure the block is in place before it is announced
+    __atomic_store_n( &control->nwritten, i + 1, __ATOMIC_RELEASE );
+}
+
+/**
+ * Marks a shared memory ring buffer as finished, and removes it.
+ *
+ * @param ring The ring buffer to be freed
+ *
+ * `finished` is set, so that readers know no more blocks are coming, and
+ * the name of the shared memory object is removed. Readers that already
+ * have it mapped can carry on reading what is left in it.
+ */
+void vmFreeShmRing( shm_ring *ring )
+{
+    // If there is no ring, silently do nothing
+    if (ring == NULL)
+        return;
+
+    __atomic_store_n( &ring->control->finished, 1, __ATOMIC_RELEASE );
+
+    munmap( ring->base, ring->size );
+    shm_unlink( ring->name );
+
+    free( ring->name );
+    free( ring );
+}
@@ -0,0 +1,609 @@
+/********************************************************
+ *                                                      *
+ * Licensed under the Academic Free License version 3.0 *
+ *                                                      *
+ ********************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <mpi.h>
+
+#include "vcsbeam.h"
+
+/**
+ * Finds the entry of the file containing the given second.
+ *
+ * @param fs              The file stager
+ * @param coarse_chan_idx The (mwalib) idx of the coarse channel
+ * @param gps_second      The GPS second
+ *
+ * @return A pointer to the file's entry, or NULL if it is not being staged
+ *
+ * The caller must hold `fs&rarr;mutex`.
+ */
+static stage_file *vmStagerFindFile( file_stager *fs, int coarse_chan_idx, uint64_t gps_second )
+{
+    int i;
+    for (i = 0; i < fs->nfiles; i++)
+    {
+        stage_file *sf = &(fs->files[i]);
+        if (sf->coarse_chan_idx == coarse_chan_idx &&
+                gps_second >= sf->first_gps &&
+                gps_second < sf->first_gps + fs->seconds_per_file)
+            return sf;
+    }
+
+    return NULL;
+}
+
+/**
+ * Copies a file, a chunk at a time.
+ *
+ * @param fs   The file stager (checked for shutdown between chunks)
+ * @param from The file to copy
+ * @param to   Where to copy it to
+ *
+ * @return `true` if the file was copied, `false` otherwise
+ *
+ * The copy is made under a temporary name, which is only renamed to `to`
+ * once it is complete, so that other processes never see a partial copy.
+ * The original is only read once, so it is dropped from the page cache
+ * afterwards.
+ */
+static bool vmStagerCopyFile( file_stager *fs, const char *from, const char *to )
+{
+    char tmp[2*MAX_COMMAND_LENGTH + 16];
+    sprintf( tmp, "%s.part", to );
+
+    int fd_in = open( from, O_RDONLY );
+    if (fd_in < 0)
+        return false;
+
+    int fd_out = open( tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+    if (fd_out < 0)
+    {
+        close( fd_in );
+        return false;
+    }
+
+    posix_fadvise( fd_in, 0, 0, POSIX_FADV_SEQUENTIAL );
+
+    char *buffer = (char *)malloc( STAGE_COPY_CHUNK_SIZE );
+    bool ok = true;
+    ssize_t nread;
+
+    while ((nread = read( fd_in, buffer, STAGE_COPY_CHUNK_SIZE )) > 0)
+    {
+        char *ptr = buffer;
+        while (nread > 0)
+        {
+            ssize_t nwritten = write( fd_out, ptr, nread );
+            if (nwritten <= 0)
+            {
+                ok = false;
+                break;
+            }
+            ptr   += nwritten;
+            nread -= nwritten;
+        }
+
+        pthread_mutex_lock( &(fs->mutex) );
+        if (fs->shutdown)
+            ok = false;
+        pthread_mutex_unlock( &(fs->mutex) );
+
+        if (!ok)
+            break;
+    }
+
+    if (nread < 0)
+        ok = false;
+
+    posix_fadvise( fd_in, 0, 0, POSIX_FADV_DONTNEED );
+
+    free( buffer );
+    close( fd_in );
+    if (close( fd_out ) != 0)
+        ok = false;
+
+    if (ok && rename( tmp, to ) != 0)
+        ok = false;
+
+    if (!ok)
+        unlink( tmp );
+
+    return ok;
+}
+
+/**
+ * Starts using the local copy of a file, so that no other process deletes
+ * it.
+ *
+ * @param sf The file's entry
+ *
+ * @return `true` if the (complete) local copy is now held, `false` if there
+ *         is none
+ *
+ * Every process using a local copy holds a shared lock on it (via
+ * `sf&rarr;fd`), and a copy is only deleted by a process holding an
+ * exclusive lock (see vmStagerEvict()). Because the copy may have been
+ * deleted between being opened and being locked, the locked file is
+ * checked to still be the one at `sf&rarr;local_path`.
+ */
+static bool vmStagerHoldCopy( stage_file *sf )
+{
+    int fd = open( sf->local_path, O_RDONLY );
+    if (fd < 0)
+        return false;
+
+    struct stat st_fd, st_path;
+    if (flock( fd, LOCK_SH ) != 0 ||
+            fstat( fd, &st_fd ) != 0 ||
+            stat( sf->local_path, &st_path ) != 0 ||
+            st_fd.st_dev != st_path.st_dev ||
+            st_fd.st_ino != st_path.st_ino ||
+            (size_t)st_fd.st_size != sf->size)
+    {
+        close( fd );
+        return false;
+    }
+
+    sf->fd = fd;
+    return true;
+}
+
+/**
+ * Makes a local copy of a file, unless another process already has.
+ *
+ * @param fs The file stager
+ * @param sf The file's entry
+ *
+ * @return The file's new state (`STAGE_STAGED` or `STAGE_SKIPPED`)
+ *
+ * Processes on the same node (e.g. the ranks of one job, or several jobs
+ * processing the same observation) share the scratch directory. A process
+ * only copies a file once it has claimed it, by creating a lock file next
+ * to the local copy. If the lock is already held, it waits (for up to
+ * `STAGE_LOCK_TIMEOUT` seconds) for the other process to finish, and then
+ * uses its copy. Either way, the copy is held (see vmStagerHoldCopy())
+ * until this process has finished with it.
+ *
+ * This is called without holding `fs&rarr;mutex`.
+ */
+static stage_state vmStagerClaimFile( file_stager *fs, stage_file *sf )
+{
+    char lock_path[2*MAX_COMMAND_LENGTH + 16];
+    sprintf( lock_path, "%s.lock", sf->local_path );
+
+    struct stat st;
+    int waited;
+    for (waited = 0; waited <= STAGE_LOCK_TIMEOUT; waited++)
+    {
+        // Is there a finished copy already? (If it disappears before it
+        // can be held, it will have to be copied again)
+        if (stat( sf->local_path, &st ) == 0 && (size_t)st.st_size == sf->size &&
+                vmStagerHoldCopy( sf ))
+            return STAGE_STAGED;
+
+        int fd = open( lock_path, O_WRONLY | O_CREAT | O_EXCL, 0644 );
+        if (fd >= 0)
+        {
+            close( fd );
+            bool ok = vmStagerCopyFile( fs, sf->remote_path, sf->local_path ) &&
+                vmStagerHoldCopy( sf );
+            unlink( lock_path );
+
+            return (ok ? STAGE_STAGED : STAGE_SKIPPED);
+        }
+
+        if (errno != EEXIST)
+            return STAGE_SKIPPED;
+
+        // Someone else is copying it
+        sleep( 1 );
+    }
+
+    return STAGE_SKIPPED;
+}
+
+/**
+ * Removes a consumed file from local storage.
+ *
+ * @param fs The file stager
+ * @param sf The file's entry
+ *
+ * This process stops holding the local copy, which is deleted unless
+ * another process (e.g. another job processing the same observation) is
+ * still holding it, in which case it is left for that process to delete.
+ * (If two processes let go of a copy at the same moment, they may both
+ * leave it, in which case it is only left behind in the scratch directory.)
+ * The caller must hold `fs&rarr;mutex`.
+ */
+static void vmStagerEvict( file_stager *fs, stage_file *sf )
+{
+    if (sf->fd >= 0)
+    {
+        if (flock( sf->fd, LOCK_EX | LOCK_NB ) == 0)
+            unlink( sf->local_path );
+
+        close( sf->fd );
+        sf->fd = -1;
+    }
+
+    fs->used -= sf->size;
+    sf->state = STAGE_EVICTED;
+}
+
+/**
+ * The main loop of a file stager's copying threads.
+ *
+ * @param arg A pointer to the `file_stager`
+ *
+ * Each thread repeatedly takes the first file (in the order in which files
+ * will be needed) that is still waiting to be copied and has not yet been
+ * read from its original location. If copying it would exceed the budget,
+ * the least recently used file that has been fully consumed is evicted
+ * first; if there is none, the thread waits until one is consumed.
+ */
+static void *vmStagerWorker( void *arg )
+{
+    file_stager *fs = (file_stager *)arg;
+
+    pthread_mutex_lock( &(fs->mutex) );
+
+    while (!fs->shutdown)
+    {
+        // Find the next file to copy
+        stage_file *sf = NULL;
+        int i;
+        for (i = 0; i < fs->nfiles; i++)
+        {
+            if (fs->files[i].state == STAGE_PENDING &&
+                    !fs->files[i].started &&
+                    fs->files[i].nreads_left > 0)
+            {
+                sf = &(fs->files[i]);
+                break;
+            }
+        }
+
+        // Nothing left to do
+        if (sf == NULL)
+            break;
+
+        if (sf->size > fs->budget)
+        {
+            sf->state = STAGE_SKIPPED;
+            continue;
+        }
+
+        if (fs->used + sf->size > fs->budget)
+        {
+            // Make room by evicting the least recently used consumed file
+            stage_file *lru = NULL;
+            for (i = 0; i < fs->nfiles; i++)
+            {
+                stage_file *f = &(fs->files[i]);
+                if (f->state == STAGE_STAGED && f->nreads_left == 0 &&
+                        (lru == NULL || f->last_used < lru->last_used))
+                    lru = f;
+            }
+
+            if (lru != NULL)
+                vmStagerEvict( fs, lru );
+            else
+                pthread_cond_wait( &(fs->changed), &(fs->mutex) );
+
+            continue;
+        }
+
+        sf->state = STAGE_COPYING;
+        fs->used += sf->size;
+        pthread_mutex_unlock( &(fs->mutex) );
+
+        stage_state state = vmStagerClaimFile( fs, sf );
+
+        pthread_mutex_lock( &(fs->mutex) );
+        sf->state = state;
+        if (state != STAGE_STAGED)
+            fs->used -= sf->size;
+        pthread_cond_broadcast( &(fs->changed) );
+    }
+
+    pthread_mutex_unlock( &(fs->mutex) );
+
+    return NULL;
+}
+
+/**
+ * Set up a stager that copies the input files to local storage ahead of
+ * time.
+ *
+ * @param vm          The VCSBeam context struct
+ * @param scratch_dir A (node-local) directory to copy the files to
+ * @param budget      The most bytes to have staged at once (per node)
+ * @param nthreads    The number of files to copy at once (per node)
+ * @param nsegments   The number of time segments each coarse channel's
+ *                    seconds are split into (1 if they are read straight
+ *                    through)
+ *
+ * The input files usually live on a slow, shared filesystem. Once this is
+ * called, `nthreads` background threads copy the files containing
+ * `vm&rarr;gps_seconds_to_process` (for all the coarse channels being
+ * processed) to `scratch_dir`, in the order they will be needed, while
+ * keeping no more than `budget` bytes staged at once. Files whose seconds
+ * have all been read are evicted, least recently used first, to make room.
+ *
+ * If the seconds are split into `nsegments` (nearly) equal segments, with
+ * segment `s` starting at idx `(s * nseconds) / nsegments`, then every
+ * segment after the first is assumed to also read the second just before
+ * it, to fill the PFB's filter history (as in fine_pfb_offline). Those
+ * seconds are read twice, so their files are not evicted until both
+ * reads are done.
+ *
+ * Reads of a staged file (see vmReadSeconds()) go to the local copy, and
+ * reads of a file that is still being copied wait for the copy to finish.
+ * Files that the copying threads have not got to yet are read from their
+ * original location as normal (and are then not copied at all).
+ *
+ * If `vm` uses MPI, this must be called by all ranks. The ranks on each
+ * node share the budget and the copying threads equally between them, and
+ * never copy the same file twice (see vmStagerClaimFile()).
+ *
+ * Channel contexts created afterwards with vmInitChannelContext() share
+ * the parent's stager.
+ *
+ * \see vmStagerGetPath()
+ * \see vmStagerConsumeSecond()
+ * \see vmFreeStager()
+ */
+void vmInitStager( vcsbeam_context *vm, const char *scratch_dir, size_t budget, int nthreads, int nsegments )
+{
+    if (nthreads < 1)
+    {
+        fprintf( stderr, "error: vmInitStager: number of threads (%d) must "
+                "be >= 1\n", nthreads );
+        exit(EXIT_FAILURE);
+    }
+
+    if (vm->zstd != NULL)
+    {
+        fprintf( stderr, "error: vmInitStager: cannot be used with "
+                "compressed input files\n" );
+        exit(EXIT_FAILURE);
+    }
+
+    struct stat st;
+    if (stat( scratch_dir, &st ) != 0 || !S_ISDIR(st.st_mode))
+    {
+        fprintf( stderr, "error: vmInitStager: '%s' is not a directory\n",
+                scratch_dir );
+        exit(EXIT_FAILURE);
+    }
+
+    // Share the node's budget and copying threads between the ranks on it
+    int node_size = 1;
+    if (vm->use_mpi)
+    {
+        MPI_Comm node_comm;
+        MPI_Comm_split_type( MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, vm->mpi_rank,
+                MPI_INFO_NULL, &node_comm );
+        MPI_Comm_size( node_comm, &node_size );
+        MPI_Comm_free( &node_comm );
+    }
+
+    file_stager *fs = (file_stager *)malloc( sizeof(file_stager) );
+
+    fs->scratch_dir = (char *)malloc( strlen( scratch_dir ) + 1 );
+    strcpy( fs->scratch_dir, scratch_dir );
+
+    fs->budget           = budget / node_size;
+    fs->used             = 0;
+    fs->clock            = 0;
+    fs->seconds_per_file = vm->seconds_per_file;
+    fs->nthreads         = (nthreads / node_size > 0 ? nthreads / node_size : 1);
+    fs->shutdown         = false;
+    fs->log              = vm->log;
+
+    // List the files in the order they will be needed: each second, for
+    // each coarse channel in turn
+    fs->files  = (stage_file *)malloc( vm->num_gps_seconds_to_process *
+            vm->num_coarse_chans_to_process * sizeof(stage_file) );
+    fs->nfiles = 0;
+
+    char path[2*MAX_COMMAND_LENGTH];
+    char filename[MAX_COMMAND_LENGTH];
+    uint64_t t0_gps_second = vm->obs_metadata->metafits_timesteps[0].gps_time_ms/1000;
+
+    unsigned int t;
+    int c;
+    for (t = 0; t < vm->num_gps_seconds_to_process; t++)
+    {
+        uint64_t gps_second = vm->gps_seconds_to_process[t];
+        uint64_t first_gps  = t0_gps_second +
+            ((gps_second - t0_gps_second) / vm->seconds_per_file) * vm->seconds_per_file;
+
+        for (c = 0; c < vm->num_coarse_chans_to_process; c++)
+        {
+            int coarse_chan_idx = vm->coarse_chan_idxs_to_process[c];
+
+            stage_file *sf = vmStagerFindFile( fs, coarse_chan_idx, gps_second );
+            if (sf != NULL)
+            {
+                sf->nreads_left++;
+                continue;
+            }
+
+            sf = &(fs->files[fs->nfiles]);
+            fs->nfiles++;
+
+            memset( filename, 0, MAX_COMMAND_LENGTH );
+            vmGetVoltFilename( vm, coarse_chan_idx, first_gps, filename );
+            sprintf( path, "%s/%s", vm->datadir, filename );
+
+            if (stat( path, &st ) != 0)
+            {
+                fprintf( stderr, "error: vmInitStager: cannot find '%s'\n", path );
+                exit(EXIT_FAILURE);
+            }
+
+            sf->coarse_chan_idx = coarse_chan_idx;
+            sf->first_gps       = first_gps;
+            sf->size            = st.st_size;
+            sf->state           = STAGE_PENDING;
+            sf->fd              = -1;
+            sf->started         = false;
+            sf->nreads_left     = 1;
+            sf->last_used       = 0;
+
+            sf->remote_path = (char *)malloc( strlen( path ) + 1 );
+            strcpy( sf->remote_path, path );
+
+            sf->local_path = (char *)malloc( strlen( fs->scratch_dir ) + strlen( basename( path ) ) + 2 );
+            sprintf( sf->local_path, "%s/%s", fs->scratch_dir, basename( path ) );
+        }
+    }
+
+    // Count the extra reads of the seconds that prime each segment
+    int s;
+    for (s = 1; s < nsegments; s++)
+    {
+        t = (s * vm->num_gps_seconds_to_process) / nsegments;
+        if (t == 0)
+            continue;
+
+        for (c = 0; c < vm->num_coarse_chans_to_process; c++)
+        {
+            stage_file *sf = vmStagerFindFile( fs, vm->coarse_chan_idxs_to_process[c],
+                    vm->gps_seconds_to_process[t - 1] );
+            if (sf != NULL)
+                sf->nreads_left++;
+        }
+    }
+
+    pthread_mutex_init( &(fs->mutex), NULL );
+    pthread_cond_init( &(fs->changed), NULL );
+
+    sprintf( vm->log_message, "Staging %d file(s) in '%s' with %d thread(s), "
+            "using up to %.1f GiB", fs->nfiles, fs->scratch_dir, fs->nthreads,
+            fs->budget / (double)(1 << 30) );
+    logger_timed_message( vm->log, vm->log_message );
+
+    fs->threads = (pthread_t *)malloc( fs->nthreads * sizeof(pthread_t) );
+    for (t = 0; t < (unsigned int)fs->nthreads; t++)
+        pthread_create( &(fs->threads[t]), NULL, vmStagerWorker, fs );
+
+    vm->stager = fs;
+}
+
+/**
+ * Gets the path to read a voltage file from.
+ *
+ * @param         fs              The file stager
+ * @param         coarse_chan_idx The (mwalib) idx of the file's coarse channel
+ * @param         gps_second      A GPS second in the file
+ * @param[in,out] path            The file's original path, which is replaced
+ *                                by the path of its local copy if it has been
+ *                                staged (this must be a buffer of at least
+ *                                2*MAX_COMMAND_LENGTH bytes)
+ *
+ * If the file is being copied, this waits for the copy to finish. If the
+ * file has not been copied yet, it is marked as no longer worth copying,
+ * and the original path is left as is.
+ */
+void vmStagerGetPath( file_stager *fs, int coarse_chan_idx, uint64_t gps_second, char *path )
+{
+    pthread_mutex_lock( &(fs->mutex) );
+
+    stage_file *sf = vmStagerFindFile( fs, coarse_chan_idx, gps_second );
+    if (sf != NULL)
+    {
+        while (sf->state == STAGE_COPYING)
+            pthread_cond_wait( &(fs->changed), &(fs->mutex) );
+
+        if (sf->state == STAGE_STAGED)
+            strcpy( path, sf->local_path );
+        else
+            sf->started = true;
+
+        sf->last_used = ++fs->clock;
+    }
+
+    pthread_mutex_unlock( &(fs->mutex) );
+}
+
+/**
+ * Marks one second of a voltage file as having been read.
+ *
+ * @param fs              The file stager
+ * @param coarse_chan_idx The (mwalib) idx of the file's coarse channel
+ * @param gps_second      The GPS second that was read
+ *
+ * Once all of a file's seconds have been read, its local copy (if any) can
+ * be evicted.
+ */
+void vmStagerConsumeSecond( file_stager *fs, int coarse_chan_idx, uint64_t gps_second )
+{
+    pthread_mutex_lock( &(fs->mutex) );
+
+    stage_file *sf = vmStagerFindFile( fs, coarse_chan_idx, gps_second );
+    if (sf != NULL && sf->nreads_left > 0)
+    {
+        sf->nreads_left--;
+        sf->last_used = ++fs->clock;
+        if (sf->nreads_left == 0)
+            pthread_cond_broadcast( &(fs->changed) );
+    }
+
+    pthread_mutex_unlock( &(fs->mutex) );
+}
+
+/**
+ * Stop staging files, and remove the local copies.
+ *
+ * @param vm The VCSBeam context struct
+ */
+void vmFreeStager( vcsbeam_context *vm )
+{
+    file_stager *fs = vm->stager;
+
+    // If there is no stager, silently do nothing
+    if (fs == NULL)
+        return;
+
+    pthread_mutex_lock( &(fs->mutex) );
+    fs->shutdown = true;
+    pthread_cond_broadcast( &(fs->changed) );
+    pthread_mutex_unlock( &(fs->mutex) );
+
+    int i;
+    for (i = 0; i < fs->nthreads; i++)
+        pthread_join( fs->threads[i], NULL );
+
+    for (i = 0; i < fs->nfiles; i++)
+    {
+        if (fs->files[i].state == STAGE_STAGED)
+            vmStagerEvict( fs, &(fs->files[i]) );
+
+        free( fs->files[i].remote_path );
+        free( fs->files[i].local_path );
+    }
+
+    pthread_mutex_destroy( &(fs->mutex) );
+    pthread_cond_destroy( &(fs->changed) );
+
+    free( fs->threads );
+    free( fs->files );
+    free( fs->scratch_dir );
+    free( fs );
+
+    vm->stager = NULL;
+}